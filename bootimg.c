@@ -0,0 +1,616 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+
+#include "config.h"
+
+#ifdef USE_BOOTIMG
+#include "util.h"
+#include "imgread.h"
+#include "bootimg.h"
+
+/* Values from linux/memfd.h and linux/fcntl.h */
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		(1024 + 9)
+#define F_SEAL_SEAL		0x0001
+#define F_SEAL_SHRINK	0x0002
+#define F_SEAL_GROW		0x0004
+#define F_SEAL_WRITE	0x0008
+#endif
+
+#define ALIGN(x, a)		(((x) + (a) - 1) / (a) * (a))
+
+/* Android boot image header v0-v2 */
+#define ANDROID_MAGIC		"ANDROID!"
+#define ANDROID_MAGIC_SIZE	8
+
+struct android_hdr {
+	char magic[ANDROID_MAGIC_SIZE];
+	uint32_t kernel_size;
+	uint32_t kernel_addr;
+	uint32_t ramdisk_size;
+	uint32_t ramdisk_addr;
+	uint32_t second_size;
+	uint32_t second_addr;
+	uint32_t tags_addr;
+	uint32_t page_size;
+	uint32_t header_version;	/* Was unused or dt_size in old images */
+	uint32_t os_version;
+	char name[16];
+	char cmdline[512];
+	uint32_t id[8];
+	char extra_cmdline[1024];
+	/* v1 */
+	uint32_t recovery_dtbo_size;
+	uint64_t recovery_dtbo_offset;
+	uint32_t header_size;
+	/* v2 */
+	uint32_t dtb_size;
+	uint64_t dtb_addr;
+} __attribute__((packed));
+
+/* Android boot image header v3 and v4 */
+#define ANDROID_V3_PAGE_SIZE	4096
+
+struct android_hdr_v3 {
+	char magic[ANDROID_MAGIC_SIZE];
+	uint32_t kernel_size;
+	uint32_t ramdisk_size;
+	uint32_t os_version;
+	uint32_t header_size;
+	uint32_t reserved[4];
+	uint32_t header_version;
+	char cmdline[1536];
+} __attribute__((packed));
+
+/* Flattened device tree (FIT is device tree too) */
+#define FDT_MAGIC		0xd00dfeed
+#define FDT_BEGIN_NODE	1
+#define FDT_END_NODE	2
+#define FDT_PROP		3
+#define FDT_NOP			4
+#define FDT_END			9
+
+/* Deepest path we look for (/configurations/conf-1) */
+#define FDT_MAX_DEPTH	2
+#define FDT_MAX_NAME	64
+
+struct fdt_header {
+	uint32_t magic;
+	uint32_t totalsize;
+	uint32_t off_dt_struct;
+	uint32_t off_dt_strings;
+	uint32_t off_mem_rsvmap;
+	uint32_t version;
+	uint32_t last_comp_version;
+	uint32_t boot_cpuid_phys;
+	uint32_t size_dt_strings;
+	uint32_t size_dt_struct;
+};
+
+struct fdt_t {
+	const char *blob;
+	uint32_t size;
+	uint32_t off_struct, size_struct;
+	uint32_t off_strings, size_strings;
+};
+
+/* Position of part in image before it is mapped */
+struct part_pos_t {
+	size_t off;
+	size_t len;
+};
+
+struct layout_t {
+	size_t total;				/* Bytes to map */
+	struct part_pos_t kernel, ramdisk, dtb;
+};
+
+
+int bootimg_fstype(const char *fstype)
+{
+	return fstype && ( !strcmp(fstype, BOOTIMG_FSTYPE_ANDROID)
+			|| !strcmp(fstype, BOOTIMG_FSTYPE_FIT) );
+}
+
+
+/* Size of file or block device */
+static int get_size(int fd, unsigned long long *size)
+{
+	struct stat st;
+	uint64_t bytes;
+
+	if (-1 == fstat(fd, &st)) return -1;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (-1 == ioctl(fd, BLKGETSIZE64, &bytes)) return -1;
+		*size = bytes;
+	} else {
+		*size = st.st_size;
+	}
+
+	return 0;
+}
+
+
+/* Copy NUL-terminated string from fixed-size fields (b may be NULL) */
+static char *join_fields(const char *a, size_t alen, const char *b, size_t blen)
+{
+	size_t la, lb = 0;
+	char *s;
+
+	la = strnlen(a, alen);
+	if (b) lb = strnlen(b, blen);
+	if (0 == la + lb) return NULL;
+
+	s = malloc(la + lb + 1);
+	if (NULL == s) return NULL;
+
+	memcpy(s, a, la);
+	if (lb) memcpy(s + la, b, lb);
+	s[la + lb] = '\0';
+	return s;
+}
+
+
+static int android_layout(kx_bootimg *img, const char *head,
+		struct layout_t *l)
+{
+	const struct android_hdr *h = (const struct android_hdr *)head;
+	const struct android_hdr_v3 *h3 = (const struct android_hdr_v3 *)head;
+	uint32_t ver, ps;
+	size_t pos;
+
+	ver = le32toh(h->header_version);
+
+	if (3 == ver || 4 == ver) {
+		/* Fixed page size, no second stage and dtb */
+		ps = ANDROID_V3_PAGE_SIZE;
+		l->kernel.off = ps;
+		l->kernel.len = le32toh(h3->kernel_size);
+		l->ramdisk.off = l->kernel.off + ALIGN(l->kernel.len, ps);
+		l->ramdisk.len = le32toh(h3->ramdisk_size);
+		l->total = l->ramdisk.off + ALIGN(l->ramdisk.len, ps);
+
+		img->cmdline = join_fields(h3->cmdline, sizeof(h3->cmdline), NULL, 0);
+		return 0;
+	}
+
+	/* Old Qualcomm images have dt_size in place of version */
+	if (ver > 4) ver = 0;
+
+	ps = le32toh(h->page_size);
+	if (ps < 2048 || ps > 65536 || (ps & (ps - 1))) {
+		log_msg(lg, "+ wrong page size %u of boot image", ps);
+		return -1;
+	}
+
+	l->kernel.off = ps;
+	l->kernel.len = le32toh(h->kernel_size);
+	l->ramdisk.off = l->kernel.off + ALIGN(l->kernel.len, ps);
+	l->ramdisk.len = le32toh(h->ramdisk_size);
+	pos = l->ramdisk.off + ALIGN(l->ramdisk.len, ps);
+	pos += ALIGN(le32toh(h->second_size), ps);
+	if (ver >= 1) pos += ALIGN(le32toh(h->recovery_dtbo_size), ps);
+	if (ver >= 2) {
+		l->dtb.off = pos;
+		l->dtb.len = le32toh(h->dtb_size);
+		pos += ALIGN(l->dtb.len, ps);
+	}
+	l->total = pos;
+
+	/* Cmdline is split between two fields */
+	img->cmdline = join_fields(h->cmdline, sizeof(h->cmdline),
+			h->extra_cmdline, sizeof(h->extra_cmdline));
+	img->name = join_fields(h->name, sizeof(h->name), NULL, 0);
+	return 0;
+}
+
+
+static int fdt_init(struct fdt_t *f, const char *blob, size_t len)
+{
+	const struct fdt_header *h = (const struct fdt_header *)blob;
+
+	if (len < sizeof(*h) || FDT_MAGIC != ntohl(h->magic)) return -1;
+
+	f->blob = blob;
+	f->size = ntohl(h->totalsize);
+	f->off_struct = ntohl(h->off_dt_struct);
+	f->size_struct = ntohl(h->size_dt_struct);
+	f->off_strings = ntohl(h->off_dt_strings);
+	f->size_strings = ntohl(h->size_dt_strings);
+
+	if (f->size > len || f->off_struct > f->size
+			|| f->size_struct > f->size - f->off_struct
+			|| f->off_strings > f->size
+			|| f->size_strings > f->size - f->off_strings
+	) return -1;
+
+	return 0;
+}
+
+
+/* Find property 'prop' of node 'path' ("/", "/images/kernel").
+ * Return its value or NULL */
+static const char *fdt_getprop(const struct fdt_t *f, const char *path,
+		const char *prop, uint32_t *plen)
+{
+	char comps[FDT_MAX_DEPTH][FDT_MAX_NAME];
+	const char *blob = f->blob, *name, *s;
+	uint32_t p, end, tag, len, nameoff;
+	int ncomp = 0, level = -1, matched = 0;
+	size_t n;
+
+	/* Split path to components */
+	while (*path) {
+		while ('/' == *path) ++path;
+		if (!*path) break;
+		n = strcspn(path, "/");
+		if (ncomp >= FDT_MAX_DEPTH || n >= FDT_MAX_NAME) return NULL;
+		memcpy(comps[ncomp], path, n);
+		comps[ncomp++][n] = '\0';
+		path += n;
+	}
+
+	p = f->off_struct;
+	end = f->off_struct + f->size_struct;
+
+	while (p + 4 <= end) {
+		tag = ntohl(*(const uint32_t *)(blob + p));
+		p += 4;
+
+		switch (tag) {
+		case FDT_BEGIN_NODE:
+			name = blob + p;
+			n = strnlen(name, end - p);
+			if (n == end - p) return NULL;
+			p += ALIGN(n + 1, 4);
+
+			++level;
+			if ( (level > 0) && (matched == level - 1) && (level <= ncomp)
+					&& !strcmp(name, comps[level - 1]) )
+				matched = level;
+			break;
+
+		case FDT_END_NODE:
+			if (level < 0) return NULL;
+			/* Node of path is over. Property is not found */
+			if (level == ncomp && matched == ncomp) return NULL;
+			if (level > 0 && matched == level) matched = level - 1;
+			--level;
+			break;
+
+		case FDT_PROP:
+			if (p + 8 > end) return NULL;
+			len = ntohl(*(const uint32_t *)(blob + p));
+			nameoff = ntohl(*(const uint32_t *)(blob + p + 4));
+			p += 8;
+			if (len > end - p || nameoff >= f->size_strings) return NULL;
+
+			if (level == ncomp && matched == ncomp) {
+				s = blob + f->off_strings + nameoff;
+				if ( (strnlen(s, f->size_strings - nameoff) < f->size_strings - nameoff)
+						&& !strcmp(s, prop) )
+				{
+					*plen = len;
+					return blob + p;
+				}
+			}
+			p += ALIGN(len, 4);
+			break;
+
+		case FDT_NOP:
+			break;
+
+		default:	/* FDT_END or garbage */
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Return string property or NULL */
+static const char *fdt_getstr(const struct fdt_t *f, const char *path,
+		const char *prop)
+{
+	const char *s;
+	uint32_t len;
+
+	s = fdt_getprop(f, path, prop, &len);
+	if (NULL == s || 0 == len || '\0' != s[len - 1]) return NULL;
+	return s;
+}
+
+
+/* Find data of FIT image named by property 'prop' of configuration */
+static int fit_part(const struct fdt_t *f, const char *conf, const char *prop,
+		int raw, struct part_pos_t *part)
+{
+	char path[FDT_MAX_NAME + 16];
+	const char *name, *comp, *data;
+	uint32_t len;
+
+	name = fdt_getstr(f, conf, prop);
+	if (NULL == name) return 0;		/* Part is optional */
+	if (strlen(name) >= FDT_MAX_NAME) return -1;
+	sprintf(path, "/images/%s", name);
+
+	/* Only kernels which unpack themselves are loaded as is */
+	comp = fdt_getstr(f, path, "compression");
+	if (raw && comp && strcmp(comp, "none")) {
+		log_msg(lg, "+ FIT image %s is compressed by %s", name, comp);
+		return -1;
+	}
+
+	data = fdt_getprop(f, path, "data", &len);
+	if (data) {
+		part->off = data - f->blob;
+		part->len = len;
+		return 0;
+	}
+
+	/* External data is placed after device tree */
+	data = fdt_getprop(f, path, "data-size", &len);
+	if (NULL == data || 4 != len) return -1;
+	part->len = ntohl(*(const uint32_t *)data);
+
+	data = fdt_getprop(f, path, "data-offset", &len);
+	if (data && 4 == len) {
+		part->off = ALIGN(f->size, 4) + ntohl(*(const uint32_t *)data);
+		return 0;
+	}
+
+	data = fdt_getprop(f, path, "data-position", &len);
+	if (data && 4 == len) {
+		part->off = ntohl(*(const uint32_t *)data);
+		return 0;
+	}
+
+	return -1;
+}
+
+
+static int fit_layout(kx_bootimg *img, struct layout_t *l)
+{
+	struct fdt_t f;
+	char conf[FDT_MAX_NAME + 16];
+	const char *s;
+	size_t end;
+
+	if (-1 == fdt_init(&f, img->map, img->maplen)) return -1;
+
+	s = fdt_getstr(&f, "/configurations", "default");
+	if (NULL == s || strlen(s) >= FDT_MAX_NAME) {
+		log_msg(lg, "+ FIT has no default configuration");
+		return -1;
+	}
+	sprintf(conf, "/configurations/%s", s);
+
+	if ( -1 == fit_part(&f, conf, "kernel", 1, &l->kernel)
+			|| -1 == fit_part(&f, conf, "ramdisk", 0, &l->ramdisk)
+			|| -1 == fit_part(&f, conf, "fdt", 1, &l->dtb) )
+		return -1;
+
+	s = fdt_getstr(&f, "/", "description");
+	if (NULL == s) s = fdt_getstr(&f, conf, "description");
+	if (s) img->name = strdup(s);
+
+	/* External data may be out of mapped device tree */
+	l->total = f.size;
+	end = l->kernel.off + l->kernel.len;
+	if (end > l->total) l->total = end;
+	end = l->ramdisk.off + l->ramdisk.len;
+	if (end > l->total) l->total = end;
+	end = l->dtb.off + l->dtb.len;
+	if (end > l->total) l->total = end;
+
+	return 0;
+}
+
+
+static int map_image(kx_bootimg *img, int fd, size_t len)
+{
+	if (img->map) munmap(img->map, img->maplen);
+
+	img->maplen = len;
+	img->map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == img->map) {
+		img->map = NULL;
+		log_msg(lg, "+ can't map boot image: %s", ERRMSG);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void set_part(kx_bootimg *img, struct bootimg_part_t *part,
+		struct part_pos_t *pos)
+{
+	part->data = pos->len ? (const char *)img->map + pos->off : NULL;
+	part->len = pos->len;
+}
+
+
+kx_bootimg *bootimg_open(int fd)
+{
+	char head[sizeof(struct android_hdr)];
+	const struct fdt_header *fh = (const struct fdt_header *)head;
+	unsigned long long size;
+	struct layout_t l;
+	kx_bootimg *img;
+
+	if (-1 == get_size(fd, &size)) return NULL;
+	if (sizeof(head) != pread(fd, head, sizeof(head), 0)) return NULL;
+
+	img = malloc(sizeof(*img));
+	if (NULL == img) return NULL;
+	memset(img, 0, sizeof(*img));
+	memset(&l, 0, sizeof(l));
+
+	if (!memcmp(head, ANDROID_MAGIC, ANDROID_MAGIC_SIZE)) {
+		img->type = BOOTIMG_FSTYPE_ANDROID;
+		if (-1 == android_layout(img, head, &l)) goto fail;
+		if (l.total > size) goto truncated;
+		if (-1 == map_image(img, fd, l.total)) goto fail;
+
+	} else if (FDT_MAGIC == ntohl(fh->magic)) {
+		img->type = BOOTIMG_FSTYPE_FIT;
+		if (ntohl(fh->totalsize) > size) goto truncated;
+		if (-1 == map_image(img, fd, ntohl(fh->totalsize))) goto fail;
+		if (-1 == fit_layout(img, &l)) goto fail;
+		if (l.total > size) goto truncated;
+		if ( (l.total > img->maplen) && (-1 == map_image(img, fd, l.total)) )
+			goto fail;
+
+	} else {
+		goto fail;
+	}
+
+	if (0 == l.kernel.len) {
+		log_msg(lg, "+ boot image has no kernel");
+		goto fail;
+	}
+
+	set_part(img, &img->kernel, &l.kernel);
+	set_part(img, &img->ramdisk, &l.ramdisk);
+	set_part(img, &img->dtb, &l.dtb);
+
+	/* Parts are read sequentially */
+	madvise(img->map, img->maplen, MADV_SEQUENTIAL);
+	return img;
+
+truncated:
+	log_msg(lg, "+ boot image is truncated");
+fail:
+	bootimg_close(img);
+	return NULL;
+}
+
+
+void bootimg_close(kx_bootimg *img)
+{
+	if (NULL == img) return;
+	if (img->map) munmap(img->map, img->maplen);
+	dispose(img->cmdline);
+	dispose(img->name);
+	free(img);
+}
+
+
+int bootimg_part_fd(const struct bootimg_part_t *part, const char *name)
+{
+	unsigned long long start = msec_now();
+	const char *p = part->data;
+	size_t left = part->len;
+	char path[32];
+	ssize_t n;
+	int mfd, rfd = -1;
+
+#ifdef __NR_memfd_create
+	mfd = syscall(__NR_memfd_create, name, MFD_ALLOW_SEALING);
+#else
+	mfd = -1;
+	errno = ENOSYS;
+#endif
+	if (mfd < 0) {
+		log_msg(lg, "Can't create memfd for %s: %s", name, ERRMSG);
+		return -1;
+	}
+
+	/* Pages of mapping go to memfd directly */
+	while (left > 0) {
+		n = write(mfd, p, left);
+		if (n <= 0) {
+			if (n < 0 && EINTR == errno) continue;
+			log_msg(lg, "Can't copy %s: %s", name, ERRMSG);
+			goto close;
+		}
+		p += n;
+		left -= n;
+	}
+
+	if (-1 == fcntl(mfd, F_ADD_SEALS,
+			F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+		log_msg(lg, "Can't seal %s: %s", name, ERRMSG);
+		goto close;
+	}
+
+	/* kexec_file_load() refuses files opened for writing */
+	sprintf(path, "/proc/self/fd/%d", mfd);
+	rfd = open(path, O_RDONLY);
+	if (rfd < 0) log_msg(lg, "Can't reopen %s: %s", name, ERRMSG);
+	else imgread_report(name, part->len, msec_now() - start);
+
+close:
+	close(mfd);
+	return rfd;
+}
+
+
+int bootimg_bootinfo(struct cfgdata_t *cfgdata, const char *device)
+{
+	kx_cfg_section *sc;
+	kx_bootimg *img;
+	int fd;
+
+	init_cfgdata(cfgdata);
+	if (NULL == cfgdata->list) return -1;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		log_msg(lg, "+ can't open device %s: %s", device, ERRMSG);
+		return -1;
+	}
+	img = bootimg_open(fd);
+	close(fd);
+	if (NULL == img) return -1;
+
+	log_msg(lg, "+ %s boot image found", img->type);
+
+	/* Kernel is device itself, nothing is mounted */
+	sc = cfg_section_new(cfgdata);
+	if (sc) {
+		sc->label = strdup(img->name ? img->name : device);
+		sc->kernelpath = strdup(device);
+	}
+
+	bootimg_close(img);
+	return sc ? 0 : -1;
+}
+
+#endif	/* USE_BOOTIMG */
@@ -0,0 +1,68 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_BOOTIMG_H_
+#define _HAVE_BOOTIMG_H_
+
+#include <stddef.h>
+#include "config.h"
+#include "cfgparser.h"
+
+/*
+ * Boot image containers: Android boot.img (header v0-v4) and FIT.
+ * Image is memory-mapped, its parts are slices of mapping.
+ */
+
+/* Names used as fstype of raw partitions with boot images */
+#define BOOTIMG_FSTYPE_ANDROID	"bootimg"
+#define BOOTIMG_FSTYPE_FIT		"fit"
+
+/* Part of image (len 0 - missing) */
+struct bootimg_part_t {
+	const char *data;
+	size_t len;
+};
+
+typedef struct {
+	void *map;
+	size_t maplen;
+	const char *type;				/* BOOTIMG_FSTYPE_* */
+	struct bootimg_part_t kernel;
+	struct bootimg_part_t ramdisk;
+	struct bootimg_part_t dtb;
+	char *cmdline;					/* Embedded cmdline (NULL - none) */
+	char *name;						/* Image name (NULL - none) */
+} kx_bootimg;
+
+/* Check that fstype is boot image container */
+int bootimg_fstype(const char *fstype);
+
+/* Map image from opened file or device. Return NULL when it is not
+ * boot image container or it is broken */
+kx_bootimg *bootimg_open(int fd);
+
+/* Unmap image */
+void bootimg_close(kx_bootimg *img);
+
+/* Copy part of image into sealed read-only memfd for loaders which
+ * need file descriptor. Return descriptor or -1 */
+int bootimg_part_fd(const struct bootimg_part_t *part, const char *name);
+
+/* Fill cfgdata with single section for boot image on raw device */
+int bootimg_bootinfo(struct cfgdata_t *cfgdata, const char *device);
+
+#endif /* _HAVE_BOOTIMG_H_ */
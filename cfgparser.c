@@ -23,6 +23,7 @@
 #include <sys/mount.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "util.h"
@@ -64,6 +65,14 @@ kx_cfg_section *cfg_section_new(struct cfgdata_t *cfgdata)
 	sc->icondata = NULL;
 	sc->priority = 0;
 	sc->is_default = 0;
+#ifdef USE_INITRD_COMPOSE
+	sc->overlays = NULL;
+	sc->bootdev = NULL;
+#endif
+#ifdef USE_BOOT_HANDLES
+	sc->kernel_fd = -1;
+	sc->initrd_fd = -1;
+#endif
 
 	cfgdata->list[cfgdata->count++] = sc;
 	cfgdata->current = sc;
@@ -76,6 +85,15 @@ void init_cfgdata(struct cfgdata_t *cfgdata)
 	cfgdata->timeout = 0;
 	cfgdata->ui = GUI;
 	cfgdata->debug = 0;
+#ifdef USE_FAST_REBOOT
+	cfgdata->fast_reboot = 0;
+#endif
+#ifdef USE_RESUME
+	cfgdata->resume_auto = USE_RESUME;
+#endif
+#ifdef USE_HEADLESS
+	cfgdata->autoboot = 0;
+#endif
 	cfgdata->current = NULL;
 
 	cfgdata->size = 2;	/* NOTE: hardcoded value */
@@ -104,6 +122,12 @@ void destroy_cfgdata(struct cfgdata_t *cfgdata)
 	for(i = 0; i < cfgdata->count; i++) {
 		if (cfgdata->list[i]) {
 			dispose(cfgdata->list[i]->iconpath);
+#ifdef USE_BOOT_HANDLES
+			if (cfgdata->list[i]->kernel_fd >= 0)
+				close(cfgdata->list[i]->kernel_fd);
+			if (cfgdata->list[i]->initrd_fd >= 0)
+				close(cfgdata->list[i]->initrd_fd);
+#endif
 			free(cfgdata->list[i]);
 		}
 	}
@@ -182,22 +206,50 @@ static int set_cmdline(struct cfgdata_t *cfgdata, char *value)
 static int set_initrd(struct cfgdata_t *cfgdata, char *value)
 {
 	kx_cfg_section *sc;
+	char *initrd;
 
 	sc = cfgdata->current;
 	if (!sc) return -1;
 
-	dispose(sc->initrd);
 	/* Add our mountpoint, since the enduser won't know it */
-	sc->initrd = malloc(strlen(MOUNTPOINT)+strlen(value)+1);
-	if (NULL == sc->initrd) {
+	initrd = malloc(strlen(MOUNTPOINT)+strlen(value)+1);
+	if (NULL == initrd) {
 		DPRINTF("Can't allocate memory to store initrd '%s'", value);
 		return -1;
 	}
 
-	strcpy(sc->initrd, "/mnt");
-	strcat(sc->initrd, value);
+	strcpy(initrd, "/mnt");
+	strcat(initrd, value);
+
+#ifdef USE_INITRD_COMPOSE
+	/* Next initrds are appended to first one */
+	if (sc->initrd) {
+		if (!sc->overlays) sc->overlays = create_charlist(2);
+		addto_charlist(sc->overlays, initrd);
+		free(initrd);
+		return 0;
+	}
+#endif
+
+	dispose(sc->initrd);
+	sc->initrd = initrd;
+	return 0;
+}
+
+#ifdef USE_INITRD_COMPOSE
+static int set_initrd_bootdev(struct cfgdata_t *cfgdata, char *value)
+{
+	kx_cfg_section *sc;
+
+	sc = cfgdata->current;
+	if (!sc) return -1;
+
+	/* Path inside of initramfs, not on device */
+	dispose(sc->bootdev);
+	sc->bootdev = strdup(value);
 	return 0;
 }
+#endif
 
 static int set_priority(struct cfgdata_t *cfgdata, char *value)
 {
@@ -276,6 +328,68 @@ static int set_debug(struct cfgdata_t *cfgdata, char *value)
 	return 0;
 }
 
+#ifdef USE_FAST_REBOOT
+static int set_reboot(struct cfgdata_t *cfgdata, char *value)
+{
+	char v[strlen(value)+1];
+
+	strtoupper(value, v);
+
+	if (strcmp(v, "FAST") == 0) {
+		cfgdata->fast_reboot = 1;
+	} else if (strcmp(v, "FULL") == 0) {
+		cfgdata->fast_reboot = 0;
+	} else {
+		log_msg(lg, "Unknown value '%s' for REBOOT keyword", value);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+#ifdef USE_HEADLESS
+static int set_autoboot(struct cfgdata_t *cfgdata, char *value)
+{
+	if (!value) {
+		/* No value means autoboot */
+		cfgdata->autoboot = 1;
+	} else {
+		char v[strlen(value)+1];
+
+		strtoupper(value, v);
+
+		if ( (strcmp(v, "ON") == 0) || (strcmp(v, "1") == 0) ) {
+			cfgdata->autoboot = 1;
+		} else if ( (strcmp(v, "OFF") == 0) || (strcmp(v, "0") == 0) ) {
+			cfgdata->autoboot = 0;
+		} else {
+			log_msg(lg, "Unknown value '%s' for AUTOBOOT keyword", value);
+			return -1;
+		}
+	}
+	return 0;
+}
+#endif
+
+#ifdef USE_RESUME
+static int set_resume(struct cfgdata_t *cfgdata, char *value)
+{
+	char v[strlen(value)+1];
+
+	strtoupper(value, v);
+
+	if (strcmp(v, "AUTO") == 0) {
+		cfgdata->resume_auto = 1;
+	} else if (strcmp(v, "MENU") == 0) {
+		cfgdata->resume_auto = 0;
+	} else {
+		log_msg(lg, "Unknown value '%s' for RESUME keyword", value);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
 static int set_fbcon(struct cfgdata_t *cfgdata, char *value)
 {
 	const char *str_rotate = "rotate:";
@@ -371,6 +485,12 @@ static struct cfg_keyfunc_t cfg_keyfunc[] = {
 	{ CFG_FILE, 1, "TIMEOUT", set_timeout },
 	{ CFG_FILE, 1, "UI", set_ui },
 	{ CFG_FILE,-1, "DEBUG", set_debug },
+#ifdef USE_FAST_REBOOT
+	{ CFG_FILE, 1, "REBOOT", set_reboot },
+#endif
+#ifdef USE_HEADLESS
+	{ CFG_FILE,-1, "AUTOBOOT", set_autoboot },
+#endif
 	/* Individual item settings */
 	{ CFG_FILE, 0, "DEFAULT", set_default },
 	{ CFG_FILE, 1, "LABEL", set_label },
@@ -378,10 +498,22 @@ static struct cfg_keyfunc_t cfg_keyfunc[] = {
 	{ CFG_FILE, 1, "ICON", set_icon },
 	{ CFG_FILE, 1, "APPEND", set_cmdline },
 	{ CFG_FILE, 1, "INITRD", set_initrd },
+#ifdef USE_INITRD_COMPOSE
+	{ CFG_FILE, 1, "INITRD_BOOTDEV", set_initrd_bootdev },
+#endif
 	{ CFG_FILE, 1, "PRIORITY", set_priority },
 	{ CFG_CMDLINE, 1, "FBCON", set_fbcon },
 	{ CFG_CMDLINE, 1, "MTDPARTS", set_mtdparts },
 	{ CFG_CMDLINE, 1, "CONSOLE", set_ttydev },
+#ifdef USE_FAST_REBOOT
+	{ CFG_CMDLINE, 1, "KEXECBOOT.REBOOT", set_reboot },
+#endif
+#ifdef USE_RESUME
+	{ CFG_CMDLINE, 1, "KEXECBOOT.RESUME", set_resume },
+#endif
+#ifdef USE_HEADLESS
+	{ CFG_CMDLINE,-1, "KEXECBOOT.AUTOBOOT", set_autoboot },
+#endif
 
 	{ CFG_NONE, 0, NULL, NULL }
 };
@@ -413,15 +545,46 @@ int process_keyword(enum cfg_type_t cfg_type, struct cfgdata_t *cfgdata, char *k
 }
 
 
+/* Parse one line of config file */
+static void parse_cfgline(char *line, struct cfgdata_t *cfgdata)
+{
+	char *c;
+	char *keyword;
+	char *value;
+
+	/* Skip white-space from beginning */
+	keyword = ltrim(line);
+
+	if ( ('\0' == keyword[0]) || ('#' == keyword[0]) ) {
+		/* Skip comment or empty line */
+		return;
+	}
+	/* Try to split line up to key and value */
+	c = strchr(keyword, '=');
+	if (NULL != c) {	/* '=' was found. We have value */
+		/* Split string to keyword and value */
+		*c = '\0';
+		++c;
+
+		value = trim(c);	/* Strip white-space from value */
+	} else {
+		value = NULL;
+	}
+	c = rtrim(keyword);	/* Strip trailing white-space from keyword */
+	*(c+1) = '\0';
+
+	/* Process keyword and value */
+	if (-1 == process_keyword(CFG_FILE, cfgdata, keyword, value)) {
+		log_msg(lg, "Can't parse keyword '%s'", keyword);
+	}
+}
+
+
 /* Parse config file into specified structure */
 /* NOTE: It will not clean cfgdata before parsing, do it yourself */
 int parse_cfgfile(char *path, struct cfgdata_t *cfgdata)
 {
-	int linenr = 0;
 	FILE *f;
-	char *c;
-	char *keyword;
-	char *value;
 	char line[8192];
 
 	/* Open the config file */
@@ -433,35 +596,30 @@ int parse_cfgfile(char *path, struct cfgdata_t *cfgdata)
 
 	/* Read config file line by line */
 	while (fgets(line, sizeof(line), f)) {
-		++linenr;
-		/* Skip white-space from beginning */
-		keyword = ltrim(line);
+		parse_cfgline(line, cfgdata);
+	}
 
-		if ( ('\0' == keyword[0]) || ('#' == keyword[0]) ) {
-			/* Skip comment or empty line */
-			continue;
-		}
-		/* Try to split line up to key and value */
-		c = strchr(keyword, '=');
-		if (NULL != c) {	/* '=' was found. We have value */
-			/* Split string to keyword and value */
-			*c = '\0';
-			++c;
+	fclose(f);
+	return 0;
+}
 
-			value = trim(c);	/* Strip white-space from value */
-		} else {
-			value = NULL;
-		}
-		c = rtrim(keyword);	/* Strip trailing white-space from keyword */
-		*(c+1) = '\0';
 
-		/* Process keyword and value */
-		if (-1 == process_keyword(CFG_FILE, cfgdata, keyword, value)) {
-			log_msg(lg, "Can't parse keyword '%s'", keyword);
+/* Parse config file contents. Buffer is modified */
+/* NOTE: It will not clean cfgdata before parsing, do it yourself */
+int parse_cfgbuf(char *buf, struct cfgdata_t *cfgdata)
+{
+	char *line, *e;
+
+	for (line = buf; '\0' != *line; line = e) {
+		e = strchr(line, '\n');
+		if (NULL == e) {
+			e = line + strlen(line);
+		} else {
+			*e++ = '\0';
 		}
+		parse_cfgline(line, cfgdata);
 	}
 
-	fclose(f);
 	return 0;
 }
 
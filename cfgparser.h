@@ -25,6 +25,9 @@
 #define MOUNTPOINT	"/mnt"
 #define BOOTCFG_PATH MOUNTPOINT "/boot/boot.cfg"
 
+/* Limit size of config file read from unmounted device */
+#define MAX_CFG_FILE_SIZE	65535
+
 enum ui_type_t { GUI, TEXTUI };
 
 typedef struct {
@@ -36,6 +39,14 @@ typedef struct {
 	void *icondata;		/* Icon data */
 	int is_default;		/* Use section as default? */
 	int priority;		/* Priority of item in menu */
+#ifdef USE_INITRD_COMPOSE
+	struct charlist *overlays;	/* Initrds appended to first one (NULL - none) */
+	char *bootdev;		/* File in initramfs to write boot device to */
+#endif
+#ifdef USE_BOOT_HANDLES
+	int kernel_fd;		/* Kernel opened during scan (-1 - none) */
+	int initrd_fd;		/* Initrd opened during scan (-1 - none) */
+#endif
 } kx_cfg_section;
 
 /* Config file data structure */
@@ -43,6 +54,15 @@ struct cfgdata_t {
 	int timeout;		/* Seconds before default item autobooting (0 - disabled) */
 	enum ui_type_t ui;	/* UI (graphics/text) */
 	int debug;			/* Use debugging */
+#ifdef USE_FAST_REBOOT
+	int fast_reboot;	/* Reboot by kexec of own kernel */
+#endif
+#ifdef USE_RESUME
+	int resume_auto;	/* Resume hibernated system without menu */
+#endif
+#ifdef USE_HEADLESS
+	int autoboot;		/* Boot default item without UI */
+#endif
 
 	unsigned int size;	/* Size of sections array allocated */
 	unsigned int count;	/* Sections count */
@@ -62,6 +82,9 @@ void init_cfgdata(struct cfgdata_t *cfgdata);
 /* Free config file sections */
 void destroy_cfgdata(struct cfgdata_t *cfgdata);
 
+/* Allocate new section and make it current */
+kx_cfg_section *cfg_section_new(struct cfgdata_t *cfgdata);
+
 /* Set kernelpath only (may be used when no config file found) */
 int cfgdata_add_kernel(struct cfgdata_t *cfgdata, char *kernelpath);
 
@@ -69,6 +92,9 @@ int cfgdata_add_kernel(struct cfgdata_t *cfgdata, char *kernelpath);
 /* NOTE: It will not clean cfgdata before parsing, do it yourself */
 int parse_cfgfile(char *cfgpath, struct cfgdata_t *cfgdata);
 
+/* Same as parse_cfgfile() but config file contents is in NUL-terminated buffer */
+int parse_cfgbuf(char *buf, struct cfgdata_t *cfgdata);
+
 int parse_cmdline(struct cfgdata_t *cfgdata);
 
 #endif /* _HAVE_CONFIGPARSER_H */
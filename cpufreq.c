@@ -0,0 +1,251 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include "config.h"
+
+#ifdef USE_CPUFREQ
+#include "util.h"
+#include "cpufreq.h"
+
+#define SYSFS_CPU	"/sys/devices/system/cpu"
+
+/* Governor used while kernel is scanned and loaded */
+#define BOOST_GOVERNOR	"performance"
+
+enum cpufreq_mode_t {
+	CPUFREQ_ORIGINAL = 0,
+	CPUFREQ_BOOST,
+	CPUFREQ_IDLE
+};
+
+/* Frequency policy (group of CPUs sharing one clock) */
+struct cpufreq_policy_t {
+	char *path;			/* cpufreq directory in sysfs */
+	char *governor;		/* Original governor */
+	char *min_freq;		/* Original minimal frequency */
+	int min_changed;	/* Minimal frequency is raised instead of governor */
+};
+
+static struct cpufreq_policy_t *policies = NULL;
+static unsigned int fill = 0;
+static int loaded = 0;
+static enum cpufreq_mode_t mode = CPUFREQ_ORIGINAL;
+
+
+/* Read first line of attribute without trailing newline */
+static int read_attr(const char *path, const char *attr, char *buf, int len)
+{
+	char name[PATH_MAX];
+	FILE *f;
+
+	snprintf(name, sizeof(name), "%s/%s", path, attr);
+	f = fopen(name, "r");
+	if (NULL == f) return -1;
+
+	if (NULL == fgets(buf, len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+
+static int write_attr(const char *path, const char *attr, const char *value)
+{
+	char name[PATH_MAX];
+	FILE *f;
+	int rc;
+
+	snprintf(name, sizeof(name), "%s/%s", path, attr);
+	f = fopen(name, "w");
+	if (NULL == f) return -1;
+
+	rc = fputs(value, f);
+	/* Value is checked by kernel at write */
+	if (0 != fclose(f) || rc < 0) return -1;
+
+	return 0;
+}
+
+
+/* CPU is online unless it says otherwise (cpu0 often has no 'online') */
+static int cpu_online(const char *name)
+{
+	char path[PATH_MAX], buf[8];
+
+	snprintf(path, sizeof(path), SYSFS_CPU "/%s", name);
+	if (-1 == read_attr(path, "online", buf, sizeof(buf))) return 1;
+
+	return ('0' != buf[0]);
+}
+
+
+/* Remember policies of online CPUs and their governors */
+static void cpufreq_load(void)
+{
+	DIR *d;
+	struct dirent *de;
+	struct cpufreq_policy_t *p;
+	char path[PATH_MAX], real[PATH_MAX], buf[64];
+	unsigned int i, size = 0;
+
+	if (loaded) return;
+	loaded = 1;
+
+	d = opendir(SYSFS_CPU);
+	if (NULL == d) return;
+
+	while (NULL != (de = readdir(d))) {
+		if (strncmp(de->d_name, "cpu", 3)) continue;
+		if (de->d_name[3] < '0' || de->d_name[3] > '9') continue;
+		if (!cpu_online(de->d_name)) continue;
+
+		/* CPUs sharing clock have links to same directory */
+		snprintf(path, sizeof(path), SYSFS_CPU "/%s/cpufreq", de->d_name);
+		if (NULL == realpath(path, real)) continue;
+
+		for (i = 0; i < fill; i++) {
+			if (!strcmp(policies[i].path, real)) break;
+		}
+		if (i < fill) continue;
+
+		if (-1 == read_attr(real, "scaling_governor", buf, sizeof(buf)))
+			continue;
+
+		if (fill >= size) {
+			size = size ? size * 2 : 4;
+			p = realloc(policies, size * sizeof(*policies));
+			if (NULL == p) {
+				DPRINTF("Can't resize cpufreq policies list");
+				break;
+			}
+			policies = p;
+		}
+
+		p = &policies[fill];
+		p->path = strdup(real);
+		p->governor = strdup(buf);
+		p->min_freq = NULL;
+		p->min_changed = 0;
+		if (-1 != read_attr(real, "scaling_min_freq", buf, sizeof(buf)))
+			p->min_freq = strdup(buf);
+		++fill;
+	}
+	closedir(d);
+
+	if (0 == fill) log_msg(lg, "No CPU frequency control is found");
+}
+
+
+/* Log current frequencies */
+static void cpufreq_report(void)
+{
+	char gov[64], cur[32];
+	unsigned int i;
+
+	for (i = 0; i < fill; i++) {
+		if (-1 == read_attr(policies[i].path, "scaling_governor",
+				gov, sizeof(gov)))
+			strcpy(gov, "?");
+		if (-1 == read_attr(policies[i].path, "scaling_cur_freq",
+				cur, sizeof(cur)))
+			strcpy(cur, "?");
+		log_msg(lg, "CPU freq %s: %s, %s kHz", policies[i].path, gov, cur);
+	}
+}
+
+
+/* Put back minimal frequency changed by boost */
+static void restore_min(struct cpufreq_policy_t *p)
+{
+	if (!p->min_changed) return;
+
+	write_attr(p->path, "scaling_min_freq", p->min_freq);
+	p->min_changed = 0;
+}
+
+
+void cpufreq_boost(void)
+{
+	char buf[32];
+	unsigned int i;
+	struct cpufreq_policy_t *p;
+
+	cpufreq_load();
+	if (CPUFREQ_BOOST == mode || 0 == fill) return;
+	mode = CPUFREQ_BOOST;
+
+	for (i = 0; i < fill; i++) {
+		p = &policies[i];
+		if (0 == write_attr(p->path, "scaling_governor", BOOST_GOVERNOR))
+			continue;
+
+		/* No performance governor. Keep current one at maximum */
+		if ( p->min_freq
+				&& (0 == read_attr(p->path, "scaling_max_freq", buf, sizeof(buf)))
+				&& (0 == write_attr(p->path, "scaling_min_freq", buf)) )
+			p->min_changed = 1;
+	}
+
+	cpufreq_report();
+}
+
+
+void cpufreq_idle(void)
+{
+	unsigned int i;
+
+	cpufreq_load();
+	if (CPUFREQ_IDLE == mode || 0 == fill) return;
+	mode = CPUFREQ_IDLE;
+
+	for (i = 0; i < fill; i++) {
+		restore_min(&policies[i]);
+		if (-1 == write_attr(policies[i].path, "scaling_governor", USE_CPUFREQ))
+			write_attr(policies[i].path, "scaling_governor",
+					policies[i].governor);
+	}
+
+	cpufreq_report();
+}
+
+
+void cpufreq_restore(void)
+{
+	unsigned int i;
+
+	if (CPUFREQ_ORIGINAL == mode) return;
+	mode = CPUFREQ_ORIGINAL;
+
+	for (i = 0; i < fill; i++) {
+		restore_min(&policies[i]);
+		write_attr(policies[i].path, "scaling_governor", policies[i].governor);
+	}
+
+	cpufreq_report();
+}
+
+#endif /* USE_CPUFREQ */
@@ -0,0 +1,39 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_CPUFREQ_H_
+#define _HAVE_CPUFREQ_H_
+
+#include "config.h"
+
+/*
+ * CPU frequency control. All online CPUs are run at maximum frequency
+ * while devices are scanned and kernel is loaded and by low-power
+ * governor while menu is idle. Original governors are restored before
+ * kexec. Missing cpufreq support is not an error.
+ */
+
+/* Run CPUs at maximum frequency */
+void cpufreq_boost(void);
+
+/* Switch CPUs to low-power governor */
+void cpufreq_idle(void);
+
+/* Return original governors */
+void cpufreq_restore(void);
+
+#endif /* _HAVE_CPUFREQ_H_ */
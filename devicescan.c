@@ -21,6 +21,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -28,23 +29,42 @@
 #include "fstype/fstype.h"
 #include "util.h"
 #include "devicescan.h"
+#include "sbprobe.h"
 #include "config.h"
 
+#ifdef USE_BOOTIMG
+#include "bootimg.h"
+#endif
+
 
-/* Create charlist of known filesystems */
-struct charlist *scan_filesystems()
+#ifdef USE_UEVENTS
+#include <dirent.h>
+
+/* Block devices in sysfs */
+#define SYSFS_BLOCK	"/sys/class/block"
+#endif
+
+/* Set of known filesystems. It is read once and is never freed */
+static struct strset *known_fs = NULL;
+
+/* Return set of known filesystems */
+struct strset *scan_filesystems()
 {
 	char *split;
-	struct charlist *fl;
+	struct strset *fl;
 	char line[80];
 
-	fl = create_charlist(8);
+	if (NULL != known_fs) return known_fs;
+
+	fl = create_strset(32);
+	if (NULL == fl) return NULL;
+
 	// make a list of all known filesystems
 	FILE *f = fopen("/proc/filesystems", "r");
 
 	if (NULL == f) {
 		log_msg(lg, "+ can't open /proc/filesystems: %s", ERRMSG);
-		free_charlist(fl);
+		free_strset(fl);
 		return NULL;
 	}
 
@@ -52,9 +72,14 @@ struct charlist *scan_filesystems()
 		line[strlen(line) - 1] = '\0';	/* kill last '\n' */
 		split = strchr(line, '\t');
 		split++;
-		addto_charlist(fl, split);	/* NOTE: strdup() may return NULL */
+		addto_strset(fl, split);	/* NOTE: strdup() may return NULL */
 	}
 	fclose(f);
+
+	/* Signature index is built here while we are single-threaded */
+	fstype_init();
+
+	known_fs = fl;
 	return fl;
 }
 
@@ -80,6 +105,9 @@ struct bootconf_t *create_bootcfg(unsigned int size)
 	bc->default_item = NULL;
 	bc->ui = GUI;
 	bc->debug = 0;
+#ifdef USE_FAST_REBOOT
+	bc->fast_reboot = 0;
+#endif
 
 	return bc;
 }
@@ -137,6 +165,18 @@ int addto_bootcfg(struct bootconf_t *bc, struct device_t *dev,
 		bi->initrd = sc->initrd;
 		bi->icondata = sc->icondata;
 		bi->priority = sc->priority;
+		bi->order = 0;
+#ifdef USE_INITRD_COMPOSE
+		bi->overlays = sc->overlays;
+		bi->bootdev = sc->bootdev;
+#endif
+#ifdef USE_BOOT_HANDLES
+		/* Handles are owned by boot item now */
+		bi->kernel_fd = sc->kernel_fd;
+		bi->initrd_fd = sc->initrd_fd;
+		sc->kernel_fd = -1;
+		sc->initrd_fd = -1;
+#endif
 		if (sc->is_default) bc->default_item = bi;
 
 		bc->list[bc->fill] = bi;
@@ -144,6 +184,9 @@ int addto_bootcfg(struct bootconf_t *bc, struct device_t *dev,
 		if (cfgdata->ui != bc->ui)	bc->ui = cfgdata->ui;
 		if (cfgdata->timeout > 0)	bc->timeout = cfgdata->timeout;
 		if (cfgdata->debug > 0)		bc->debug = cfgdata->debug;
+#ifdef USE_FAST_REBOOT
+		if (cfgdata->fast_reboot > 0)	bc->fast_reboot = cfgdata->fast_reboot;
+#endif
 
 		++bc->fill;
 
@@ -177,6 +220,13 @@ void free_bootcfg(struct bootconf_t *bc)
 		dispose(bc->list[i]->cmdline);
 		dispose(bc->list[i]->initrd);
 		dispose(bc->list[i]->label);
+#ifdef USE_INITRD_COMPOSE
+		if (bc->list[i]->overlays) free_charlist(bc->list[i]->overlays);
+		dispose(bc->list[i]->bootdev);
+#endif
+#ifdef USE_BOOT_HANDLES
+		close_boothandles(bc->list[i]);
+#endif
 		free(bc->list[i]);
 	}
 	free(bc->list);
@@ -202,6 +252,15 @@ void print_bootcfg(struct bootconf_t *bc)
 		log_msg(lg, " [%d] kernelpath: '%s'", i, bc->list[i]->kernelpath);
 		log_msg(lg, " [%d] cmdline: '%s'", i, bc->list[i]->cmdline);
 		log_msg(lg, " [%d] initrd: '%s'", i, bc->list[i]->initrd);
+#ifdef USE_INITRD_COMPOSE
+		if (bc->list[i]->overlays) {
+			unsigned int j;
+			for (j = 0; j < bc->list[i]->overlays->fill; j++)
+				log_msg(lg, " [%d] + initrd: '%s'", i,
+						bc->list[i]->overlays->list[j]);
+		}
+		log_msg(lg, " [%d] bootdev: '%s'", i, bc->list[i]->bootdev);
+#endif
 		log_msg(lg, " [%d] icondata: '%p'", i, bc->list[i]->icondata);
 		log_msg(lg, " [%d] priority: '%d'", i, bc->list[i]->priority);
 	}
@@ -209,53 +268,196 @@ void print_bootcfg(struct bootconf_t *bc)
 #endif
 
 
-/* Detect FS type on device and returt pointer to static structure from fstype.c */
-const char *detect_fstype(char *device, struct charlist *fl)
+/* Check that FS is known by kernel. Return fstype or NULL */
+static const char *check_fstype(const char *fstype, struct strset *fl)
+{
+	if (!in_strset(fl, fstype)) {
+
+		/* whitelist 'ubi', we assume it is ubifs */
+		if (!strncmp(fstype, "ubi",3)) {
+			log_msg(lg, "+ found %s container: assume ubifs", fstype);
+#ifdef USE_RESUME
+		} else if (!strcmp(fstype, "suspend")) {
+			log_msg(lg, "+ found hibernation image");
+#endif
+#ifdef USE_BOOTIMG
+		/* Boot images are read from raw device */
+		} else if (bootimg_fstype(fstype)) {
+			log_msg(lg, "+ found %s container", fstype);
+#endif
+		} else {
+			log_msg(lg, "+ FS %s is not supported by kernel", fstype);
+			return NULL;
+		}
+	}
+
+	return fstype;
+}
+
+
+/* Detect FS type from probe window of device. Fingerprint of
+ * filesystem is taken from the same window */
+static int detect_window(struct device_t *dev, const char *buf, int len,
+		struct strset *fl)
 {
-	int fd;
 	const char *fstype;
 
-	fd = open(device, O_RDONLY);
-	if (fd < 0) {
-		log_msg(lg, "+ can't open device: %s", ERRMSG);
-		return NULL;
+	if (0 != identify_fs_buf(buf, len, &fstype, NULL)) {
+		log_msg(lg, "+ can't identify FS type on %s", dev->device);
+		return -1;
 	}
 
-	if ( 0 != identify_fs(fd, &fstype, NULL, 0) ) {
-		close(fd);
-		log_msg(lg, "+ can't identify FS type");
-		return NULL;
+	log_msg(lg, "+ FS type '%s' detected on %s", fstype, dev->device);
+	dev->fstype = check_fstype(fstype, fl);
+	dev->fingerprint = fingerprint_fs_buf(buf, len, fstype);
+
+	return (NULL == dev->fstype) ? -1 : 0;
+}
+
+
+/* Detect FS types of 'count' devices with one batch of superblock reads */
+int devscan_detect_batch(struct device_t *devs, unsigned int count,
+		struct strset *fslist)
+{
+	struct sbprobe_t *probes;
+	unsigned int i;
+
+	probes = malloc(count * sizeof(*probes));
+	if (NULL == probes) {
+		DPRINTF("Can't allocate superblock probes array");
+		return -1;
 	}
-	close(fd);
 
-	log_msg(lg, "+ FS type '%s' detected", fstype);
+	for (i = 0; i < count; i++) {
+		probes[i].device = devs[i].device;
+		devs[i].fstype = NULL;
+	}
+
+	if (-1 == sbprobe_read(probes, count)) {
+		free(probes);
+		return -1;
+	}
 
-	/* Check that FS is known */
-	if (in_charlist(fl, fstype) < 0) {
+	for (i = 0; i < count; i++) {
+		if (probes[i].len < 0) {
+			log_msg(lg, "+ can't read device %s: %s", devs[i].device,
+					strerror(probes[i].err));
+			continue;
+		}
 
-		/* whitelist 'ubi', we assume it is ubifs */
-		if (!strncmp(fstype, "ubi",3)) {
-			log_msg(lg, "+ found %s container: assume ubifs", fstype);
-		} else {
-			log_msg(lg, "+ FS %s is not supported by kernel", fstype);
+		detect_window(&devs[i], probes[i].buf, probes[i].len, fslist);
+	}
+
+	sbprobe_free(probes, count);
+	free(probes);
+	return 0;
+}
+
+
+#ifdef USE_BOOT_HANDLES
+void close_boothandles(struct boot_item_t *bi)
+{
+	/* Detached filesystem goes away with last handle */
+	if (bi->kernel_fd >= 0) close(bi->kernel_fd);
+	if (bi->initrd_fd >= 0) close(bi->initrd_fd);
+	bi->kernel_fd = -1;
+	bi->initrd_fd = -1;
+}
+#endif
+
+
+/* Return 'path' (starting with MOUNTPOINT) relocated to 'mountpoint' */
+char *mountpoint_path(const char *mountpoint, const char *path)
+{
+	char *p;
+	const int mplen = sizeof(MOUNTPOINT) - 1;
+
+	/* Strip our default mountpoint from path */
+	if (0 == strncmp(path, MOUNTPOINT, mplen)) path += mplen;
+
+	p = malloc(strlen(mountpoint) + strlen(path) + 1);
+	if (NULL == p) {
+		DPRINTF("Can't allocate memory for path '%s'", path);
 		return NULL;
+	}
+
+	strcpy(p, mountpoint);
+	strcat(p, path);
+	return p;
+}
+
+
+/* Return 0 if file 'path' exists on device mounted at 'mountpoint' */
+static int mountpoint_stat(const void *mountpoint, const char *path)
+{
+	struct stat sinfo;
+	char *p;
+	int rc;
+
+	p = mountpoint_path(mountpoint, path);
+	if (NULL == p) return -1;
+
+	rc = stat(p, &sinfo);
+	free(p);
+	return rc;
+}
+
+
+/* Look for kernels when there is no config file.
+ * 'exists' returns 0 when file is found, -1 when it isn't or -2 */
+static int get_kernels(struct cfgdata_t *cfgdata,
+		int (*exists)(const void *src, const char *path), const void *src)
+{
+	char **kp;
+	int rc;
+
+#ifdef USE_MACHINE_KERNEL
+	/* Check machine kernel if set */
+	if (NULL != machine_kernel) {
+		rc = exists(src, machine_kernel);
+		if (-2 == rc) return -2;
+		if (0 == rc) {
+			cfgdata_add_kernel(cfgdata, machine_kernel);
+			log_msg(lg, "+ found machine kernel '%s'", machine_kernel);
+			return 0;
 		}
 	}
+#endif
 
-	return(fstype);
+	/* Check default kernels */
+	for (kp = default_kernels; NULL != *kp; kp++) {
+		rc = exists(src, *kp);
+		if (-2 == rc) return -2;
+		if (0 == rc) {
+			cfgdata_add_kernel(cfgdata, *kp);
+			log_msg(lg, "+ found default kernel '%s'", *kp);
+			return 0;
+		}
+	}
+
+	/* We have no kernels */
+	log_msg(lg, "+ no config file nor any kernels found");
+	return -1;
 }
 
 
 /* Check and parse config file */
-int get_bootinfo(struct cfgdata_t *cfgdata)
+int get_bootinfo(struct cfgdata_t *cfgdata, const char *mountpoint)
 {
-	struct stat sinfo;
+	char *cfgpath;
+	int rc;
 
 	/* Clean cfgdata structure */
 	init_cfgdata(cfgdata);
 
+	cfgpath = mountpoint_path(mountpoint, BOOTCFG_PATH);
+	if (NULL == cfgpath) return -1;
+
 	/* Parse config file */
-	if (0 == parse_cfgfile(BOOTCFG_PATH, cfgdata)) {	/* Found and parsed */
+	rc = parse_cfgfile(cfgpath, cfgdata);
+	free(cfgpath);
+
+	if (0 == rc) {	/* Found and parsed */
 		log_msg(lg, "+ config file found");
 		/* Check kernel presence
 		 * FIXME: we should stat every kernel or shouldn't stat at all
@@ -265,40 +467,46 @@ int get_bootinfo(struct cfgdata_t *cfgdata)
 		return -1;
 		*/
 		return 0;
+	}
 
-	} else {	/* No config file found. Check kernels. */
+	/* No config file found. Check kernels. */
+	return get_kernels(cfgdata, mountpoint_stat, mountpoint);
+}
 
-#ifdef USE_MACHINE_KERNEL
-		/* Check machine kernel if set */
-		if (NULL != machine_kernel) {
-			if (0 == stat(machine_kernel, &sinfo)) {
-				cfgdata_add_kernel(cfgdata, machine_kernel);
-				log_msg(lg, "+ found machine kernel '%s'", machine_kernel);
-				return 0;
-			}
-		}
-#endif
 
-		/* Check default kernels */
-		char **kp;
-		for (kp = default_kernels; NULL != *kp; kp++) {
-			if (0 == stat(*kp, &sinfo)) {
-				cfgdata_add_kernel(cfgdata, *kp);
-				log_msg(lg, "+ found default kernel '%s'", *kp);
-				return 0;
-			}
-		}
+#ifdef USE_ROFS
+static int rofs_exists(const void *fs, const char *path)
+{
+	return rofs_stat((kx_rofs *)fs, path, NULL);
+}
+
+int get_bootinfo_rofs(struct cfgdata_t *cfgdata, kx_rofs *fs)
+{
+	char *buf;
+	int rc;
+
+	/* Clean cfgdata structure */
+	init_cfgdata(cfgdata);
+
+	rc = rofs_read(fs, BOOTCFG_PATH, &buf, MAX_CFG_FILE_SIZE);
+	if (-2 == rc) return -2;
+
+	if (rc >= 0) {
+		parse_cfgbuf(buf, cfgdata);
+		free(buf);
+		log_msg(lg, "+ config file found");
+		return 0;
 	}
 
-	/* We have no kernels */
-	log_msg(lg, "+ no config file nor any kernels found");
-	return -1;
+	log_msg(lg, "+ can't open config file");
+	return get_kernels(cfgdata, rofs_exists, fs);
 }
+#endif
 
-FILE *devscan_open(struct charlist **fslist)
+FILE *devscan_open(struct strset **fslist)
 {
 	FILE *f;
-	struct charlist *fl;
+	struct strset *fl;
 	char line[80];
 
     /* Get a list of all filesystems registered in the kernel */
@@ -312,7 +520,7 @@ FILE *devscan_open(struct charlist **fslist)
 	f = fopen("/proc/partitions", "r");
 	if (NULL == f) {
 		log_msg(lg, "Can't open /proc/partitions: %s", ERRMSG);
-		goto free_fl;
+		return NULL;
 	}
 
 	// First two lines are bogus.
@@ -321,14 +529,34 @@ FILE *devscan_open(struct charlist **fslist)
 
 	*fslist = fl;
 	return f;
+}
 
-free_fl:
-	free_charlist(fl);
+#ifdef USE_DEVICES_RECREATING
+/* Create device node unless right one exists already */
+static void devscan_mknod(const char *device, int major, int minor)
+{
+	struct stat sinfo;
+
+	if ( (0 == stat(device, &sinfo)) && S_ISBLK(sinfo.st_mode)
+			&& (sinfo.st_rdev == makedev(major, minor)) )
+		return;
+
+	/* Remove old device node. We don't care about unlink() result. */
+	unlink(device);
 
-	return NULL;
+	/* Re-create device node */
+	log_msg(lg, "+ creating device node");
+	if ( -1 == mknod( device,
+			(S_IFBLK | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH),
+			makedev(major, minor) ) )
+	{
+		log_msg(lg, "+ mknod failed: %s", ERRMSG);
+	}
 }
+#endif
 
-int devscan_next(FILE *fp, struct charlist *fslist, struct device_t *dev)
+/* Get next device without FS detection */
+int devscan_read(FILE *fp, struct device_t *dev)
 {
 	int major, minor, len;
 	unsigned long long blocks;
@@ -372,29 +600,169 @@ int devscan_next(FILE *fp, struct charlist *fslist, struct device_t *dev)
 			device, major, minor, blocks>>10);
 
 #ifdef USE_DEVICES_RECREATING
-	/* Remove old device node. We don't care about unlink() result. */
-	unlink(device);
+	devscan_mknod(device, major, minor);
+#endif
 
-	/* Re-create device node */
-	log_msg(lg, "+ creating device node");
-	if ( -1 == mknod( device,
-			(S_IFBLK | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH),
-			makedev(major, minor) ) )
+	dev->device = device;
+	dev->fstype = NULL;
+	dev->blocks = blocks;
+	dev->major = major;
+	dev->minor = minor;
+	dev->fingerprint = 0;
+
+	return 1;
+}
+
+/* Detect FS type of device read by devscan_read(). Window is the same
+ * as in batch so scan cache gets fingerprint too */
+int devscan_detect(struct device_t *dev, struct strset *fslist)
+{
+	ssize_t len;
+	char *buf;
+	int fd, rc;
+
+	fd = open(dev->device, O_RDONLY);
+	if (fd < 0) {
+		log_msg(lg, "+ can't open device %s: %s", dev->device, ERRMSG);
+		return -1;
+	}
+
+	buf = malloc(FSTYPE_PROBE_SIZE);
+	if (NULL == buf) {
+		DPRINTF("Can't allocate probe window for %s", dev->device);
+		close(fd);
+		return -1;
+	}
+
+	len = pread(fd, buf, FSTYPE_PROBE_SIZE, 0);
+	close(fd);
+	if (len < 0) {
+		log_msg(lg, "+ can't read device %s: %s", dev->device, ERRMSG);
+		free(buf);
+		return -1;
+	}
+
+	rc = detect_window(dev, buf, len, fslist);
+	free(buf);
+	return rc;
+}
+
+int devscan_next(FILE *fp, struct strset *fslist, struct device_t *dev)
+{
+	int rc;
+
+	rc = devscan_read(fp, dev);
+	if (rc <= 0) return rc;
+
+	if (-1 == devscan_detect(dev, fslist)) {
+		free(dev->device);
+		return -1;
+	}
+
+	return 1;
+}
+
+
+#ifdef USE_UEVENTS
+/* Skip dot entries of sysfs directory */
+static int sysfs_filter(const struct dirent *d)
+{
+	return ('.' != d->d_name[0]);
+}
+
+/* Return sorted names of block devices present in sysfs */
+struct charlist *devscan_sysfs_names(void)
+{
+	struct dirent **namelist;
+	struct charlist *cl;
+	int i, n;
+
+	n = scandir(SYSFS_BLOCK, &namelist, sysfs_filter, alphasort);
+	if (n < 0) {
+		log_msg(lg, "Can't scan %s: %s", SYSFS_BLOCK, ERRMSG);
+		return NULL;
+	}
+
+	cl = create_charlist(n + 1);
+	for (i = 0; i < n; i++) {
+		addto_charlist(cl, namelist[i]->d_name);
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	return cl;
+}
+
+/* Read first line of sysfs attribute of block device */
+static int sysfs_attr(const char *name, const char *attr, char *buf, int len)
+{
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), SYSFS_BLOCK "/%s/%s", name, attr);
+	f = fopen(path, "r");
+	if (NULL == f) return -1;
+
+	if (NULL == fgets(buf, len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Get device 'name' (sda1) from sysfs without FS detection */
+int devscan_sysfs_device(const char *name, struct device_t *dev)
+{
+	int major, minor;
+	unsigned long long blocks;
+	char *device;
+	char buf[32];
+
+	if ( (-1 == sysfs_attr(name, "dev", buf, sizeof(buf)))
+			|| (2 != sscanf(buf, "%d:%d", &major, &minor)) )
 	{
-		log_msg(lg, "+ mknod failed: %s", ERRMSG);
+		log_msg(lg, "Can't get numbers of device '%s'", name);
+		return -1;
 	}
-#endif
 
-	dev->fstype = detect_fstype(device, fslist);
-	if (NULL == dev->fstype) {
-		free(device);
+	/* Size is in 512-byte sectors */
+	if ( (-1 == sysfs_attr(name, "size", buf, sizeof(buf)))
+			|| (1 != sscanf(buf, "%llu", &blocks)) )
+	{
+		log_msg(lg, "Can't get size of device '%s'", name);
+		return -1;
+	}
+	blocks >>= 1;
+
+	/* FIXME: 200k is hardcoded below */
+	if (blocks < 200) {
+		log_msg(lg, "+ device %s is too small (%lluk < 200k), skipped", name, blocks);
 		return -1;
 	}
 
+	device = malloc(strlen(name) + 5 + 1); /* 5 = strlen("/dev/") */
+	if (NULL == device) {
+		DPRINTF("Can't allocate memory for device name '%s'", name);
+		return -1;
+	}
+	strcpy(device, "/dev/");
+	strcat(device, name);
+
+	log_msg(lg, "Found device '%s' (%d, %d) of size %lluMb",
+			device, major, minor, blocks>>10);
+
+#ifdef USE_DEVICES_RECREATING
+	devscan_mknod(device, major, minor);
+#endif
+
 	dev->device = device;
+	dev->fstype = NULL;
 	dev->blocks = blocks;
+	dev->major = major;
+	dev->minor = minor;
+	dev->fingerprint = 0;
 
 	return 1;
 }
-
-
+#endif	/* USE_UEVENTS */
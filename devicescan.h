@@ -21,12 +21,15 @@
 #include "config.h"
 #include "util.h"
 #include "cfgparser.h"
+#include "rofs.h"
 
 /* Device structure */
 struct device_t {
 	char *device;		/* Device path (/dev/mmcblk0p1) */
 	const char *fstype;	/* Filesystem (ext2) */
 	unsigned long long blocks;	/* Device size in 1K blocks */
+	int major, minor;	/* Device numbers */
+	unsigned long long fingerprint;	/* Superblock fingerprint (0 - unknown) */
 };
 
 enum dtype_t {
@@ -47,7 +50,16 @@ struct boot_item_t {
 	char *initrd;		/* Initial ramdisk file */
 	void *icondata;		/* Icon data */
 	int priority;		/* Priority of item in menu */
+	unsigned int order;	/* Device order (for items of same priority) */
 	enum dtype_t dtype;	/* Device type */
+#ifdef USE_INITRD_COMPOSE
+	struct charlist *overlays;	/* Initrds appended to first one (NULL - none) */
+	char *bootdev;		/* File in initramfs to write boot device to */
+#endif
+#ifdef USE_BOOT_HANDLES
+	int kernel_fd;		/* Kernel opened during scan (-1 - none) */
+	int initrd_fd;		/* Initrd opened during scan (-1 - none) */
+#endif
 };
 
 /* Boot configuration structure */
@@ -56,6 +68,9 @@ struct bootconf_t {
 	struct boot_item_t *default_item;	/* Default menu item (NULL - none) */
 	enum ui_type_t ui;			/* UI (graphics/text) */
 	int debug;					/* Use debugging */
+#ifdef USE_FAST_REBOOT
+	int fast_reboot;			/* Reboot by kexec of own kernel */
+#endif
 
 	struct boot_item_t **list;	/* Boot items list */
 	unsigned int size;			/* Count of boot items in list */
@@ -65,11 +80,34 @@ struct bootconf_t {
 extern char *machine_kernel;
 extern char *default_kernels[];
 
+/* Return set of filesystems known by kernel. It is read once
+ * and is shared by all callers so it should not be freed */
+struct strset *scan_filesystems();
+
 /* Prepare devicescan loop */
-FILE *devscan_open(struct charlist **fslist);
+FILE *devscan_open(struct strset **fslist);
 
 /* Get next device (fp & fslist in, dev out) */
-int devscan_next(FILE *fp, struct charlist *fslist, struct device_t *dev);
+int devscan_next(FILE *fp, struct strset *fslist, struct device_t *dev);
+
+/* Get next device without FS detection (fp in, dev out) */
+int devscan_read(FILE *fp, struct device_t *dev);
+
+#ifdef USE_UEVENTS
+/* Return sorted names of block devices present in sysfs */
+struct charlist *devscan_sysfs_names(void);
+
+/* Get device 'name' (sda1) from sysfs without FS detection (dev out) */
+int devscan_sysfs_device(const char *name, struct device_t *dev);
+#endif
+
+/* Detect FS type of device read by devscan_read() (fslist in, dev in/out) */
+int devscan_detect(struct device_t *dev, struct strset *fslist);
+
+/* Detect FS types of 'count' devices by one batch of reads.
+ * fstype of every device is set to NULL when detection failed */
+int devscan_detect_batch(struct device_t *devs, unsigned int count,
+		struct strset *fslist);
 
 /* Allocate bootconf structure */
 struct bootconf_t *create_bootcfg(unsigned int size);
@@ -81,8 +119,23 @@ void free_bootcfg(struct bootconf_t *bc);
 int addto_bootcfg(struct bootconf_t *bc, struct device_t *dev,
 		struct cfgdata_t *cfgdata);
 
-/* Check and parse config file */
-int get_bootinfo(struct cfgdata_t *cfgdata);
+#ifdef USE_BOOT_HANDLES
+/* Close kernel and initrd handles of boot item */
+void close_boothandles(struct boot_item_t *bi);
+#endif
+
+/* Return 'path' (starting with MOUNTPOINT) relocated to 'mountpoint'.
+ * Return value should be free()'d */
+char *mountpoint_path(const char *mountpoint, const char *path);
+
+/* Check and parse config file on device mounted at 'mountpoint' */
+int get_bootinfo(struct cfgdata_t *cfgdata, const char *mountpoint);
+
+#ifdef USE_ROFS
+/* Same as get_bootinfo() but device is read without mounting.
+ * Return -2 when device should be mounted to find out */
+int get_bootinfo_rofs(struct cfgdata_t *cfgdata, kx_rofs *fs);
+#endif
 
 #ifdef DEBUG
 /* Print bootconf structure */
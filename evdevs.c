@@ -263,6 +263,29 @@ void inputs_close(kx_inputs *inputs)
 	inputs->count = 0;
 }
 
+#ifdef USE_HEADLESS
+/* Check that some key or button is held down now */
+int inputs_key_held(kx_inputs *inputs)
+{
+	unsigned long keys[(KEY_MAX/BITS_PER_LONG) + 1];
+	unsigned int i, j;
+
+	for (i = 0; i < inputs->count; i++) {
+		if (KX_IT_EVDEV != inputs->fdtypes[i]) continue;
+
+		memset(keys, 0, sizeof(keys));
+		if (ioctl(inputs->fds[i], EVIOCGKEY(sizeof(keys)), keys) < 0)
+			continue;
+
+		for (j = 0; j < sizeof(keys) / sizeof(keys[0]); j++) {
+			if (keys[j]) return 1;
+		}
+	}
+
+	return 0;
+}
+#endif
+
 /* Prepare inputs for processing */
 int inputs_preprocess(kx_inputs *inputs)
 {
@@ -303,6 +326,11 @@ int inputs_process_evdev(int fd)
 		case KEY_R:
 			action = A_REBOOT;
 			break;
+#ifdef USE_FAST_REBOOT
+		case KEY_F:	/* Fast reboot */
+			action = A_FASTREBOOT;
+			break;
+#endif
 #endif
 		case KEY_S:	/* reScan */
 			action = A_RESCAN;
@@ -352,7 +380,7 @@ enum actions_t inputs_process(kx_inputs *inputs)
 	struct timeval timeout;
 
 	timeout.tv_usec = 0;
-#ifdef USE_TIMEOUT
+#if defined(USE_TIMEOUT) && (USE_TIMEOUT > 0)
 	timeout.tv_sec = USE_TIMEOUT;
 #else
 	timeout.tv_sec = 60;	// exit after timeout to allow to do something above
@@ -396,6 +424,19 @@ enum actions_t inputs_process(kx_inputs *inputs)
 			case KX_IT_SOCKET:
 				/* Process input from sockets */
 				break;
+			case KX_IT_NOTIFY:
+				/* Internal notification. Should be read by caller.
+				 * User input is more important */
+				if (A_NONE == action) action = A_NOTIFY;
+				break;
+			case KX_IT_UEVENT:
+				/* Kernel uevents socket. Should be read by caller */
+				if (A_NONE == action) action = A_UEVENT;
+				break;
+			case KX_IT_TIMER:
+				/* Expired timerfd. Should be read by caller */
+				if (A_NONE == action) action = A_TIMER;
+				break;
 			}
 		}
 	}
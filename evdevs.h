@@ -30,9 +30,15 @@ enum actions_t {
 	A_PARENTMENU,
 	A_SUBMENU,
 	A_REBOOT,
+#ifdef USE_FAST_REBOOT
+	A_FASTREBOOT,
+#endif
 	A_SHUTDOWN,
 	A_RESCAN,
 	A_DEBUG,
+	A_NOTIFY,
+	A_UEVENT,
+	A_TIMER,
 	A_SELECT,
 #ifdef USE_TIMEOUT
 	A_TIMEOUT,
@@ -55,7 +61,10 @@ enum actions_t {
 typedef enum {
 	KX_IT_EVDEV,
 	KX_IT_TTY,
-	KX_IT_SOCKET
+	KX_IT_SOCKET,
+	KX_IT_NOTIFY,
+	KX_IT_UEVENT,
+	KX_IT_TIMER
 } kx_input_type;
 
 typedef struct {
@@ -83,6 +92,11 @@ int inputs_open(kx_inputs *inputs);
 /* Close opened inputs */
 void inputs_close(kx_inputs *inputs);
 
+#ifdef USE_HEADLESS
+/* Check that some key or button is held down now */
+int inputs_key_held(kx_inputs *inputs);
+#endif
+
 /* Prepare inputs for processing */
 int inputs_preprocess(kx_inputs *inputs);
 
@@ -21,6 +21,7 @@
 
 #ifdef USE_FBMENU
 #include <errno.h>
+#include <limits.h>
 
 #include "fb.h"
 
@@ -119,6 +120,104 @@ fb_respect_angle(int x, int y, int *dx, int *dy, int *nx)
 */
 }
 
+/**************************************************************************
+ * Damage tracking
+ */
+
+/* Rectangles overlap or touch each other */
+static int rect_touch(kx_rect *a, kx_rect *b)
+{
+	return (a->x <= b->x + b->width) && (b->x <= a->x + a->width)
+		&& (a->y <= b->y + b->height) && (b->y <= a->y + a->height);
+}
+
+/* Extend rectangle 'a' to cover 'b' */
+static void rect_union(kx_rect *a, kx_rect *b)
+{
+	int x2, y2;
+
+	x2 = a->x + a->width;
+	if (b->x + b->width > x2) x2 = b->x + b->width;
+	y2 = a->y + a->height;
+	if (b->y + b->height > y2) y2 = b->y + b->height;
+
+	if (b->x < a->x) a->x = b->x;
+	if (b->y < a->y) a->y = b->y;
+	a->width = x2 - a->x;
+	a->height = y2 - a->y;
+}
+
+static void fb_add_damage(kx_rect *r)
+{
+	kx_rect u;
+	int i, best = 0;
+	long grow, best_grow = -1;
+
+	/* Join touching rectangles. Joined one may touch others */
+	for (i = 0; i < fb.damage_count; i++) {
+		if (rect_touch(&fb.damage[i], r)) {
+			rect_union(r, &fb.damage[i]);
+			fb.damage[i] = fb.damage[--fb.damage_count];
+			i = -1;
+		}
+	}
+
+	if (fb.damage_count < FB_DAMAGE_MAX) {
+		fb.damage[fb.damage_count++] = *r;
+		return;
+	}
+
+	/* No free slots. Extend rectangle which grows least */
+	for (i = 0; i < fb.damage_count; i++) {
+		u = fb.damage[i];
+		rect_union(&u, r);
+		grow = (long)u.width * u.height
+				- (long)fb.damage[i].width * fb.damage[i].height;
+		if (best_grow < 0 || grow < best_grow) {
+			best_grow = grow;
+			best = i;
+		}
+	}
+	rect_union(&fb.damage[best], r);
+}
+
+/* Mark logical rectangle as changed */
+static void fb_damage(int x, int y, int width, int height)
+{
+	kx_rect r;
+	int x2, y2;
+
+	x2 = x + width;
+	y2 = y + height;
+
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x2 > fb.width) x2 = fb.width;
+	if (y2 > fb.height) y2 = fb.height;
+	if (x2 <= x || y2 <= y) return;
+
+	r.x = x;
+	r.y = y;
+	r.width = x2 - x;
+	r.height = y2 - y;
+	fb_add_damage(&r);
+}
+
+/* Map logical rectangle to physical one */
+static void rect_to_phys(kx_rect *r)
+{
+	int x1, y1, x2, y2;
+
+	/* Opposite corners give physical rectangle for any angle */
+	fb_respect_angle(r->x, r->y, &x1, &y1, NULL);
+	fb_respect_angle(r->x + r->width - 1, r->y + r->height - 1, &x2, &y2, NULL);
+
+	r->x = (x1 < x2) ? x1 : x2;
+	r->y = (y1 < y2) ? y1 : y2;
+	r->width = ((x1 > x2) ? x1 - x2 : x2 - x1) + 1;
+	r->height = ((y1 > y2) ? y1 - y2 : y2 - y1) + 1;
+}
+
 /**************************************************************************
  * Pixel plotting routines
  */
@@ -127,11 +226,9 @@ static void
 fb_plot_pixel_32bpp(int x, int y, kx_rgba color)
 {
 	static char *offset;
-	static int ox, oy;
 
-	fb_respect_angle(x, y, &ox, &oy, NULL);
-	offset = fb.backbuffer + oy * fb.stride + (ox << 2);
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	offset = fb.canvas + y * fb.canvas_stride + (x << 2);
+	if (offset > (fb.canvas + fb.canvas_size - fb.byte_pp)) return;
 
 	*(volatile uint32_t *) offset = (uint32_t) color;
 }
@@ -142,11 +239,9 @@ static void
 fb_plot_pixel_24bpp(int x, int y, kx_rgba color)
 {
 	static char *offset;
-	static int ox, oy;
 
-	fb_respect_angle(x, y, &ox, &oy, NULL);
-	offset = fb.backbuffer + oy * fb.stride + (ox + (ox << 1));
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	offset = fb.canvas + y * fb.canvas_stride + (x + (x << 1));
+	if (offset > (fb.canvas + fb.canvas_size - fb.byte_pp)) return;
 
 	*(volatile char *) (offset) = (color & 0x000000FF);
 	*(volatile char *) (offset + 1) = (color & 0x0000FF00) >> 8;
@@ -159,11 +254,9 @@ static void
 fb_plot_pixel_18bpp(int x, int y, kx_rgba color)
 {
 	static char *offset;
-	static int ox, oy;
 
-	fb_respect_angle(x, y, &ox, &oy, NULL);
-	offset = fb.backbuffer + oy * fb.stride + (ox + (ox << 1));
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	offset = fb.canvas + y * fb.canvas_stride + (x + (x << 1));
+	if (offset > (fb.canvas + fb.canvas_size - fb.byte_pp)) return;
 
 	*(volatile char *) (offset) = (color & 0x000000FF);
 	*(volatile char *) (offset + 1) = (color & 0x0000FF00) >> 8;
@@ -176,114 +269,239 @@ static void
 fb_plot_pixel_16bpp(int x, int y, kx_rgba color)
 {
 	static char *offset;
-	static int ox, oy;
 
-	fb_respect_angle(x, y, &ox, &oy, NULL);
-	offset = fb.backbuffer + oy * fb.stride + (ox << 1);
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	offset = fb.canvas + y * fb.canvas_stride + (x << 1);
+	if (offset > (fb.canvas + fb.canvas_size - fb.byte_pp)) return;
 
 	*(volatile uint16_t *) offset = (uint16_t) color;
 }
 #endif
 
 /**************************************************************************
- * Horizontal line drawing routines
+ * Span fill routines
+ * Rows are filled by aligned 64-bit words. Canvas is accessed by other
+ * types too, so words may alias them.
  */
+typedef uint64_t __attribute__((__may_alias__)) fb_word;
+typedef uint32_t __attribute__((__may_alias__)) fb_u32;
+typedef uint16_t __attribute__((__may_alias__)) fb_u16;
+
+/* Clip logical rectangle by canvas. Return 0 when nothing is left */
+static int fb_clip(int *x, int *y, int *width, int *height)
+{
+	if (*x < 0) {
+		*width += *x;
+		*x = 0;
+	}
+	if (*y < 0) {
+		*height += *y;
+		*y = 0;
+	}
+	if (*x + *width > fb.width) *width = fb.width - *x;
+	if (*y + *height > fb.height) *height = fb.height - *y;
+
+	return (*width > 0 && *height > 0);
+}
+
 #ifdef USE_32BPP
 static void
-fb_draw_hline_32bpp(int x, int y, int length, kx_rgba color)
+fb_fill_rect_32bpp(int x, int y, int width, int height, kx_rgba color)
 {
-	static char *offset;
-	static int ox, oy, nx;
-
-	fb_respect_angle(x, y, &ox, &oy, &nx);
-	offset = fb.backbuffer + oy * fb.stride + (ox << 2);
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	fb_word w = ((fb_word)color << 32) | (uint32_t)color;
+	fb_word *q;
+	fb_u32 *p;
+	char *row;
+	int n;
+
+	if (!fb_clip(&x, &y, &width, &height)) return;
+
+	row = fb.canvas + y * fb.canvas_stride + (x << 2);
+	for (; height > 0; height--, row += fb.canvas_stride) {
+		p = (fb_u32 *)row;
+		n = width;
+		if ((unsigned long)p & 7) {
+			*(p++) = color;
+			--n;
+		}
 
-	if (length > fb.width - x)
-		oy = fb.width - x;
-	else
-		oy = length;
+		q = (fb_word *)p;
+		for (; n >= 2; n -= 2)
+			*(q++) = w;
 
-	for(; oy > 0; oy--) {
-		*(volatile uint32_t *) offset = color;
-		offset += nx;
+		if (n) *(fb_u32 *)q = color;
 	}
 }
 #endif
 
-#ifdef USE_24BPP
+#if defined(USE_24BPP) || defined(USE_18BPP)
+/* 8 pixels take 3 words */
 static void
-fb_draw_hline_24bpp(int x, int y, int length, kx_rgba color)
+fb_fill_rect_24bpp(int x, int y, int width, int height, kx_rgba color)
 {
-	static char *offset;
-	static int ox, oy, nx;
+	unsigned char c[24];
+	fb_word w[3], *q;
+	char *row, *p;
+	int i, n;
 
-	fb_respect_angle(x, y, &ox, &oy, &nx);
-	offset = fb.backbuffer + oy * fb.stride + (ox + (ox << 1));
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	if (!fb_clip(&x, &y, &width, &height)) return;
 
-	if (length > fb.width - x)
-		oy = fb.width - x;
-	else
-		oy = length;
+	for (i = 0; i < 24; i += 3) {
+		c[i] = color & 0x000000FF;
+		c[i + 1] = (color & 0x0000FF00) >> 8;
+		c[i + 2] = (color & 0x00FF0000) >> 16;
+	}
+	memcpy(w, c, sizeof(w));
+
+	row = fb.canvas + y * fb.canvas_stride + (x + (x << 1));
+	for (; height > 0; height--, row += fb.canvas_stride) {
+		p = row;
+		n = width;
+		/* Word boundary is met on some pixel boundary */
+		for (; ((unsigned long)p & 7) && n > 0; n--) {
+			p[0] = c[0];
+			p[1] = c[1];
+			p[2] = c[2];
+			p += 3;
+		}
+
+		q = (fb_word *)p;
+		for (; n >= 8; n -= 8) {
+			q[0] = w[0];
+			q[1] = w[1];
+			q[2] = w[2];
+			q += 3;
+		}
 
-	for(; oy > 0; oy--) {
-		*(volatile char *) (offset) = (color & 0x000000FF);
-		*(volatile char *) (offset + 1) = (color & 0x0000FF00) >> 8;
-		*(volatile char *) (offset + 2) = (color & 0x00FF0000) >> 16;
-		offset += nx;
+		for (p = (char *)q; n > 0; n--) {
+			p[0] = c[0];
+			p[1] = c[1];
+			p[2] = c[2];
+			p += 3;
+		}
 	}
 }
 #endif
 
-#ifdef USE_18BPP
+#ifdef USE_16BPP
 static void
-fb_draw_hline_18bpp(int x, int y, int length, kx_rgba color)
+fb_fill_rect_16bpp(int x, int y, int width, int height, kx_rgba color)
 {
-	static char *offset;
-	static int ox, oy, nx;
+	uint16_t c = (uint16_t) color;
+	fb_word w = c;
+	fb_word *q;
+	fb_u16 *p;
+	char *row;
+	int n;
+
+	if (!fb_clip(&x, &y, &width, &height)) return;
+
+	w |= w << 16;
+	w |= w << 32;
+
+	row = fb.canvas + y * fb.canvas_stride + (x << 1);
+	for (; height > 0; height--, row += fb.canvas_stride) {
+		p = (fb_u16 *)row;
+		n = width;
+		for (; ((unsigned long)p & 7) && n > 0; n--)
+			*(p++) = c;
+
+		q = (fb_word *)p;
+		for (; n >= 4; n -= 4)
+			*(q++) = w;
+
+		for (p = (fb_u16 *)q; n > 0; n--)
+			*(p++) = c;
+	}
+}
+#endif
 
-	fb_respect_angle(x, y, &ox, &oy, &nx);
-	offset = fb.backbuffer + oy * fb.stride + (ox + (ox << 1));
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+/**************************************************************************
+ * Rotation routines
+ */
+#ifdef USE_32BPP
+static void
+fb_rotate_span_32bpp(const char *src, int step, char *dst, int n)
+{
+	uint32_t *d = (uint32_t *)dst;
 
-	if (length > fb.width - x)
-		oy = fb.width - x;
-	else
-		oy = length;
+	for(; n > 0; n--) {
+		*(d++) = *(const uint32_t *)src;
+		src += step;
+	}
+}
+#endif
 
-	for(; oy > 0; oy--) {
-		*(volatile char *) (offset) = (color & 0x000000FF);
-		*(volatile char *) (offset + 1) = (color & 0x0000FF00) >> 8;
-		*(volatile char *) (offset + 2) = (color & 0x00FF0000) >> 16;
-		offset += nx;
+#if defined(USE_24BPP) || defined(USE_18BPP)
+static void
+fb_rotate_span_24bpp(const char *src, int step, char *dst, int n)
+{
+	for(; n > 0; n--) {
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		dst += 3;
+		src += step;
 	}
 }
 #endif
 
 #ifdef USE_16BPP
 static void
-fb_draw_hline_16bpp(int x, int y, int length, kx_rgba color)
+fb_rotate_span_16bpp(const char *src, int step, char *dst, int n)
 {
-	static char *offset;
-	static int ox, oy, nx;
+	uint16_t *d = (uint16_t *)dst;
 
-	fb_respect_angle(x, y, &ox, &oy, &nx);
-	offset = fb.backbuffer + oy * fb.stride + (ox << 1);
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	for(; n > 0; n--) {
+		*(d++) = *(const uint16_t *)src;
+		src += step;
+	}
+}
+#endif
 
-	if (length > fb.width - x)
-		oy = fb.width - x;
-	else
-		oy = length;
+/* Rotated copy is done by tiles which columns stay in cache */
+#define FB_TILE	16
 
-	for(; oy > 0; oy--) {
-		*(volatile uint16_t *) offset = (uint16_t) color;
-		offset += nx;
+/* Rotate logical rectangle of canvas into physical buffer 'dst' */
+static void fb_rotate_rect(kx_rect *r, char *dst)
+{
+	const int bpp = fb.byte_pp, cs = fb.canvas_stride;
+	int tx, ty, x, y, x2, y2;
+
+	if (180 == fb.angle) {
+		/* Rows are reversed. No tiles needed */
+		x2 = r->x + r->width;
+		for (y = r->y; y < r->y + r->height; y++)
+			fb.rotate_span(fb.canvas + y * cs + (x2 - 1) * bpp, -bpp,
+					dst + (fb.real_height - 1 - y) * fb.stride
+						+ (fb.real_width - x2) * bpp,
+					r->width);
+		return;
+	}
+
+	/* Logical columns become physical rows */
+	for (ty = r->y; ty < r->y + r->height; ty += FB_TILE) {
+		y2 = ty + FB_TILE;
+		if (y2 > r->y + r->height) y2 = r->y + r->height;
+
+		for (tx = r->x; tx < r->x + r->width; tx += FB_TILE) {
+			x2 = tx + FB_TILE;
+			if (x2 > r->x + r->width) x2 = r->x + r->width;
+
+			for (x = tx; x < x2; x++) {
+				if (90 == fb.angle)
+					fb.rotate_span(fb.canvas + ty * cs + x * bpp, cs,
+							dst + (fb.real_height - 1 - x) * fb.stride
+								+ ty * bpp,
+							y2 - ty);
+				else
+					fb.rotate_span(fb.canvas + (y2 - 1) * cs + x * bpp, -cs,
+							dst + x * fb.stride
+								+ (fb.real_width - y2) * bpp,
+							y2 - ty);
+			}
+		}
 	}
 }
-#endif
 
 /*
  * NOTE: klibc uses 8bit transfers that breaks image on tosa
@@ -307,21 +525,274 @@ fb_memcpy(char *src, char *dst, int length)
 	}
 }
 
-/* Move backbuffer contents to videomemory */
+/* Get row span of physical rectangle in transfer units.
+ * Transfers are aligned to their width */
+static void rect_span(kx_rect *r, int *start, int *end)
+{
+	int unit = sizeof(USE_FB_TRANS_TYPE);
+
+	*start = r->x * fb.byte_pp / unit;
+	*end = ((r->x + r->width) * fb.byte_pp + unit - 1) / unit;
+	if (*end * unit > fb.stride) *end = fb.stride / unit;
+}
+
+/* Copy changed parts of physical rectangle rows to videomemory */
+static void fb_render_rect(kx_rect *r)
+{
+	static USE_FB_TRANS_TYPE *b, *s;
+	int unit = sizeof(USE_FB_TRANS_TYPE);
+	int y, off, start, end, lo, hi;
+
+	rect_span(r, &start, &end);
+
+	for (y = r->y; y < r->y + r->height; y++) {
+		off = y * fb.stride;
+		b = (USE_FB_TRANS_TYPE *)(fb.backbuffer + off);
+		s = (USE_FB_TRANS_TYPE *)(fb.shadow + off);
+
+		/* Skip unchanged head and tail of row */
+		for (lo = start; lo < end && b[lo] == s[lo]; lo++);
+		if (lo == end) continue;
+		for (hi = end; b[hi - 1] == s[hi - 1]; hi--);
+
+		fb_memcpy((char *)(b + lo), fb.data + off + lo * unit,
+				(hi - lo) * unit);
+		memcpy(s + lo, b + lo, (hi - lo) * unit);
+	}
+}
+
+#ifdef USE_FB_FLIP
+/* Bring hidden page up to date with visible one before drawing.
+ * Only regions changed by last flip are copied */
+static void fb_flip_sync(void)
+{
+	int unit = sizeof(USE_FB_TRANS_TYPE);
+	int i, y, off, start, end;
+	char *front;
+
+	if (0 == fb.stale_count) return;
+
+	front = fb.data + fb.page * fb.screensize;
+	for (i = 0; i < fb.stale_count; i++) {
+		rect_span(&fb.stale[i], &start, &end);
+		for (y = fb.stale[i].y; y < fb.stale[i].y + fb.stale[i].height; y++) {
+			off = y * fb.stride + start * unit;
+			fb_memcpy(front + off, fb.backbuffer + off, (end - start) * unit);
+		}
+	}
+	fb.stale_count = 0;
+}
+
+/* Show hidden page. Return -1 when panning fails */
+static int fb_flip_page(void)
+{
+	int hidden = 1 - fb.page;
+	int i;
+
+	/* Nothing is drawn. Hidden page may be not synced yet */
+	if (0 == fb.damage_count) return 0;
+
+#if USE_FB_FLIP
+	i = 0;
+	ioctl(fb.fd, FBIO_WAITFORVSYNC, &i);
+#endif
+
+	fb.var.xoffset = 0;
+	fb.var.yoffset = hidden * fb.real_height;
+	if (-1 == ioctl(fb.fd, FBIOPAN_DISPLAY, &fb.var)) return -1;
+
+	fb.page = hidden;
+	fb.backbuffer = fb.data + (1 - hidden) * fb.screensize;
+	if (!fb.rotated) fb.canvas = fb.backbuffer;
+
+	/* New hidden page misses what was drawn on other one */
+	for (i = 0; i < fb.damage_count; i++)
+		fb.stale[i] = fb.damage[i];
+	fb.stale_count = fb.damage_count;
+	fb.damage_count = 0;
+
+	return 0;
+}
+
+/* Return to copying from RAM backbuffer */
+static void fb_flip_disable(void)
+{
+	char *buf;
+
+	buf = malloc(fb.screensize);
+	if (NULL == buf) return;
+
+	fb_flip_sync();
+	fb_memcpy(fb.backbuffer, buf, fb.screensize);
+	fb.backbuffer = buf;
+	if (!fb.rotated) fb.canvas = fb.backbuffer;
+	fb.data += fb.page * fb.screensize;
+	fb.shadow = malloc(fb.screensize);
+	fb.shadow_valid = 0;
+	fb.flip = 0;
+}
+#else
+#define fb_flip_sync()	do { } while (0)
+#endif
+
+/* Move changed parts of backbuffer to videomemory */
 void fb_render()
 {
-	fb_memcpy(fb.backbuffer, fb.data, fb.screensize);
+	int i;
+	kx_rect all;
+
+	if (fb.rotated && (NULL == fb.shadow || !fb.shadow_valid)
+#ifdef USE_FB_FLIP
+			&& !fb.flip
+#endif
+	) {
+		/* Whole backbuffer is copied below */
+		all.x = all.y = 0;
+		all.width = fb.width;
+		all.height = fb.height;
+		fb_rotate_rect(&all, fb.backbuffer);
+	}
+
+	/* Damage is physical from here */
+	for (i = 0; i < fb.damage_count; i++) {
+		if (fb.rotated) {
+			fb_rotate_rect(&fb.damage[i], fb.backbuffer);
+			rect_to_phys(&fb.damage[i]);
+		}
+	}
+
+#ifdef USE_FB_FLIP
+	if (fb.flip) {
+		if (0 == fb_flip_page()) return;
+		log_msg(lg, "Can't pan framebuffer: %s", ERRMSG);
+		fb_flip_disable();
+		if (fb.flip) return;
+	}
+#endif
+
+	if (NULL == fb.shadow || !fb.shadow_valid) {
+		/* Videomemory contents is unknown */
+		fb_memcpy(fb.backbuffer, fb.data, fb.screensize);
+		if (fb.shadow) {
+			memcpy(fb.shadow, fb.backbuffer, fb.screensize);
+			fb.shadow_valid = 1;
+		}
+	} else {
+		for (i = 0; i < fb.damage_count; i++)
+			fb_render_rect(&fb.damage[i]);
+	}
+
+	fb.damage_count = 0;
+
+#ifdef USE_FB_MEMORY
+	if (fb.dump) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s%05u.ppm", fb.dump, ++fb.frame);
+		fb_save_ppm(path);
+	}
+#endif
+}
+
+#ifdef USE_FB_MEMORY
+/* Get color components of pixel at 'p'. Reverse of compose_color() */
+static void fb_pixel_rgb(const char *p, unsigned char *rgb)
+{
+	uint32_t v;
+	uint16_t v16;
+	unsigned int c1, c2, c3, t;
+
+	/* Same switch as in compose_color() */
+	switch (fb.bpp) {
+	case 16:
+		memcpy(&v16, p, sizeof(v16));
+		rgb[0] = (v16 >> 11) << 3;
+		rgb[1] = ((v16 >> 5) & 0x3F) << 2;
+		rgb[2] = (v16 & 0x1F) << 3;
+		break;
+	case 18:
+		c1 = (unsigned char)p[2];
+		c2 = (unsigned char)p[1];
+		c3 = (unsigned char)p[0];
+		rgb[0] = (c1 & 0x3F) << 2;
+		rgb[1] = ((c1 >> 6) << 2) | ((c2 & 0x0F) << 4);
+		rgb[2] = ((c2 >> 4) << 2) | ((c3 & 0x03) << 6);
+		break;
+	case 24:
+		rgb[0] = p[2];
+		rgb[1] = p[1];
+		rgb[2] = p[0];
+		break;
+	default:
+		memcpy(&v, p, sizeof(v));
+		rgb[0] = v >> 16;
+		rgb[1] = v >> 8;
+		rgb[2] = v;
+		break;
+	}
+
+	/* Components are swapped by compose_color() unless mode is RGB */
+	if (RGB != fb.rgbmode) {
+		t = rgb[0];
+		rgb[0] = rgb[2];
+		rgb[2] = t;
+	}
+}
+
+int fb_save_ppm(const char *path)
+{
+	unsigned char *row;
+	const char *src, *ext;
+	int x, y, rc = 0;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (NULL == f) {
+		log_msg(lg, "Can't create %s: %s", path, ERRMSG);
+		return -1;
+	}
+
+	row = malloc(fb.real_width * 3);
+	if (NULL == row) {
+		fclose(f);
+		return -1;
+	}
+
+	ext = strrchr(path, '.');
+	if (ext && 0 == strcmp(ext, ".pam"))
+		fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 3\nMAXVAL 255\n"
+				"TUPLTYPE RGB\nENDHDR\n", fb.real_width, fb.real_height);
+	else
+		fprintf(f, "P6\n%d %d\n255\n", fb.real_width, fb.real_height);
+
+	src = fb.data;
+#ifdef USE_FB_FLIP
+	if (fb.flip) src += fb.page * fb.screensize;
+#endif
+	for (y = 0; y < fb.real_height && 0 == rc; y++) {
+		for (x = 0; x < fb.real_width; x++)
+			fb_pixel_rgb(src + y * fb.stride + x * fb.byte_pp, row + x * 3);
+		if (1 != fwrite(row, fb.real_width * 3, 1, f)) rc = -1;
+	}
+
+	free(row);
+	if (0 != fclose(f)) rc = -1;
+	if (-1 == rc) log_msg(lg, "Can't write %s: %s", path, ERRMSG);
+
+	return rc;
 }
+#endif
 
 /* Save backbuffer contents to further usage */
 char *fb_dump()
 {
 	char *dump;
 
-	dump = malloc(fb.screensize);
+	dump = malloc(fb.canvas_size);
 	if (NULL == dump) return NULL;
 
-	fb_memcpy(fb.backbuffer, dump, fb.screensize);
+	fb_flip_sync();
+	fb_memcpy(fb.canvas, dump, fb.canvas_size);
 	return dump;
 }
 
@@ -329,16 +800,40 @@ char *fb_dump()
 void fb_restore(char *dump)
 {
 	if (NULL == dump) return;
-	fb_memcpy(dump, fb.backbuffer, fb.screensize);
+#ifdef USE_FB_FLIP
+	/* Whole hidden page is overwritten */
+	fb.stale_count = 0;
+#endif
+	fb_memcpy(dump, fb.canvas, fb.canvas_size);
+	fb_damage(0, 0, fb.width, fb.height);
 }
 
 
 void fb_destroy()
 {
+#ifdef USE_FB_FLIP
+	if (fb.flip) {
+		/* Leave picture on first page for console and next kernel */
+		if (fb.page) {
+			fb_memcpy(fb.data + fb.screensize, fb.data, fb.screensize);
+			fb.var.yoffset = 0;
+			ioctl(fb.fd, FBIOPAN_DISPLAY, &fb.var);
+		}
+		fb.backbuffer = NULL;
+	}
+#endif
 	if (fb.fd >= 0)
 		close(fb.fd);
+#ifdef USE_FB_MEMORY
+	if (fb.memory)
+		free(fb.base);
+#endif
 	if(fb.backbuffer)
 		free(fb.backbuffer);
+	if(fb.shadow)
+		free(fb.shadow);
+	if(fb.rotated)
+		free(fb.canvas);
 }
 
 int
@@ -403,6 +898,42 @@ attempt_to_change_pixel_format(struct fb_var_screeninfo *fb_var)
 	return 0;
 }
 
+#ifdef USE_FB_FLIP
+/* Get two pages in virtual area and check that panning works.
+ * Return 1 when pages may be flipped */
+static int fb_flip_init(struct fb_var_screeninfo *fb_var,
+		struct fb_fix_screeninfo *fb_fix)
+{
+	unsigned long page = (unsigned long)fb_fix->line_length * fb_var->yres;
+
+	if ( (fb_fix->smem_len < 2 * page) || (0 == fb_fix->ypanstep) ) {
+		log_msg(lg, "Framebuffer can't flip pages, copying is used");
+		return 0;
+	}
+
+	if (fb_var->yres_virtual < 2 * fb_var->yres) {
+		fb_var->yres_virtual = 2 * fb_var->yres;
+		if ( (ioctl(fb.fd, FBIOPUT_VSCREENINFO, fb_var) == -1)
+				|| (ioctl(fb.fd, FBIOGET_VSCREENINFO, fb_var) == -1)
+				|| (ioctl(fb.fd, FBIOGET_FSCREENINFO, fb_fix) == -1)
+				|| (fb_var->yres_virtual < 2 * fb_var->yres) ) {
+			log_msg(lg, "Can't get two framebuffer pages, copying is used");
+			return 0;
+		}
+	}
+
+	fb_var->xoffset = 0;
+	fb_var->yoffset = 0;
+	if (ioctl(fb.fd, FBIOPAN_DISPLAY, fb_var) == -1) {
+		log_msg(lg, "Framebuffer can't be panned, copying is used");
+		return 0;
+	}
+
+	log_msg(lg, "Framebuffer pages are flipped");
+	return 1;
+}
+#endif
+
 #ifdef DEBUG
 void print_fb()
 {
@@ -417,6 +948,9 @@ void print_fb()
 
 	log_msg(lg, "Screensize: %d", fb.screensize);
 	log_msg(lg, "Angle: %d", fb.angle);
+#ifdef USE_FB_FLIP
+	log_msg(lg, "Page flipping: %d", fb.flip);
+#endif
 
 	log_msg(lg, "RGBmode: %d", fb.rgbmode);
 	log_msg(lg, "Red offset: %d, red length: %d", fb.red_offset, fb.red_length);
@@ -425,29 +959,21 @@ void print_fb()
 }
 #endif
 
-int fb_new(int angle)
+/* Open framebuffer device and map its videomemory */
+static int fb_open_device(const char *fbdev)
 {
 	struct fb_var_screeninfo fb_var;
 	struct fb_fix_screeninfo fb_fix;
 	int off;
-	char *fbdev;
-
-	fbdev = getenv("FBDEV");
-	if (fbdev == NULL)
-		fbdev = "/dev/fb0";
-
-	memset(&fb, 0, sizeof(FB));
-
-	fb.fd = -1;
 
 	if ((fb.fd = open(fbdev, O_RDWR)) < 0) {
-		log_msg(lg, "Error opening /dev/fb0: %s", ERRMSG);
-		goto fail;
+		log_msg(lg, "Error opening %s: %s", fbdev, ERRMSG);
+		return -1;
 	}
 
 	if (ioctl(fb.fd, FBIOGET_VSCREENINFO, &fb_var) == -1) {
 		log_msg(lg, "Error getting variable framebuffer info: %s", ERRMSG);
-		goto fail;
+		return -1;
 	}
 
 	if (fb_var.bits_per_pixel < 16)
@@ -457,12 +983,12 @@ int fb_new(int angle)
 			"Trying to change pixel format...",
 			fb_var.bits_per_pixel);
 		if (!attempt_to_change_pixel_format(&fb_var))
-			goto fail;
+			return -1;
 	}
 	if (ioctl (fb.fd, FBIOGET_VSCREENINFO, &fb_var) == -1)
 	{
 		log_msg(lg, "Error getting variable framebuffer info (2): %s", ERRMSG);
-		goto fail;
+		return -1;
 	}
 
 	/* NB: It looks like the fbdev concept of fixed vs variable screen info is
@@ -470,20 +996,21 @@ int fb_new(int angle)
 	 * if you set a new pixel format. */
 	if (ioctl(fb.fd, FBIOGET_FSCREENINFO, &fb_fix) == -1) {
 		log_msg(lg, "Error getting fixed framebuffer info: %s", ERRMSG);
-		goto fail;
+		return -1;
 	}
 
-	fb.real_width = fb.width = fb_var.xres;
-	fb.real_height = fb.height = fb_var.yres;
+#ifdef USE_FB_FLIP
+	fb.flip = fb_flip_init(&fb_var, &fb_fix);
+	fb.var = fb_var;
+#endif
+
+	fb.real_width = fb_var.xres;
+	fb.real_height = fb_var.yres;
 	fb.bpp = fb_var.bits_per_pixel;
-	fb.byte_pp = fb.bpp >> 3;
 	fb.stride = fb_fix.line_length;
 	fb.type = fb_fix.type;
 	fb.visual = fb_fix.visual;
 
-	fb.screensize = fb.stride * fb.height;
-	fb.backbuffer = malloc(fb.screensize);
-
 	fb.red_offset = fb_var.red.offset;
 	fb.red_length = fb_var.red.length;
 	fb.green_offset = fb_var.green.offset;
@@ -491,26 +1018,21 @@ int fb_new(int angle)
 	fb.blue_offset = fb_var.blue.offset;
 	fb.blue_length = fb_var.blue.length;
 
-	fb.depth = fb.red_length + fb.green_length + fb.blue_length;
-	if (18 != fb.depth) fb.depth = fb.bpp;	/* according to some info 18bpp is reported as 24bpp */
-
-	if ((fb.red_offset > fb.green_offset) && (fb.green_offset > fb.blue_offset)) {
-		fb.rgbmode = RGB;
-	} else if ((fb.red_offset < fb.green_offset) && (fb.green_offset < fb.blue_offset)) {
-		fb.rgbmode = BGR;
-	} else {
-		fb.rgbmode = GENERIC;
-	}
+	fb.screensize = fb.stride * fb.real_height;
 
 	fb.base = (char *) mmap((caddr_t) NULL,
 				 /*fb_fix.smem_len */
-				 fb.stride * fb.height,
+#ifdef USE_FB_FLIP
+				 fb.flip ? 2 * fb.screensize :
+#endif
+				 fb.screensize,
 				 PROT_READ | PROT_WRITE,
 				 MAP_SHARED, fb.fd, 0);
 
 	if (fb.base == (char *) -1) {
+		fb.base = NULL;
 		log_msg(lg, "Error cannot mmap framebuffer: %s", ERRMSG);
-		goto fail;
+		return -1;
 	}
 
 	off =
@@ -518,6 +1040,145 @@ int fb_new(int angle)
 	    (unsigned long) getpagesize();
 
 	fb.data = fb.base + off;
+	return 0;
+}
+
+
+#ifdef USE_FB_MEMORY
+/* Create surface in RAM by spec 'WIDTHxHEIGHT[xBPP][:bgr][:angle]'.
+ * 18 bpp is stored in 3 bytes like on real hardware */
+static int fb_open_memory(const char *spec, int *angle)
+{
+	char *p, *opt;
+	int bgr = 0;
+	int shift[3];	/* red, green, blue offsets in RGB order */
+	int len;
+
+	fb.real_width = get_nni(spec, &p);
+	if (fb.real_width <= 0 || 'x' != *p) goto bad;
+	fb.real_height = get_nni(p + 1, &p);
+	if (fb.real_height <= 0) goto bad;
+
+	fb.bpp = 32;
+	if ('x' == *p) {
+		fb.bpp = get_nni(p + 1, &p);
+		if (fb.bpp < 0) goto bad;
+	}
+
+	while (':' == *p) {
+		opt = p + 1;
+		if (0 == strncmp(opt, "bgr", 3)) {
+			bgr = 1;
+			p = opt + 3;
+		} else if (0 == strncmp(opt, "rgb", 3)) {
+			bgr = 0;
+			p = opt + 3;
+		} else {
+			*angle = get_nni(opt, &p);
+			if (*angle < 0 || p == opt) goto bad;
+		}
+	}
+	if ('\0' != *p) goto bad;
+
+	switch (fb.bpp) {
+	case 16:
+		len = 5;
+		shift[0] = 11; shift[1] = 5; shift[2] = 0;
+		break;
+	case 18:
+		fb.bpp = 24;
+		len = 6;
+		shift[0] = 12; shift[1] = 6; shift[2] = 0;
+		break;
+	case 24:
+	case 32:
+		len = 8;
+		shift[0] = 16; shift[1] = 8; shift[2] = 0;
+		break;
+	default:
+		goto bad;
+	}
+
+	fb.red_length = fb.blue_length = len;
+	fb.green_length = (16 == fb.bpp) ? 6 : len;
+	fb.red_offset = bgr ? shift[2] : shift[0];
+	fb.green_offset = shift[1];
+	fb.blue_offset = bgr ? shift[0] : shift[2];
+
+	/* Transfers are done by words */
+	fb.stride = (fb.real_width * (fb.bpp >> 3) + 3) & ~3;
+	fb.screensize = fb.stride * fb.real_height;
+	fb.type = FB_TYPE_PACKED_PIXELS;
+	fb.visual = FB_VISUAL_TRUECOLOR;
+
+	fb.base = calloc(1, fb.screensize);
+	if (NULL == fb.base) {
+		DPRINTF("Can't allocate memory surface");
+		return -1;
+	}
+	fb.data = fb.base;
+	fb.memory = 1;
+
+	/* Every rendered frame is saved when prefix is given */
+	fb.dump = getenv("FBDUMP");
+
+	log_msg(lg, "Using %dx%d memory surface", fb.real_width, fb.real_height);
+	return 0;
+
+bad:
+	log_msg(lg, "Wrong memory surface spec '%s'", spec);
+	return -1;
+}
+#endif
+
+
+int fb_new(int angle)
+{
+	char *fbdev;
+
+	fbdev = getenv("FBDEV");
+	if (fbdev == NULL)
+		fbdev = "/dev/fb0";
+
+	memset(&fb, 0, sizeof(FB));
+
+	fb.fd = -1;
+
+#ifdef USE_FB_MEMORY
+	if (0 == strncmp(fbdev, "mem:", 4)) {
+		if (-1 == fb_open_memory(fbdev + 4, &angle)) goto fail;
+	} else
+#endif
+	if (-1 == fb_open_device(fbdev)) goto fail;
+
+	fb.width = fb.real_width;
+	fb.height = fb.real_height;
+	fb.byte_pp = fb.bpp >> 3;
+
+#ifdef USE_FB_FLIP
+	/* Hidden page is used instead of backbuffer */
+	if (fb.flip) {
+		fb.page = 0;
+		fb.backbuffer = fb.data + fb.screensize;
+	} else
+#endif
+	{
+		fb.backbuffer = malloc(fb.screensize);
+		/* Only changed pixels are written to videomemory when we have shadow */
+		fb.shadow = malloc(fb.screensize);
+	}
+
+	fb.depth = fb.red_length + fb.green_length + fb.blue_length;
+	if (18 != fb.depth) fb.depth = fb.bpp;	/* according to some info 18bpp is reported as 24bpp */
+
+	if ((fb.red_offset > fb.green_offset) && (fb.green_offset > fb.blue_offset)) {
+		fb.rgbmode = RGB;
+	} else if ((fb.red_offset < fb.green_offset) && (fb.green_offset < fb.blue_offset)) {
+		fb.rgbmode = BGR;
+	} else {
+		fb.rgbmode = GENERIC;
+	}
+
 	fb.angle = angle;
 
 	switch (fb.angle) {
@@ -525,13 +1186,32 @@ int fb_new(int angle)
 	case 90:
 		fb.width = fb.real_height;
 		fb.height = fb.real_width;
-		break;
+		/* fall through */
 	case 180:
+		fb.rotated = 1;
+		break;
 	case 0:
 	default:
+		fb.angle = 0;
 		break;
 	}
 
+	if (fb.rotated) {
+		/* Drawing is not rotated. Canvas is rotated on render only */
+		fb.canvas_stride = (fb.width * fb.byte_pp + 3) & ~3;
+		fb.canvas_size = fb.canvas_stride * fb.height;
+		fb.canvas = malloc(fb.canvas_size);
+		if (NULL == fb.canvas) {
+			fb.rotated = 0;
+			log_msg(lg, "Can't allocate rotation canvas");
+			goto fail;
+		}
+	} else {
+		fb.canvas = fb.backbuffer;
+		fb.canvas_stride = fb.stride;
+		fb.canvas_size = fb.screensize;
+	}
+
 #ifdef DEBUG
 	print_fb(fb);
 #endif
@@ -540,25 +1220,29 @@ int fb_new(int angle)
 #ifdef USE_32BPP
 	case 32:
 		fb.plot_pixel = fb_plot_pixel_32bpp;
-		fb.draw_hline = fb_draw_hline_32bpp;
+		fb.fill_rect = fb_fill_rect_32bpp;
+		fb.rotate_span = fb_rotate_span_32bpp;
 		break;
 #endif
 #ifdef USE_24BPP
 	case 24:
 		fb.plot_pixel = fb_plot_pixel_24bpp;
-		fb.draw_hline = fb_draw_hline_24bpp;
+		fb.fill_rect = fb_fill_rect_24bpp;
+		fb.rotate_span = fb_rotate_span_24bpp;
 		break;
 #endif
 #ifdef USE_18BPP
 	case 18:
 		fb.plot_pixel = fb_plot_pixel_18bpp;
-		fb.draw_hline = fb_draw_hline_18bpp;
+		fb.fill_rect = fb_fill_rect_24bpp;
+		fb.rotate_span = fb_rotate_span_24bpp;
 		break;
 #endif
 #ifdef USE_16BPP
 	case 16:
 		fb.plot_pixel = fb_plot_pixel_16bpp;
-		fb.draw_hline = fb_draw_hline_16bpp;
+		fb.fill_rect = fb_fill_rect_16bpp;
+		fb.rotate_span = fb_rotate_span_16bpp;
 		break;
 #endif
 	default:
@@ -586,7 +1270,9 @@ void fb_plot_pixel(int x, int y, kx_rgba rgba)
 
 	color = compose_color(rgba);
 
+	fb_flip_sync();
 	fb.plot_pixel(x, y, color);
+	fb_damage(x, y, 1, 1);
 }
 
 
@@ -596,20 +1282,23 @@ void fb_draw_hline(int x, int y, int length, kx_rgba rgba)
 
 	color = compose_color(rgba);
 
-	fb.draw_hline(x, y, length, color);
+	fb_flip_sync();
+	fb.fill_rect(x, y, length, 1, color);
+	fb_damage(x, y, length, 1);
 }
 
 
 void fb_draw_rect(int x, int y, int width, int height,
 		kx_rgba rgba)
 {
-	static int dy;
 	kx_rgba color;
 
 	color = compose_color(rgba);
 
-	for (dy = y; dy < y+height; dy++)
-		fb.draw_hline(x, dy, width, color);
+	fb_flip_sync();
+	fb.fill_rect(x, y, width, height, color);
+
+	fb_damage(x, y, width, height);
 }
 
 
@@ -623,17 +1312,21 @@ void fb_draw_rounded_rect(int x, int y, int width, int height,
 
 	color = compose_color(rgba);
 
+	fb_flip_sync();
+
 	/* Top rounded part */
 	dy = y;
-	fb.draw_hline(x+2, dy++, width-4, color);
-	fb.draw_hline(x+1, dy++, width-2, color);
+	fb.fill_rect(x+2, dy++, width-4, 1, color);
+	fb.fill_rect(x+1, dy++, width-2, 1, color);
 
-	for (; dy < y+height-2; dy++)
-		fb.draw_hline(x, dy, width, color);
+	fb.fill_rect(x, dy, width, height-4, color);
+	dy += height-4;
 
 	/* Bottom rounded part */
-	fb.draw_hline(x+1, dy++, width-2, color);
-	fb.draw_hline(x+2, dy++, width-4, color);
+	fb.fill_rect(x+1, dy++, width-2, 1, color);
+	fb.fill_rect(x+2, dy++, width-4, 1, color);
+
+	fb_damage(x, y, width, height);
 }
 
 
@@ -695,15 +1388,17 @@ int fb_draw_constrained_text(int x, int y,
 		int max_x, int max_y, kx_rgba rgba,
 		const Font * font, const char *text)
 {
-	int h, w, cx, cy, dx, dy;
+	int h, w, cx, cy, dx, dy, mx;
 	char *c = (char *) text;
 	u_int32_t gl;
 	kx_rgba color;
 
 	color = compose_color(rgba);
 
+	fb_flip_sync();
 	h = font->height;
 	dx = x; dy = y;
+	mx = x;
 
 	for(; *c;c++){
 		u_int32_t *glyph = NULL;
@@ -742,8 +1437,10 @@ int fb_draw_constrained_text(int x, int y,
 		}
 
 		dx += w;
+		if (dx > mx) mx = dx;
 	}
 
+	fb_damage(x, y, mx - x, dy - y + h);
 	return dy - y + h;
 }
 
@@ -764,6 +1461,7 @@ void fb_draw_picture(int x, int y, kx_picture *pic)
 	int dx = 0, dy = 0;
 	kx_rgba *pixel, color;
 
+	fb_flip_sync();
 	pixel = pic->pixels;
 	dy = y;
 	for (i = 0; i < pic->height; i++) {
@@ -780,6 +1478,8 @@ void fb_draw_picture(int x, int y, kx_picture *pic)
 		}
 		++dy;
 	}
+
+	fb_damage(x, y, pic->width, pic->height);
 }
 
 /* Free picture's data structure */
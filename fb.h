@@ -41,9 +41,22 @@
 typedef void (*plot_pixel_func)(int x, int y,
 		kx_rgba color);
 
-typedef void (*draw_hline_func)(int x, int y, int length,
+typedef void (*fill_rect_func)(int x, int y, int width, int height,
 		kx_rgba color);
 
+/* Copy 'n' pixels taken by 'step' bytes to consecutive pixels at 'dst' */
+typedef void (*rotate_span_func)(const char *src, int step, char *dst,
+		int n);
+
+/* Rectangle in framebuffer coordinates */
+typedef struct {
+	int x, y;
+	int width, height;
+} kx_rect;
+
+/* Damaged rectangles kept until render. More are merged together */
+#define FB_DAMAGE_MAX	8
+
 typedef struct FB {
 	int fd;
 	int type;
@@ -55,8 +68,31 @@ typedef struct FB {
 	int stride;
 	char *data;
 	char *backbuffer;
+	char *shadow;	/* Copy of videomemory contents */
+	char *canvas;	/* Drawing is done here in logical orientation */
+	int canvas_stride;
+	int canvas_size;
+	int rotated;	/* Canvas is rotated into backbuffer on render */
 	char *base;
 
+	kx_rect damage[FB_DAMAGE_MAX];	/* Changed since last render */
+	int damage_count;
+	int shadow_valid;
+
+#ifdef USE_FB_FLIP
+	int flip;		/* Backbuffer is hidden page of videomemory */
+	int page;		/* Visible page number */
+	struct fb_var_screeninfo var;
+	kx_rect stale[FB_DAMAGE_MAX];	/* Hidden page is behind visible here */
+	int stale_count;
+#endif
+
+#ifdef USE_FB_MEMORY
+	int memory;		/* Surface is in RAM instead of device */
+	char *dump;		/* Prefix of frame files saved on render */
+	unsigned int frame;
+#endif
+
 	int screensize;
 	int angle;
 	int real_width, real_height;
@@ -70,7 +106,8 @@ typedef struct FB {
 	int blue_length;
 
 	plot_pixel_func plot_pixel;
-	draw_hline_func draw_hline;
+	fill_rect_func fill_rect;
+	rotate_span_func rotate_span;
 } FB;
 
 FB fb;
@@ -115,7 +152,7 @@ void
 fb_draw_text(int x, int y, kx_rgba rgba,
 		const Font * font, const char *text);
 
-/* Move backbuffer contents to videomemory */
+/* Move changed parts of backbuffer to videomemory */
 void fb_render();
 
 /* Save backbuffer contents to further usage */
@@ -130,5 +167,11 @@ void fb_draw_picture(int x, int y, kx_picture *pic);
 /* Free picture's data structure */
 void fb_destroy_picture(kx_picture *pic);
 
+#ifdef USE_FB_MEMORY
+/* Save visible picture as PPM or as PAM when 'path' ends with .pam.
+ * Picture is not rotated: it is what panel would show */
+int fb_save_ppm(const char *path);
+#endif
+
 #endif	/* USE_FBMENU */
 #endif	/* _HAVE_FB_H */
@@ -11,7 +11,9 @@
  */
 
 #include <sys/types.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 #include <unistd.h>
@@ -231,6 +233,9 @@ static int check_for_modules(const char *fs_name)
 	return (0);
 }
 
+/* Kernel support of ext4 flavours. Found once by fstype_init() */
+static int ext4_present, ext4dev_present;
+
 static int base_ext4_image(const void *buf, unsigned long long *bytes,
 			   int *test_fs)
 {
@@ -256,14 +261,11 @@ static int base_ext4_image(const void *buf, unsigned long long *bytes,
 
 static int ext4_image(const void *buf, unsigned long long *bytes)
 {
-	int ret, test_fs, ext4dev_present, ext4_present;
+	int ret, test_fs;
 
 	ret = base_ext4_image(buf, bytes, &test_fs);
 	if (ret == 0)
 		return 0;
-	ext4dev_present = (fs_proc_check("ext4dev") ||
-			   check_for_modules("ext4dev"));
-	ext4_present = (fs_proc_check("ext4") || check_for_modules("ext4"));
 	if ((test_fs || !ext4_present) && ext4dev_present)
 		return 0;
 	return 1;
@@ -271,14 +273,11 @@ static int ext4_image(const void *buf, unsigned long long *bytes)
 
 static int ext4dev_image(const void *buf, unsigned long long *bytes)
 {
-	int ret, test_fs, ext4dev_present, ext4_present;
+	int ret, test_fs;
 
 	ret = base_ext4_image(buf, bytes, &test_fs);
 	if (ret == 0)
 		return 0;
-	ext4dev_present = (fs_proc_check("ext4dev") ||
-			   check_for_modules("ext4dev"));
-	ext4_present = (fs_proc_check("ext4") || check_for_modules("ext4"));
 	if ((!test_fs || !ext4dev_present) && ext4_present)
 		return 0;
 	return 1;
@@ -509,10 +508,200 @@ static int btrfs_image(const void *buf, unsigned long long *bytes)
 	return 0;
 }
 
+static int bootimg_image(const void *buf, unsigned long long *bytes)
+{
+	if (!memcmp(buf, "ANDROID!", 8)) {
+		*bytes = 0;
+		return 1;
+	}
+	return 0;
+}
+
+static int fit_image(const void *buf, unsigned long long *bytes)
+{
+	const unsigned char *p = buf;
+
+	/* FIT is flattened device tree. Image nodes are checked by loader */
+	if (p[0] == 0xd0 && p[1] == 0x0d && p[2] == 0xfe && p[3] == 0xed) {
+		*bytes = (unsigned long long)__be32_to_cpu(((const __u32 *)buf)[1]);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Magic value at 'offset' of filesystem block. Identify callback
+ * of filesystem is called only when one of its magics is found.
+ */
+struct fsmagic {
+	unsigned short offset;
+	unsigned char len;
+	const char *magic;
+};
+
+#define FSMAGIC(type, field, len, magic)	{ offsetof(type, field), len, magic }
+#define FSMAGIC_END				{ 0, 0, NULL }
+
+static const struct fsmagic gzip_magic[] = {
+	{ 0, 2, "\037\213" },
+	{ 0, 2, "\037\236" },
+	FSMAGIC_END
+};
+
+static const struct fsmagic cramfs_magic[] = {
+#if __BYTE_ORDER == __BIG_ENDIAN
+	FSMAGIC(struct cramfs_super, magic, 4, "\x28\xcd\x3d\x45"),
+#else
+	FSMAGIC(struct cramfs_super, magic, 4, "\x45\x3d\xcd\x28"),
+#endif
+	FSMAGIC_END
+};
+
+static const struct fsmagic romfs_magic[] = {
+	FSMAGIC(struct romfs_super_block, word0, 8, "-rom1fs-"),
+	FSMAGIC_END
+};
+
+static const struct fsmagic xfs_magic[] = {
+	FSMAGIC(struct xfs_sb, sb_magicnum, 4, "XFSB"),
+	FSMAGIC_END
+};
+
+/* Native and swapped magics give the same bytes on any host */
+static const struct fsmagic squashfs_magic[] = {
+	FSMAGIC(struct squashfs_super_block, s_magic, 4, "hsqs"),
+	FSMAGIC(struct squashfs_super_block, s_magic, 4, "sqsh"),
+	FSMAGIC(struct squashfs_super_block, s_magic, 4, "shsq"),
+	FSMAGIC(struct squashfs_super_block, s_magic, 4, "qshs"),
+	FSMAGIC_END
+};
+
+static const struct fsmagic ext_magic[] = {
+	FSMAGIC(struct ext2_super_block, s_magic, 2, "\x53\xef"),
+	FSMAGIC_END
+};
+
+static const struct fsmagic minix_magic[] = {
+#if __BYTE_ORDER == __BIG_ENDIAN
+	FSMAGIC(struct minix_super_block, s_magic, 2, "\x13\x7f"),
+	FSMAGIC(struct minix_super_block, s_magic, 2, "\x13\x8f"),
+#else
+	FSMAGIC(struct minix_super_block, s_magic, 2, "\x7f\x13"),
+	FSMAGIC(struct minix_super_block, s_magic, 2, "\x8f\x13"),
+#endif
+	FSMAGIC_END
+};
+
+static const struct fsmagic ubi_magic[] = {
+	{ 0, 4, "UBI#" },
+	FSMAGIC_END
+};
+
+static const struct fsmagic jffs2_magic[] = {
+	{ 0, 2, "\x85\x19" },
+	FSMAGIC_END
+};
+
+static const struct fsmagic bootimg_magic[] = {
+	{ 0, 8, "ANDROID!" },
+	FSMAGIC_END
+};
+
+static const struct fsmagic fit_magic[] = {
+	{ 0, 4, "\xd0\x0d\xfe\xed" },
+	FSMAGIC_END
+};
+
+static const struct fsmagic vfat_magic[] = {
+	{ 54, 8, "FAT12   " },
+	{ 54, 8, "FAT16   " },
+	{ 82, 8, "FAT32   " },
+	FSMAGIC_END
+};
+
+static const struct fsmagic nilfs2_magic[] = {
+	FSMAGIC(struct nilfs_super_block, s_magic, 2, "\x34\x34"),
+	FSMAGIC_END
+};
+
+static const struct fsmagic ocfs2_magic[] = {
+	FSMAGIC(struct ocfs2_dinode, i_signature,
+		sizeof(OCFS2_SUPER_BLOCK_SIGNATURE) - 1,
+		OCFS2_SUPER_BLOCK_SIGNATURE),
+	FSMAGIC_END
+};
+
+static const struct fsmagic reiserfs_magic[] = {
+	FSMAGIC(struct reiserfs_super_block, s_v1.s_magic,
+		sizeof(REISERFS_SUPER_MAGIC_STRING) - 1,
+		REISERFS_SUPER_MAGIC_STRING),
+	FSMAGIC(struct reiserfs_super_block, s_v1.s_magic,
+		sizeof(REISER2FS_SUPER_MAGIC_STRING) - 1,
+		REISER2FS_SUPER_MAGIC_STRING),
+	FSMAGIC(struct reiserfs_super_block, s_v1.s_magic,
+		sizeof(REISER2FS_JR_SUPER_MAGIC_STRING) - 1,
+		REISER2FS_JR_SUPER_MAGIC_STRING),
+	FSMAGIC_END
+};
+
+static const struct fsmagic reiser4_magic[] = {
+	FSMAGIC(struct reiser4_master_sb, ms_magic,
+		sizeof(REISER4_SUPER_MAGIC_STRING) - 1,
+		REISER4_SUPER_MAGIC_STRING),
+	FSMAGIC_END
+};
+
+static const struct fsmagic gfs2_magic[] = {
+	FSMAGIC(struct gfs2_sb, sb_header.mh_magic, 4, "\x01\x16\x19\x70"),
+	FSMAGIC_END
+};
+
+static const struct fsmagic btrfs_magic[] = {
+	FSMAGIC(struct btrfs_super_block, magic, BTRFS_MAGIC_L, BTRFS_MAGIC),
+	FSMAGIC_END
+};
+
+static const struct fsmagic jfs_magic[] = {
+	FSMAGIC(struct jfs_superblock, s_magic, 4, JFS_MAGIC),
+	FSMAGIC_END
+};
+
+static const struct fsmagic iso_magic[] = {
+	FSMAGIC(struct iso_volume_descriptor, id, ISO_MAGIC_L, ISO_MAGIC),
+	FSMAGIC(struct iso_hs_volume_descriptor, id, ISO_HS_MAGIC_L, ISO_HS_MAGIC),
+	FSMAGIC_END
+};
+
+static const struct fsmagic luks_magic[] = {
+	FSMAGIC(struct luks_partition_header, magic, LUKS_MAGIC_L, LUKS_MAGIC),
+	FSMAGIC_END
+};
+
+/* lvm2_image() checks both 512 byte sectors of block */
+static const struct fsmagic lvm2_magic[] = {
+	FSMAGIC(struct lvm2_super_block, magic, LVM2_MAGIC_L, LVM2_MAGIC),
+	{ 0x200 + offsetof(struct lvm2_super_block, magic), LVM2_MAGIC_L, LVM2_MAGIC },
+	FSMAGIC_END
+};
+
+static const struct fsmagic swap_magic[] = {
+	FSMAGIC(struct swap_super_block, magic, SWAP_MAGIC_L, SWAP_MAGIC_1),
+	FSMAGIC(struct swap_super_block, magic, SWAP_MAGIC_L, SWAP_MAGIC_2),
+	FSMAGIC_END
+};
+
+static const struct fsmagic suspend_magic[] = {
+	FSMAGIC(struct swap_super_block, magic, SUSP_MAGIC_L, SUSP_MAGIC_1),
+	FSMAGIC(struct swap_super_block, magic, SUSP_MAGIC_L, SUSP_MAGIC_2),
+	FSMAGIC(struct swap_super_block, magic, SUSP_MAGIC_L, SUSP_MAGIC_U),
+	FSMAGIC_END
+};
+
 struct imagetype {
 	off_t block;
 	const char name[12];
 	int (*identify) (const void *, unsigned long long *);
+	const struct fsmagic *magic;
 };
 
 /*
@@ -528,44 +717,144 @@ struct imagetype {
  * The same goes for LUKS as for LVM.
  */
 static struct imagetype images[] = {
-	{0, "gzip", gzip_image},
-	{0, "cramfs", cramfs_image},
-	{0, "romfs", romfs_image},
-	{0, "xfs", xfs_image},
-	{0, "squashfs", squashfs_image},
-	{1, "ext4dev", ext4dev_image},
-	{1, "ext4", ext4_image},
-	{1, "ext3", ext3_image},
-	{1, "ext2", ext2_image},
-	{1, "minix", minix_image},
-	{0, "ubi", ubi_image},
-	{0, "jffs2", jffs2_image},
-	{0, "vfat", vfat_image},
-	{1, "nilfs2", nilfs2_image},
-	{2, "ocfs2", ocfs2_image},
-	{8, "reiserfs", reiserfs_image},
-	{64, "reiserfs", reiserfs_image},
-	{64, "reiser4", reiser4_image},
-	{64, "gfs2", gfs2_image},
-	{64, "btrfs", btrfs_image},
-	{32, "jfs", jfs_image},
-	{32, "iso9660", iso_image},
-	{0, "luks", luks_image},
-	{0, "lvm2", lvm2_image},
-	{1, "lvm2", lvm2_image},
-	{-1, "swap", swap_image},
-	{-1, "suspend", suspend_image},
-	{0, "", NULL}
+	{0, "gzip", gzip_image, gzip_magic},
+	{0, "cramfs", cramfs_image, cramfs_magic},
+	{0, "romfs", romfs_image, romfs_magic},
+	{0, "xfs", xfs_image, xfs_magic},
+	{0, "squashfs", squashfs_image, squashfs_magic},
+	{1, "ext4dev", ext4dev_image, ext_magic},
+	{1, "ext4", ext4_image, ext_magic},
+	{1, "ext3", ext3_image, ext_magic},
+	{1, "ext2", ext2_image, ext_magic},
+	{1, "minix", minix_image, minix_magic},
+	{0, "ubi", ubi_image, ubi_magic},
+	{0, "jffs2", jffs2_image, jffs2_magic},
+	{0, "vfat", vfat_image, vfat_magic},
+	{0, "bootimg", bootimg_image, bootimg_magic},
+	{0, "fit", fit_image, fit_magic},
+	{1, "nilfs2", nilfs2_image, nilfs2_magic},
+	{2, "ocfs2", ocfs2_image, ocfs2_magic},
+	{8, "reiserfs", reiserfs_image, reiserfs_magic},
+	{64, "reiserfs", reiserfs_image, reiserfs_magic},
+	{64, "reiser4", reiser4_image, reiser4_magic},
+	{64, "gfs2", gfs2_image, gfs2_magic},
+	{64, "btrfs", btrfs_image, btrfs_magic},
+	{32, "jfs", jfs_image, jfs_magic},
+	{32, "iso9660", iso_image, iso_magic},
+	{0, "luks", luks_image, luks_magic},
+	{0, "lvm2", lvm2_image, lvm2_magic},
+	{1, "lvm2", lvm2_image, lvm2_magic},
+	{-1, "swap", swap_image, swap_magic},
+	{-1, "suspend", suspend_image, suspend_magic},
+	{0, "", NULL, NULL}
 };
 
+/*
+ * Index of all magics by their position in probe window and first two
+ * bytes. identify_fs_buf() looks up bytes found at every known position
+ * and checks only filesystems whose magic is in place.
+ */
+#define FSINDEX_SIZE		64	/* hash buckets, power of 2 */
+#define FSINDEX_MAX_MAGICS	64
+
+struct fsindex_entry {
+	unsigned int pos;		/* magic position in probe window */
+	const struct fsmagic *m;
+	unsigned int image;		/* index in images[] */
+	struct fsindex_entry *next;
+};
+
+static struct fsindex_entry fsindex_entries[FSINDEX_MAX_MAGICS];
+static struct fsindex_entry *fsindex[FSINDEX_SIZE];
+static unsigned int fsindex_pos[FSINDEX_MAX_MAGICS];	/* distinct positions */
+static unsigned int fsindex_npos;
+static int fsindex_ready;
+
+static unsigned int fsindex_hash(unsigned int pos, const unsigned char *p)
+{
+	return (pos * 31 + p[0] * 7 + p[1]) & (FSINDEX_SIZE - 1);
+}
+
+void fstype_init(void)
+{
+	struct imagetype *ip;
+	const struct fsmagic *m;
+	struct fsindex_entry *e;
+	unsigned int n = 0, i, h;
+
+	if (fsindex_ready)
+		return;
+
+	/* Candidates of identify_fs_buf() are bits of 64-bit mask */
+	if (ARRAY_SIZE(images) > 64)
+		return;
+
+	for (ip = images; ip->identify; ip++) {
+		/* Hack for swap, which apparently is dependent on page size */
+		if (ip->block == -1)
+			ip->block = SWAP_OFFSET();
+
+		for (m = ip->magic; m->len; m++) {
+			if (n >= FSINDEX_MAX_MAGICS)
+				return;
+
+			e = &fsindex_entries[n++];
+			e->pos = ip->block * BLOCK_SIZE + m->offset;
+			e->m = m;
+			e->image = ip - images;
+
+			h = fsindex_hash(e->pos, (const unsigned char *)m->magic);
+			e->next = fsindex[h];
+			fsindex[h] = e;
+
+			for (i = 0; i < fsindex_npos; i++) {
+				if (fsindex_pos[i] == e->pos)
+					break;
+			}
+			if (i == fsindex_npos)
+				fsindex_pos[fsindex_npos++] = e->pos;
+		}
+	}
+
+	/* Kernel doesn't gain filesystems while we are probing */
+	ext4dev_present = (fs_proc_check("ext4dev") ||
+			   check_for_modules("ext4dev"));
+	ext4_present = (fs_proc_check("ext4") || check_for_modules("ext4"));
+
+	fsindex_ready = 1;
+}
+
 int identify_fs(int fd, const char **fstype,
 		unsigned long long *bytes, off_t offset)
 {
-	uint64_t buf[BLOCK_SIZE >> 3];	/* 64-bit worst case alignment */
-	off_t cur_block = (off_t) - 1;
-	struct imagetype *ip;
+	void *buf;
+	ssize_t len;
 	int ret;
-	unsigned long long dummy;
+
+	buf = malloc(FSTYPE_PROBE_SIZE);
+	if (!buf)
+		return -1;
+
+	/* Whole probe window by one read. Small devices give less */
+	len = pread(fd, buf, FSTYPE_PROBE_SIZE, offset);
+	if (len < BLOCK_SIZE) {
+		free(buf);
+		return -1;	/* error */
+	}
+
+	ret = identify_fs_buf(buf, len, fstype, bytes);
+	free(buf);
+	return ret;
+}
+
+int identify_fs_buf(const void *buf, size_t len, const char **fstype,
+		unsigned long long *bytes)
+{
+	const unsigned char *p = buf;
+	struct imagetype *ip;
+	struct fsindex_entry *e;
+	unsigned long long candidates = 0, dummy;
+	unsigned int i, pos;
 
 	if (!bytes)
 		bytes = &dummy;
@@ -573,23 +862,37 @@ int identify_fs(int fd, const char **fstype,
 	*fstype = NULL;
 	*bytes = 0;
 
-	for (ip = images; ip->identify; ip++) {
-		/* Hack for swap, which apparently is dependent on page size */
-		if (ip->block == -1)
-			ip->block = SWAP_OFFSET();
+	if (!fsindex_ready) {
+		fstype_init();
+		if (!fsindex_ready)
+			return -1;
+	}
 
-		if (cur_block != ip->block) {
-			/*
-			 * Read block.
-			 */
-			cur_block = ip->block;
-			ret = pread(fd, buf, BLOCK_SIZE,
-				    offset + cur_block * BLOCK_SIZE);
-			if (ret != BLOCK_SIZE)
-				return -1;	/* error */
+	/* Find filesystems whose magic is in place */
+	for (i = 0; i < fsindex_npos; i++) {
+		pos = fsindex_pos[i];
+		if (pos + 2 > len)
+			continue;
+
+		for (e = fsindex[fsindex_hash(pos, p + pos)]; e; e = e->next) {
+			if (e->pos == pos && pos + e->m->len <= len &&
+			    !memcmp(p + pos, e->m->magic, e->m->len))
+				candidates |= 1ULL << e->image;
 		}
+	}
 
-		if (ip->identify(buf, bytes)) {
+	/* Check them in order of images[] */
+	for (i = 0; candidates; i++, candidates >>= 1) {
+		if (!(candidates & 1))
+			continue;
+
+		ip = &images[i];
+
+		/* Skip signatures beyond data we have */
+		if ((ip->block + 1) * BLOCK_SIZE > len)
+			continue;
+
+		if (ip->identify(p + ip->block * BLOCK_SIZE, bytes)) {
 			*fstype = ip->name;
 			return 0;
 		}
@@ -597,3 +900,48 @@ int identify_fs(int fd, const char **fstype,
 
 	return 1;		/* Unknown filesystem */
 }
+
+/*
+ * Filesystems which rewrite their superblock on every change
+ * (mount count, write time, generation) or are read-only images.
+ * Hash of block with superblock identifies state of filesystem.
+ */
+static struct imagetype fpsources[] = {
+	{0, "cramfs", NULL},
+	{0, "squashfs", NULL},
+	{1, "ext4dev", NULL},
+	{1, "ext4", NULL},
+	{1, "ext3", NULL},
+	{1, "ext2", NULL},
+	{1, "nilfs2", NULL},
+	{64, "btrfs", NULL},
+	{32, "iso9660", NULL},
+	{0, "", NULL}
+};
+
+unsigned long long fingerprint_fs_buf(const void *buf, size_t len,
+		const char *fstype)
+{
+	struct imagetype *ip;
+	const unsigned char *p;
+	unsigned long long hash;
+	int i;
+
+	for (ip = fpsources; ip->name[0]; ip++) {
+		if (!strcmp(ip->name, fstype))
+			break;
+	}
+
+	if (!ip->name[0] || (ip->block + 1) * BLOCK_SIZE > len)
+		return 0;
+
+	/* FNV-1a over whole superblock block */
+	p = (const unsigned char *)buf + ip->block * BLOCK_SIZE;
+	hash = 0xcbf29ce484222325ULL;
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash ? hash : 1;
+}
@@ -14,7 +14,23 @@
 
 #include <unistd.h>
 
+/* Bytes from start of device enough to identify any known filesystem */
+#define FSTYPE_PROBE_SIZE	(65 * 1024)
+
+/* Build magic index and check kernel support of ext4. It is done
+ * by first identify call too but is not thread-safe there */
+void fstype_init(void);
+
 int identify_fs(int fd, const char **fstype,
 		unsigned long long *bytes, off_t offset);
 
+/* Identify filesystem by 'len' bytes read from start of device */
+int identify_fs_buf(const void *buf, size_t len, const char **fstype,
+		unsigned long long *bytes);
+
+/* Return fingerprint of filesystem state from identify_fs_buf() buffer
+ * or 0 when 'fstype' doesn't allow to notice changes by superblock */
+unsigned long long fingerprint_fs_buf(const void *buf, size_t len,
+		const char *fstype);
+
 #endif
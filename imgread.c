@@ -0,0 +1,266 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "config.h"
+#include "util.h"
+#include "imgread.h"
+
+/* Size of single read */
+#define IMGREAD_CHUNK		(1024 * 1024)
+
+/* Queue readahead while images are loaded, KB */
+#define IMGREAD_QUEUE_RA	4096
+
+/* Kernel and initrd may be on different devices */
+#define IMGREAD_MAX_QUEUES	2
+
+/* Queue with changed readahead */
+struct ra_queue_t {
+	dev_t dev;
+	char path[64];
+	unsigned long old_kb;
+};
+
+static struct ra_queue_t queues[IMGREAD_MAX_QUEUES];
+static unsigned int queues_count = 0;
+
+/* Load may be stopped by other thread */
+static volatile int interruptible = 0;
+static volatile int interrupted = 0;
+
+
+/* Find read_ahead_kb of queue for block device (partition or disk) */
+static int queue_ra_path(dev_t dev, char *path, size_t size)
+{
+	snprintf(path, size, "/sys/dev/block/%u:%u/partition",
+			major(dev), minor(dev));
+	if (0 == access(path, F_OK))
+		snprintf(path, size, "/sys/dev/block/%u:%u/../queue/read_ahead_kb",
+				major(dev), minor(dev));
+	else
+		snprintf(path, size, "/sys/dev/block/%u:%u/queue/read_ahead_kb",
+				major(dev), minor(dev));
+
+	return access(path, W_OK);
+}
+
+
+static int read_ulong(const char *path, unsigned long *val)
+{
+	char buf[32];
+	int fd, n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) return -1;
+
+	buf[n] = '\0';
+	*val = strtoul(buf, NULL, 10);
+	return 0;
+}
+
+
+static int write_ulong(const char *path, unsigned long val)
+{
+	char buf[32];
+	int fd, n;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) return -1;
+	n = sprintf(buf, "%lu", val);
+	n = (write(fd, buf, n) == n) ? 0 : -1;
+	close(fd);
+	return n;
+}
+
+
+/* Raise readahead of device queue once */
+static void raise_queue_ra(dev_t dev)
+{
+	struct ra_queue_t *q;
+	unsigned int i;
+
+	/* Filesystems without block device (ubifs, jffs2) */
+	if (0 == major(dev)) return;
+
+	for (i = 0; i < queues_count; i++)
+		if (queues[i].dev == dev) return;
+	if (queues_count >= IMGREAD_MAX_QUEUES) return;
+
+	q = &queues[queues_count];
+	if (0 != queue_ra_path(dev, q->path, sizeof(q->path))) return;
+	if (-1 == read_ulong(q->path, &q->old_kb)) return;
+	if (q->old_kb >= IMGREAD_QUEUE_RA) return;
+
+	if (-1 == write_ulong(q->path, IMGREAD_QUEUE_RA)) {
+		log_msg(lg, "Can't raise readahead of %s: %s", q->path, ERRMSG);
+		return;
+	}
+
+	q->dev = dev;
+	++queues_count;
+	DPRINTF("Readahead of %s: %lu -> %d KB", q->path, q->old_kb,
+			IMGREAD_QUEUE_RA);
+}
+
+
+void imgread_prepare(int fd)
+{
+	struct stat st;
+
+	if (fd < 0 || -1 == fstat(fd, &st)) return;
+
+	raise_queue_ra(st.st_dev);
+
+	/* Start reading now. Next file will be read while this one is
+	 * consumed */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+}
+
+
+void imgread_restore(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < queues_count; i++)
+		write_ulong(queues[i].path, queues[i].old_kb);
+
+	queues_count = 0;
+}
+
+
+int imgread_file(int fd, const char *name, char **buf, size_t *len)
+{
+	struct stat st;
+	unsigned long long start = msec_now();
+	size_t done = 0, chunk;
+	ssize_t n;
+	void *p;
+
+	if (-1 == fstat(fd, &st)) {
+		log_msg(lg, "Can't stat %s: %s", name, ERRMSG);
+		return -1;
+	}
+
+	/* Aligned buffer lets kernel copy whole pages */
+	if (0 != posix_memalign(&p, getpagesize(), st.st_size ? st.st_size : 1)) {
+		log_msg(lg, "Can't allocate %ld bytes for %s", (long)st.st_size, name);
+		return -1;
+	}
+	*buf = p;
+
+	while (done < (size_t)st.st_size) {
+		if (imgread_interrupted()) {
+			log_msg(lg, "Reading of %s is interrupted", name);
+			free(*buf);
+			return -1;
+		}
+
+		chunk = st.st_size - done;
+		if (chunk > IMGREAD_CHUNK) chunk = IMGREAD_CHUNK;
+
+		/* Handles may be shared, so don't move file offset */
+		n = pread(fd, *buf + done, chunk, done);
+		if (n < 0 && EINTR == errno) continue;
+		if (n <= 0) break;
+		done += n;
+	}
+
+	if (done != (size_t)st.st_size) {
+		log_msg(lg, "Can't read %s: %s", name, ERRMSG);
+		free(*buf);
+		return -1;
+	}
+
+	*len = done;
+	imgread_report(name, done, msec_now() - start);
+	return 0;
+}
+
+
+void imgread_interruptible(int on)
+{
+	interruptible = on;
+	interrupted = 0;
+}
+
+
+void imgread_interrupt(void)
+{
+	interrupted = 1;
+}
+
+
+int imgread_interrupted(void)
+{
+	return interruptible && interrupted;
+}
+
+
+int imgread_cache(int fd, const char *name)
+{
+	unsigned long long start = msec_now();
+	off_t done = 0;
+	ssize_t n;
+	char *buf;
+
+	if (!interruptible || fd < 0) return 0;
+
+	buf = malloc(IMGREAD_CHUNK);
+	if (NULL == buf) return 0;	/* Kernel will read it itself */
+
+	for (;;) {
+		if (imgread_interrupted()) {
+			log_msg(lg, "Reading of %s is interrupted", name);
+			free(buf);
+			return -1;
+		}
+
+		n = pread(fd, buf, IMGREAD_CHUNK, done);
+		if (n < 0 && EINTR == errno) continue;
+		if (n <= 0) break;
+		done += n;
+	}
+	free(buf);
+
+	imgread_report(name, done, msec_now() - start);
+	return 0;
+}
+
+
+void imgread_report(const char *name, unsigned long long bytes,
+		unsigned long long ms)
+{
+	unsigned long long rate;	/* 0.1 MB/s */
+
+	rate = bytes * 10000 / ((ms ? ms : 1) * 1024 * 1024);
+	log_msg(lg, "%s: %llu bytes in %llu ms (%llu.%llu MB/s)", name,
+			bytes, ms, rate / 10, rate % 10);
+}
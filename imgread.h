@@ -0,0 +1,59 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_IMGREAD_H_
+#define _HAVE_IMGREAD_H_
+
+#include <stddef.h>
+#include "config.h"
+
+/*
+ * Streaming of kernel and initrd images into memory.
+ * Files are read by large chunks into page-aligned buffers, readahead
+ * of boot device queue is raised while images are loaded.
+ */
+
+/* Prepare file for loading: raise readahead of its device and start
+ * asynchronous reading so several files are read in parallel */
+void imgread_prepare(int fd);
+
+/* Restore readahead of devices changed by imgread_prepare() */
+void imgread_restore(void);
+
+/* Read whole file into allocated page-aligned buffer (free() it).
+ * Return 0 on success or -1 */
+int imgread_file(int fd, const char *name, char **buf, size_t *len);
+
+/* Make loads interruptible (on != 0) or not. Loading is done by one
+ * thread at a time, state is global */
+void imgread_interruptible(int on);
+
+/* Ask interruptible load to stop. It fails at next chunk */
+void imgread_interrupt(void);
+
+/* Return 1 when load should stop */
+int imgread_interrupted(void);
+
+/* Read file into page cache by chunks when loads are interruptible, so
+ * kernel reading it later doesn't hold us. Return 0 or -1 when interrupted */
+int imgread_cache(int fd, const char *name);
+
+/* Log size, time and throughput of file loading */
+void imgread_report(const char *name, unsigned long long bytes,
+		unsigned long long ms);
+
+#endif /* _HAVE_IMGREAD_H_ */
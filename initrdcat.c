@@ -0,0 +1,241 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+
+#include "config.h"
+
+#ifdef USE_INITRD_COMPOSE
+#include "util.h"
+#include "imgread.h"
+#include "initrdcat.h"
+
+/* Values from linux/memfd.h and linux/fcntl.h */
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		(1024 + 9)
+#define F_SEAL_SEAL		0x0001
+#define F_SEAL_SHRINK	0x0002
+#define F_SEAL_GROW		0x0004
+#define F_SEAL_WRITE	0x0008
+#endif
+
+/* Size of generated cpio archive is bounded */
+#define CPIO_MAX_SIZE	4096
+#define CPIO_HEADER_SIZE	110
+
+/* Parts are copied by chunks so copying may be interrupted */
+#define COPY_CHUNK	(1024 * 1024)
+
+/* Archives in initramfs should start at 4-byte boundary */
+#define ALIGN4(x)		(((x) + 3) & ~3UL)
+
+/* Bounded cpio (newc) builder */
+struct cpio_t {
+	char buf[CPIO_MAX_SIZE];
+	size_t len;
+	unsigned int ino;
+};
+
+
+static int cpio_add(struct cpio_t *c, const char *name, unsigned int mode,
+		const char *data, size_t size)
+{
+	size_t namesize = strlen(name) + 1;
+	size_t need;
+
+	need = ALIGN4(CPIO_HEADER_SIZE + namesize) + ALIGN4(size);
+	if (c->len + need > sizeof(c->buf)) return -1;
+
+	memset(c->buf + c->len, 0, need);
+	sprintf(c->buf + c->len, "070701%08X%08X%08X%08X%08X%08X%08X"
+			"%08X%08X%08X%08X%08X%08X",
+			++c->ino, mode, 0, 0, (mode & 040000) ? 2 : 1, 0,
+			(unsigned int)size, 0, 0, 0, 0, (unsigned int)namesize, 0);
+	strcpy(c->buf + c->len + CPIO_HEADER_SIZE, name);
+	c->len += ALIGN4(CPIO_HEADER_SIZE + namesize);
+
+	if (size) memcpy(c->buf + c->len, data, size);
+	c->len += ALIGN4(size);
+
+	return 0;
+}
+
+
+/* Archive with file 'path' holding 'device' and its parent directories */
+static int cpio_bootdev(struct cpio_t *c, const char *path, const char *device)
+{
+	char name[256];
+	char data[256];
+	char *p;
+
+	while ('/' == *path) ++path;
+	if (strlen(path) >= sizeof(name) || strlen(device) + 2 > sizeof(data))
+		return -1;
+	strcpy(name, path);
+
+	/* Directories should be created before file */
+	for (p = strchr(name, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (-1 == cpio_add(c, name, 040755, NULL, 0)) return -1;
+		*p = '/';
+	}
+
+	sprintf(data, "%s\n", device);
+	if (-1 == cpio_add(c, name, 0100644, data, strlen(data))) return -1;
+
+	return cpio_add(c, "TRAILER!!!", 0, NULL, 0);
+}
+
+
+/* Copy whole file to end of memfd without passing data through us */
+static int copy_fd(int mfd, int fd, off_t *pos)
+{
+	struct stat st;
+	loff_t in = 0;
+	off_t off;
+	ssize_t n = 0;
+	size_t left;
+
+	if (-1 == fstat(fd, &st)) return -1;
+	left = st.st_size;
+
+#ifdef __NR_copy_file_range
+	/* Files on other filesystems may be refused. sendfile() then */
+	while (left > 0 && !imgread_interrupted()) {
+		n = syscall(__NR_copy_file_range, fd, &in, mfd, NULL,
+				(left > COPY_CHUNK) ? COPY_CHUNK : left, 0);
+		if (n < 0 && EINTR == errno) continue;
+		if (n <= 0) break;
+		left -= n;
+	}
+	if (0 == left) goto done;
+	if (0 != n && !imgread_interrupted())
+		DPRINTF("copy_file_range() failed: %s", ERRMSG);
+#endif
+
+	off = in;
+	while (left > 0) {
+		if (imgread_interrupted()) {
+			log_msg(lg, "Copying of initrd part is interrupted");
+			return -1;
+		}
+		n = sendfile(mfd, fd, &off, (left > COPY_CHUNK) ? COPY_CHUNK : left);
+		if (n < 0 && EINTR == errno) continue;
+		if (n <= 0) {
+			log_msg(lg, "Can't copy initrd part: %s", ERRMSG);
+			return -1;
+		}
+		left -= n;
+	}
+
+#ifdef __NR_copy_file_range
+done:
+#endif
+	*pos += st.st_size;
+	return 0;
+}
+
+
+/* Pad memfd with zeroes to 4-byte boundary */
+static int pad_fd(int mfd, off_t *pos)
+{
+	static const char zero[4] = { 0, 0, 0, 0 };
+	size_t n = ALIGN4(*pos) - *pos;
+
+	if (n && (write(mfd, zero, n) != (ssize_t)n)) return -1;
+	*pos += n;
+	return 0;
+}
+
+
+int initrdcat_compose(const int *fds, unsigned int count,
+		const char *bootdev, const char *device)
+{
+	struct cpio_t *cpio = NULL;
+	unsigned long long start = msec_now();
+	char path[32];
+	off_t pos = 0;
+	unsigned int i;
+	int mfd, rfd = -1;
+
+#ifdef __NR_memfd_create
+	mfd = syscall(__NR_memfd_create, "initrd", MFD_ALLOW_SEALING);
+#else
+	mfd = -1;
+	errno = ENOSYS;
+#endif
+	if (mfd < 0) {
+		log_msg(lg, "Can't create memfd for initrd: %s", ERRMSG);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (-1 == pad_fd(mfd, &pos)) goto fail;
+		if (-1 == copy_fd(mfd, fds[i], &pos)) goto fail;
+	}
+
+	if (bootdev && device) {
+		cpio = malloc(sizeof(*cpio));
+		if (NULL == cpio) goto fail;
+		cpio->len = 0;
+		cpio->ino = 0;
+
+		if (-1 == cpio_bootdev(cpio, bootdev, device)) {
+			log_msg(lg, "Boot device file %s is too long", bootdev);
+			goto fail;
+		}
+		if (-1 == pad_fd(mfd, &pos)) goto fail;
+		if (write(mfd, cpio->buf, cpio->len) != (ssize_t)cpio->len) goto fail;
+		pos += cpio->len;
+	}
+
+	if (-1 == fcntl(mfd, F_ADD_SEALS,
+			F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+		log_msg(lg, "Can't seal initrd: %s", ERRMSG);
+		goto fail;
+	}
+
+	/* kexec_file_load() refuses files opened for writing */
+	sprintf(path, "/proc/self/fd/%d", mfd);
+	rfd = open(path, O_RDONLY);
+	if (rfd < 0) log_msg(lg, "Can't reopen initrd: %s", ERRMSG);
+	else imgread_report("composed initrd", pos, msec_now() - start);
+
+	dispose(cpio);
+	close(mfd);
+	return rfd;
+
+fail:
+	log_msg(lg, "Can't compose initrd: %s", ERRMSG);
+	dispose(cpio);
+	close(mfd);
+	return -1;
+}
+
+#endif	/* USE_INITRD_COMPOSE */
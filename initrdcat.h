@@ -0,0 +1,35 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_INITRDCAT_H_
+#define _HAVE_INITRDCAT_H_
+
+#include "config.h"
+
+/*
+ * Composition of initrd from several files in memory.
+ * Kernel unpacks concatenated cpio archives (compressed or not) one by
+ * one, so files are just copied one after another with 4-byte padding.
+ */
+
+/* Concatenate 'count' files and, when 'bootdev' is set, cpio archive with
+ * file 'bootdev' holding boot 'device' into sealed read-only memfd.
+ * Return its descriptor or -1 */
+int initrdcat_compose(const int *fds, unsigned int count,
+		const char *bootdev, const char *device);
+
+#endif /* _HAVE_INITRDCAT_H_ */
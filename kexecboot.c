@@ -30,11 +30,49 @@
 #include <sys/reboot.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #include "config.h"
+
+#if defined(USE_PROBE_TIMEOUT) || defined(USE_SCAN_BUDGET)
+/* Probing time is limited */
+#define USE_SCAN_LIMITS
+#endif
+
+/* Text view never shows more log rows than this */
+#define TEXTVIEW_ROWS	256
+
 #include "util.h"
 #include "cfgparser.h"
 #include "devicescan.h"
+#include "scanpool.h"
+#include "mntprofile.h"
+#include "kexecload.h"
+#ifdef USE_PRELOAD
+#include "preload.h"
+#endif
+#ifdef USE_PROBE_ORDER
+#include "probeorder.h"
+#endif
+#if defined(USE_UEVENTS) || defined(USE_SCAN_LIMITS)
+#include <sys/timerfd.h>
+#endif
+#ifdef USE_UEVENTS
+#include <poll.h>
+#include "uevent.h"
+#endif
+#ifdef USE_SCAN_CACHE
+#include "scancache.h"
+#endif
+#ifdef USE_BOOTIMG
+#include "bootimg.h"
+#endif
+#ifdef USE_RESUME
+#include "resume.h"
+#endif
+#ifdef USE_CPUFREQ
+#include "cpufreq.h"
+#endif
 #include "evdevs.h"
 #include "menu.h"
 #include "kexecboot.h"
@@ -71,6 +109,11 @@ char *default_kernels[] = {
 #ifdef USE_UIMAGE
 	"/mnt/boot/uImage",
 	"/mnt/uImage",
+#endif
+#ifdef USE_BOOTIMG
+	"/mnt/boot/boot.img",
+	"/mnt/boot.img",
+	"/mnt/boot/fitImage",
 #endif
 	NULL
 };
@@ -88,8 +131,30 @@ typedef enum {
 struct params_t {
 	struct cfgdata_t *cfg;
 	struct bootconf_t *bootcfg;
+	struct strset *fslist;		/* Filesystems known by kernel */
 	kx_menu *menu;
+	int menu_touched;			/* User has moved menu selection */
+#ifdef USE_PROBE_ORDER
+	int confirmed;				/* Default item of last boot device is found */
+#endif
+#ifdef USE_RESUME
+	int resume_item;			/* Boot item resuming hibernated system (-1 - none) */
+#endif
 	kx_context context;
+	kx_scanpool *pool;			/* Probing pool (NULL - scan is finished) */
+	int scan_notify[2];			/* Pipe to wake up event loop by probing pool */
+#ifdef USE_UEVENTS
+	int uevent_fd;				/* Kernel uevents socket */
+	int settle_fd;				/* Timer of settle deadline */
+	int settling;				/* Waiting for devices to settle */
+	struct charlist *devices;	/* Devices known to scanner */
+	struct device_t *hotplug;	/* Devices waiting for busy pool to finish */
+	unsigned int hotplug_count;
+#endif
+#ifdef USE_SCAN_LIMITS
+	int watch_fd;				/* Timer of probing limits */
+	unsigned long long scan_deadline;	/* msec_now() of scan budget end */
+#endif
 #ifdef USE_FBMENU
 	struct gui_t *gui;
 #endif
@@ -168,9 +233,9 @@ char *get_machine_kernelpath() {
 #endif	/* USE_MACHINE_KERNEL */
 
 
-void start_kernel(struct params_t *params, int choice)
+/* Load kernel of boot item 'choice'. Return 0 on success or -1 */
+int load_boot_item(struct params_t *params, int choice)
 {
-	/* we use var[] instead of *var because sizeof(var) using */
 #ifdef USE_HOST_DEBUG
 	const char kexec_path[] = "/bin/echo";
 #else
@@ -178,220 +243,961 @@ void start_kernel(struct params_t *params, int choice)
 #endif
 	const char mount_point[] = MOUNTPOINT;
 
-	const char str_cmdline_start[] = "--command-line=";
-	const char str_rootfstype[] = "";
-	const char str_rootwait[] = "";
-	const char str_ubirootdev[] = "ubi0";
-	const char str_ubimtd[] = " ubi.mtd="; /* max ' ubi.mtd=15' len 11 +1 = 12 */
+	struct boot_item_t *item;
 
-#ifdef UBI_VID_HDR_OFFSET
-	const char str_ubimtd_off[] = UBI_VID_HDR_OFFSET;
-#else
-	const char str_ubimtd_off[] = "";
+	item = params->bootcfg->list[choice];
+
+	if (NULL == item->device) {
+		log_msg(lg, "Boot item has no device");
+		return -1;
+	}
+
+#ifdef USE_CPUFREQ
+	cpufreq_boost();
 #endif
 
-	char mount_dev[16];
-	char mount_fstype[16];
-	char str_mtd_id[3];
+#ifdef USE_PRELOAD
+	/* Kernel may be loaded already while menu was shown */
+	if (0 == preload_finish(item))
+		log_msg(lg, "Kernel %s is preloaded", item->kernelpath);
+	else
+#endif
+	if (-1 == kexecload_item(kexec_path, item, mount_point)) {
+		log_msg(lg, "Can't load kernel %s", item->kernelpath);
+#ifdef USE_CPUFREQ
+		cpufreq_idle();
+#endif
+		return -1;
+	}
 
-	/* Tags passed from host kernel cmdline to kexec'ed kernel */
-	//const char str_mtdparts[] = " mtdparts=";
-	//const char str_fbcon[] = " fbcon=";
+#ifdef USE_PROBE_ORDER
+	/* Probe this device first next time */
+	probeorder_booted(item->device);
+	probeorder_save(USE_PROBE_ORDER);
+#endif
 
-	//const char str_initrd_start[] = "--initrd=";
+	return 0;
+}
 
-	/* empty environment */
-	//char *const envp[] = { NULL };
 
-	//const char *load_argv[] = { NULL, "--load-hardboot --mem-min=0x50000000", NULL, NULL, NULL, NULL };
-	//const char *exec_argv[] = { NULL, "-e", NULL, NULL};
+/* Boot loaded kernel. Return on failure only */
+void boot_kernel(void)
+{
+#ifdef USE_CPUFREQ
+	/* New kernel gets governor it was started with */
+	cpufreq_restore();
+#endif
 
-    char kexec_arg[10000];
+#ifndef USE_HOST_DEBUG
+	kexecload_boot(KEXEC_PATH);
+#endif
+}
 
-	//char *cmdline_arg = NULL, *initrd_arg = NULL;
-	//int n, idx, u;
-	//struct stat sinfo;
-	struct boot_item_t *item;
 
-	item = params->bootcfg->list[choice];
+#ifdef USE_FAST_REBOOT
+/* Restart kexecboot by kexec of its own kernel. Return on failure only */
+static void fast_reboot(void)
+{
+#ifdef USE_HOST_DEBUG
+	const char kexec_path[] = "/bin/echo";
+#else
+	const char kexec_path[] = KEXEC_PATH;
+#endif
+
+#ifdef USE_PRELOAD
+	/* Loader thread should not replace our kernel */
+	preload_finish(NULL);
+#endif
 
-	//exec_argv[0] = kexec_path;
-	//load_argv[0] = kexec_path;
-
-	/* --command-line arg generation */
-	//idx = 2;	/* load_argv current option index */
+#ifdef USE_CPUFREQ
+	cpufreq_boost();
+#endif
 
-	/* fill '--command-line' option */
-	if (item->device) {
-		/* default device to mount */
-		strcpy(mount_dev, item->device);
-
-		if (item->fstype) {
-			/* default fstype to mount */
-			strcpy(mount_fstype, item->fstype);
-        }
-
-		/* allocate space */
-		//n = sizeof(str_cmdline_start) + strlen(item->device) +
-		//		sizeof(str_ubirootdev) + 2 +
-		//		sizeof(str_ubimtd) + 2 + sizeof(str_ubimtd_off) + 1 +
-		//		sizeof(str_rootwait) +
-		//		sizeof(str_rootfstype) + strlen(item->fstype) + 2 +
-		//		sizeof(str_mtdparts) + strlenn(params->cfg->mtdparts) +
-		//		sizeof(str_fbcon) + strlenn(params->cfg->fbcon) +
-		//		sizeof(char) + strlenn(item->cmdline);
-
-
-        //Start kexec command with path to kexec tools binary
-        strcpy(kexec_arg, kexec_path);
-
-        //Add " --load-hardboot --mem-min=0x50000000"
-        strcat(kexec_arg, " --load-hardboot --mem-min=0x50000000");
-
-        if(item->cmdline)
-        {
-            //Add " --command-line="
-            strcat(kexec_arg, " --command-line=");
-
-            //Add command line
-            strcat(kexec_arg, item->cmdline);
-        }
-
-        if(item->initrd)
-        {
-            //Add " --initrd="
-            strcat(kexec_arg, " --initrd=");
-
-            //Add initrd path
-            strcat(kexec_arg, item->initrd);
-        }
-
-        //Add a space
-        strcat(kexec_arg, " ");
-
-        //Add kernel path
-        strcat(kexec_arg, item->kernelpath);
-
-		//cmdline_arg = (char *)malloc(n);
-		//if (NULL == cmdline_arg) {
-		//	perror("Can't allocate memory for cmdline_arg");
-		//} else {
-
-		//	strcpy(cmdline_arg, str_cmdline_start);	/* --command-line=root= */
-
-
-		//	}
-			//strcat(cmdline_arg, str_rootwait);
-
-			//if (params->cfg->mtdparts) {
-			//	strcat(cmdline_arg, str_mtdparts);
-			//	strcat(cmdline_arg, params->cfg->mtdparts);
-			//}
-
-			//if (params->cfg->fbcon) {
-			//	strcat(cmdline_arg, str_fbcon);
-			//	strcat(cmdline_arg, params->cfg->fbcon);
-			//}
-
-		//	if (item->cmdline) {
-		//		strcat(cmdline_arg, " ");
-		//		strcat(cmdline_arg, item->cmdline);
-		//	}
-		//	load_argv[idx] = cmdline_arg;
-		//	++idx;
-		//}
-	}
-
-	/* fill '--initrd' option */
-	//if (item->initrd) {
-	//	/* allocate space */
-	//	n = sizeof(str_initrd_start) + strlen(item->initrd);
-
-	//	initrd_arg = (char *)malloc(n);
-	//	if (NULL == initrd_arg) {
-	//		perror("Can't allocate memory for initrd_arg");
-	//	} else {
-	//		strcpy(initrd_arg, str_initrd_start);	/* --initrd= */
-	//		strcat(initrd_arg, item->initrd);
-	//		load_argv[idx] = initrd_arg;
-	//		++idx;
-	//	}
-	//}
-
-	/* Append kernelpath as last arg of kexec */
-	//load_argv[idx] = item->kernelpath;
-
-	//DPRINTF("load_argv: %s, %s, %s, %s, %s", load_argv[0],
-	//		load_argv[1], load_argv[2],
-	//		load_argv[3], load_argv[4]);
-
-    //DPRINTF("load_argv: %s", (char *const *)load_argv);
-
-	/* Mount boot device */
-	if ( -1 == mount(mount_dev, mount_point, mount_fstype,
-			MS_RDONLY, NULL) ) {
-		perror("Can't mount boot device");
-		exit(-1);
+	if (-1 == kexecload_self(kexec_path, USE_FAST_REBOOT)) {
+		log_msg(lg, "Can't load kernel %s", USE_FAST_REBOOT);
+#ifdef USE_CPUFREQ
+		cpufreq_idle();
+#endif
+		return;
 	}
 
-    DPRINTF("kexec command: %s", kexec_arg);
+#ifdef USE_CPUFREQ
+	cpufreq_restore();
+#endif
 
-    system(kexec_arg);
+#ifndef USE_HOST_DEBUG
+	kexecload_boot(kexec_path);
+#endif
+}
+#endif
 
-	/* Load kernel */
-	//n = fexecw(kexec_path, (char *const *)load_argv, envp);
-	//if (-1 == n) {
-	//	perror("Kexec can't load kernel");
-	//	exit(-1);
-	//}
 
-	umount(mount_point);
+#ifdef USE_ZAURUS
+/* Zaurus partition info (valid when zaurus_error is 0) */
+static struct zaurus_partinfo_t pinfo;
+static int zaurus_error = 0;
+#endif
 
-	//dispose(cmdline_arg);
-	//dispose(initrd_arg);
+#ifdef USE_SCAN_THREADS
+/* ubiattach and /sys/class/ubi lookup should not race */
+static pthread_mutex_t ubi_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-	/* Check /proc/sys/net presence */
-	//if ( -1 == stat("/proc/sys/net", &sinfo) ) {
-	//	if (ENOENT == errno) {
-	//		/* We have no network, don't issue ifdown() while kexec'ing */
-	//		exec_argv[2] = "-x";
-	//		DPRINTF("No network is detected, disabling ifdown()");
-	//	} else {
-	//		perror("Can't stat /proc/sys/net");
-	//	}
-	//}
+#ifdef USE_ICONS
+/* Load custom icons of sections found. Icons are read from device
+ * mounted at 'mountpoint' or from unmounted filesystem 'fs' */
+static void load_icons(struct cfgdata_t *cfgdata, const char *mountpoint,
+		kx_rofs *fs)
+{
+	kx_cfg_section *sc;
+	int i;
+	int rows;
+	char **xpm_data;
+	char *iconpath;
+#ifdef USE_ROFS
+	char *buf;
+	int len;
+#endif
+
+	/* Iterate over sections found */
+	for (i = 0; i < cfgdata->count; i++) {
+		sc = cfgdata->list[i];
+		if (!sc) continue;
+
+		/* Load custom icon */
+		if (sc->iconpath) {
+#ifdef USE_ROFS
+			if (fs) {
+				len = rofs_read(fs, sc->iconpath, &buf, MAX_XPM_FILE_SIZE);
+				if (len < 0) {
+					log_msg(lg, "+ can't read xpm icon %s", sc->iconpath);
+					continue;
+				}
+				rows = xpm_load_buffer(&xpm_data, buf, len);
+				free(buf);
+			} else
+#endif
+			{
+				iconpath = mountpoint_path(mountpoint, sc->iconpath);
+				if (NULL == iconpath) continue;
 
-    system("sync");
+				rows = xpm_load_image(&xpm_data, iconpath);
+				free(iconpath);
+			}
+			if (-1 == rows) {
+				log_msg(lg, "+ can't load xpm icon %s", sc->iconpath);
+				continue;
+			}
 
-	//DPRINTF("exec_argv: %s, %s, %s", exec_argv[0],
-	//		exec_argv[1], exec_argv[2]);
+			sc->icondata = xpm_parse_image(xpm_data, rows);
+			if (!sc->icondata) {
+				log_msg(lg, "+ can't parse xpm icon %s", sc->iconpath);
+				continue;
+			}
+			xpm_destroy_image(xpm_data, rows);
+		}
+	}
+}
+#endif
 
-	/* Boot new kernel */
-	//execve(kexec_path, (char *const *)exec_argv, envp);
 
-    system("/usr/sbin/kexec -e");
+#ifdef USE_BOOT_HANDLES
+/* Open kernels and initrds of found sections so filesystem may be
+ * detached and boot will not mount it again. Return number of sections
+ * with handles */
+static int open_boot_handles(struct cfgdata_t *cfgdata, const char *mountpoint)
+{
+	kx_cfg_section *sc;
+	char *path;
+	int i, n = 0;
+
+	for (i = 0; i < cfgdata->count; i++) {
+		sc = cfgdata->list[i];
+		if (!sc || !sc->kernelpath) continue;
+#ifdef USE_INITRD_COMPOSE
+		/* Initrd parts are read from mounted device */
+		if (sc->overlays) continue;
+#endif
+
+		path = mountpoint_path(mountpoint, sc->kernelpath);
+		if (NULL == path) continue;
+		sc->kernel_fd = open(path, O_RDONLY);
+		free(path);
+		if (sc->kernel_fd < 0) continue;
+
+		if (sc->initrd) {
+			path = mountpoint_path(mountpoint, sc->initrd);
+			if (path) {
+				sc->initrd_fd = open(path, O_RDONLY);
+				free(path);
+			}
+
+			/* Don't boot without initrd. Item will be mounted again */
+			if (sc->initrd_fd < 0) {
+				close(sc->kernel_fd);
+				sc->kernel_fd = -1;
+				continue;
+			}
+		}
+
+		++n;
+	}
+
+	return n;
 }
+#endif
 
 
-int scan_devices(struct params_t *params)
+static int probe_device_cfg(kx_scan_job *job, const char *mountpoint,
+		struct params_t *params)
 {
-	struct charlist *fl;
-	struct bootconf_t *bootconf;
-	struct device_t dev;
-	struct cfgdata_t cfgdata;
-	int rc,n;
-	FILE *f;
+	struct device_t *dev = &job->dev;
+	struct cfgdata_t *cfgdata = &job->cfgdata;
+	int rc, n;
+#if defined(USE_ICONS) || defined(USE_SCAN_CACHE)
+	int icons = 0;	/* Custom icons are loaded */
+#endif
 
 	char mount_dev[16];
 	char mount_fstype[16];
 	char str_mtd_id[3];
+#ifdef USE_ROFS
+	kx_rofs *fs;
+#endif
+
+	/* Detect FS type unless it is detected by batch already */
+	if ( (NULL == dev->fstype) && (-1 == devscan_detect(dev, params->fslist)) )
+		return -1;
+
+#ifdef USE_RESUME
+	/* Swap with hibernation image has nothing to boot itself */
+	if (!strcmp(dev->fstype, "suspend")) {
+		resume_check(dev->device);
+		return -1;
+	}
+#endif
+
+#ifdef USE_BOOTIMG
+	/* Raw partition with boot image. Nothing to mount */
+	if (bootimg_fstype(dev->fstype))
+		return bootimg_bootinfo(cfgdata, dev->device);
+#endif
 
 #ifdef USE_ICONS
-	kx_cfg_section *sc;
+	icons = (NULL != params->gui);
+#endif
+
+#ifdef USE_SCAN_CACHE
+	/* Unchanged filesystem. Take results of last probe */
+	if (0 == scancache_lookup(dev, icons, cfgdata))
+		return (cfgdata->count > 0) ? 0 : -1;
+#endif
+
+#ifdef USE_ROFS
+	/* Read boot config without mounting when filesystem allows it */
+	fs = rofs_open(dev->device, dev->fstype);
+	if (fs) {
+		rc = get_bootinfo_rofs(cfgdata, fs);
+#ifdef USE_ICONS
+		if ( (0 == rc) && icons ) load_icons(cfgdata, NULL, fs);
+#endif
+		rofs_close(fs);
+		if (-2 != rc) goto done;
+
+		log_msg(lg, "+ device should be mounted to be read");
+	}
+#endif
+
+	/* initialize with defaults */
+	strcpy(mount_dev, dev->device);
+	strcpy(mount_fstype, dev->fstype);
+
+	/* We found an ubi erase counter */
+	if (!strncmp(dev->fstype, "ubi",3)) {
+
+		/* attach ubi boot device - mtd id [0-15] */
+		if(isdigit(atoi(dev->device+strlen(dev->device)-2))) {
+			strcpy(str_mtd_id, dev->device+strlen(dev->device)-2);
+			strcat(str_mtd_id, dev->device+strlen(dev->device)-1);
+		} else {
+			strcpy(str_mtd_id, dev->device+strlen(dev->device)-1);
+		}
+#ifdef USE_SCAN_THREADS
+		pthread_mutex_lock(&ubi_lock);
+#endif
+		n = ubi_attach(str_mtd_id);
+#ifdef USE_SCAN_THREADS
+		pthread_mutex_unlock(&ubi_lock);
+#endif
+
+		/* we have attached ubiX and we mount /dev/ubiX_0  */
+		sprintf(mount_dev, "/dev/ubi%d", n);
+		 /* HARDCODED: first volume */
+		strcat(mount_dev, "_0");
+
+		/* HARDCODED: we assume it's ubifs */
+		strcpy(mount_fstype, "ubifs");
+	}
+
+	/* Mount device */
+	if (-1 == mntprofile_mount(mount_dev, mountpoint, mount_fstype, MNT_PROBE)) {
+		log_msg(lg, "+ can't mount device %s: %s", mount_dev, ERRMSG);
+		return -1;
+	}
+
+	/* NOTE: Don't go out before umount'ing */
+
+	/* Search boot method and return boot info */
+	rc = get_bootinfo(cfgdata, mountpoint);
+
+	if (-1 == rc) {	/* Error */
+		goto umount;
+	}
+
+#ifdef USE_ICONS
+	if (icons) load_icons(cfgdata, mountpoint, NULL);
+#endif
+
+#ifdef USE_BOOT_HANDLES
+	/* Keep filesystem attached to handles only. Probe mount of journaled
+	 * filesystem doesn't replay journal so boot should mount it again */
+	if ( mntprofile_bootable(mount_fstype)
+			&& (open_boot_handles(cfgdata, mountpoint) > 0) ) {
+		if (-1 == umount2(mountpoint, MNT_DETACH)) {
+			log_msg(lg, "+ can't detach device: %s", ERRMSG);
+			return -1;
+		}
+		goto done;
+	}
+#endif
+
+umount:
+	/* Umount device */
+	if (-1 == umount(mountpoint)) {
+		log_msg(lg, "+ can't umount device: %s", ERRMSG);
+		return -1;
+	}
+
+#if defined(USE_ROFS) || defined(USE_BOOT_HANDLES)
+done:
+#endif
+#ifdef USE_SCAN_CACHE
+	scancache_store(dev, icons, (0 == rc) ? cfgdata : NULL);
+#endif
+
+	return rc;
+}
+
+
+#ifdef USE_PROBE_ORDER
+/* Check that job found default item on device which was booted last time */
+static int default_confirmed(kx_scan_job *job)
+{
 	int i;
-	int rows;
-	char **xpm_data;
 
+	for (i = 0; i < job->cfgdata.count; i++) {
+		if (job->cfgdata.list[i] && job->cfgdata.list[i]->is_default)
+			return probeorder_is_last(&job->dev);
+	}
+
+	return 0;
+}
+#endif
+
+
+/* Probe one device on mountpoint. Called from scan pool workers */
+int probe_device(kx_scan_job *job, const char *mountpoint, void *data)
+{
+	struct params_t *params = data;
+	int rc;
+#ifdef USE_PROBE_ORDER
+	unsigned long long start = msec_now();
+#endif
+
+	rc = probe_device_cfg(job, mountpoint, params);
+
+#ifdef USE_PROBE_ORDER
+	probeorder_probed(&job->dev, msec_now() - start);
+
+#if defined(USE_TIMEOUT) && (0 == USE_TIMEOUT)
+	/* We will boot it at once. Other devices are not needed */
+	if ( (0 == rc) && default_confirmed(job) ) {
+		log_msg(lg, "+ default item of last boot is found");
+		rc = 1;
+	}
+#endif
+#endif
+
+	return rc;
+}
+
+
+/* Add boot item 'no' of bootconf to main menu keeping priority order */
+static kx_menu_item *menu_add_boot_item(struct params_t *params, int no)
+{
+	kx_menu_level *ml = params->menu->top;
+	struct bootconf_t *bl = params->bootcfg;
+	struct boot_item_t *bi, *tbi;
+	kx_menu_item *mi;
+	kx_menu_dim pos;
+	char desc[160];
+	char *label;
+#ifdef USE_ICONS
+	kx_picture *icon;
+	struct gui_t *gui;
+
+	gui = params->gui;
+#endif
+
+	bi = bl->list[no];
+
+	/* Find place after items with higher or same priority.
+	 * Items of same priority are kept in device order */
+	for (pos = 0; pos < ml->count; pos++) {
+		mi = ml->list[pos];
+		if (mi->id < A_DEVICES) continue;
+
+		tbi = bl->list[mi->id - A_DEVICES];
+		if (tbi->priority < bi->priority) break;
+		if (tbi->priority == bi->priority && tbi->order > bi->order) break;
+	}
+
+	snprintf(desc, sizeof(desc), "%s %s %lluMb",
+			bi->device, bi->fstype, bi->blocks/1024);
+
+	if (bi->label)
+		label = bi->label;
+	else
+		label = bi->kernelpath + sizeof(MOUNTPOINT) - 1;
+
+	log_msg(lg, "+ [%s]", label);
+	mi = menu_item_insert(ml, pos, A_DEVICES + no, label, desc, NULL);
+
+#ifdef USE_ICONS
+	if (gui) {
+		/* Search associated with boot item icon if any */
+		icon = bi->icondata;
+		if (!icon && (gui->icons)) {
+			/* We have no custom icon - use default */
+			switch (bi->dtype) {
+			case DVT_STORAGE:
+				icon = gui->icons[ICON_STORAGE];
+				break;
+			case DVT_MMC:
+				icon = gui->icons[ICON_MMC];
+				break;
+			case DVT_MTD:
+				icon = gui->icons[ICON_MEMORY];
+				break;
+			case DVT_UNKNOWN:
+			default:
+				break;
+			}
+		}
+
+		/* Add icon to menu */
+		if (mi) mi->data = icon;
+	}
+#endif
+
+	return mi;
+}
+
+
+/* Stop devices scanning and free probing pool */
+void scan_devices_finish(struct params_t *params)
+{
+	if (NULL == params->pool) return;
+
+	scanpool_cancel(params->pool);
+	scanpool_destroy(params->pool);
+	params->pool = NULL;
+
+#ifdef USE_SCAN_CACHE
+	scancache_report();
+	scancache_save(USE_SCAN_CACHE);
+#endif
+
+	log_msg(lg, "Scan is finished: %d boot item(s) found",
+			params->bootcfg->fill);
+
+#ifdef USE_CPUFREQ
+	/* Nothing to do until item is chosen */
+	cpufreq_idle();
+#endif
+}
+
+
+#ifdef USE_RESUME
+/* Add resume item once hibernation image and its kernel are found */
+static void resume_offer(struct params_t *params)
+{
+	struct bootconf_t *bc = params->bootcfg;
+	unsigned int i, n;
+
+	if ( (params->resume_item >= 0) || (NULL == resume_device()) ) return;
+
+	for (i = 0; i < bc->fill; i++) {
+		if (resume_match(bc->list[i])) break;
+	}
+	if (i == bc->fill) return;
+
+	n = bc->fill;
+	if (-1 == resume_add_item(bc, bc->list[i])) return;
+
+	log_msg(lg, "Hibernated system on %s can be resumed by %s",
+			resume_device(), bc->list[i]->kernelpath);
+	bc->list[n]->order = bc->list[i]->order;
+	menu_add_boot_item(params, n);
+	if (!params->menu_touched)
+		menu_item_select_by_id(params->menu->top, A_DEVICES + n);
+	params->resume_item = n;
+
+	/* Nothing else will be booted */
+	if (params->cfg->resume_auto) scan_devices_finish(params);
+}
+#endif
+
+
+#ifdef USE_UEVENTS
+static void scan_devices_hotplug(struct params_t *params);
+#endif
+
+/* Merge results of finished probes into bootconf and main menu.
+ * Return count of boot items added */
+int scan_devices_collect(struct params_t *params)
+{
+	struct bootconf_t *bc = params->bootcfg;
+	struct boot_item_t *def;
+	kx_scan_job *job;
+	unsigned int i, first;
+	int n = 0;
+	char buf[64];
+
+	if (NULL == params->pool) return 0;
+
+	/* Drain notification pipe. All finished jobs are taken below */
+	if (params->scan_notify[0] >= 0) {
+		while (read(params->scan_notify[0], buf, sizeof(buf)) > 0);
+	}
+
+	while (NULL != (job = scanpool_collect(params->pool))) {
+		if (job->rc < 0) continue;
+
+#ifdef USE_PROBE_ORDER
+		if ( !params->confirmed && default_confirmed(job) ) {
+			log_msg(lg, "Default item of last boot is confirmed on %s",
+					job->dev.device);
+			params->confirmed = 1;
+		}
+#endif
+
+#ifdef USE_UEVENTS
+		/* Device is removed while it was probed */
+		if (in_charlist(params->devices, job->dev.device) < 0) continue;
+#endif
+
+#ifdef USE_ZAURUS
+		/* Fix partition sizes. We can have kernel in root and home partitions on NAND */
+		/* HACK: mtdblock devices are hardcoded */
+		if (0 == zaurus_error) {
+			if (0 == strcmp(job->dev.device, "/dev/mtdblock2")) {	/* root */
+				log_msg(lg, "+ [zaurus root] size of %s will be changed from %llu to %lu",
+						job->dev.device, job->dev.blocks, pinfo.root);
+				job->dev.blocks = pinfo.root;
+			} else if (0 == strcmp(job->dev.device, "/dev/mtdblock3")) {	/* home */
+				log_msg(lg, "+ [zaurus home] size of %s will be changed from %llu to %lu",
+						job->dev.device, job->dev.blocks, pinfo.home);
+				job->dev.blocks = pinfo.home;
+			}
+		}
+#endif
+
+		/* Now we have something in cfgdata */
+		first = bc->fill;
+		def = bc->default_item;
+		addto_bootcfg(bc, &job->dev, &job->cfgdata);
+
+		for (i = first; i < bc->fill; i++) {
+			bc->list[i]->order = job->no;
+			menu_add_boot_item(params, i);
+			++n;
+
+			/* Select default item until selection is moved by user */
+			if (bc->list[i] == bc->default_item && def != bc->default_item
+					&& !params->menu_touched
+			) {
+				menu_item_select_by_id(params->menu->top, A_DEVICES + i);
+			}
+		}
+	}
+
+#ifdef USE_RESUME
+	resume_offer(params);
+#endif
+
+	if ( params->pool && params->pool->closed
+			&& (0 == scanpool_pending(params->pool)) ) {
+		scan_devices_finish(params);
+#ifdef USE_UEVENTS
+		/* Devices plugged while pool was busy get new pool */
+		if (params->hotplug_count > 0) scan_devices_hotplug(params);
+#endif
+	}
+
+	return n;
+}
+
+
+#ifdef USE_SCAN_LIMITS
+/* Arm watch timer to expire after 'ms' milliseconds or disarm it */
+static void scan_devices_arm(struct params_t *params, int ms)
+{
+	struct itimerspec its;
+
+	if (params->watch_fd < 0) return;
+
+	memset(&its, 0, sizeof(its));
+	if (ms >= 0) {
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000L + 1;	/* 0 disarms */
+	}
+	timerfd_settime(params->watch_fd, 0, &its, NULL);
+}
+
+
+/* Apply probing time limits to new pool */
+static void scan_devices_limit(struct params_t *params)
+{
+	unsigned int timeout = 0;
+	unsigned long long deadline = 0;
+
+#ifdef USE_PROBE_TIMEOUT
+	timeout = USE_PROBE_TIMEOUT * 1000;
+#endif
+#ifdef USE_SCAN_BUDGET
+	/* Budget is for boot time. Later hotplugged devices are not limited */
+	if (msec_now() < params->scan_deadline) deadline = params->scan_deadline;
+#endif
+
+	scanpool_set_limits(params->pool, timeout, deadline);
+	scan_devices_arm(params, scanpool_expire(params->pool));
+}
+#endif
+
+
+/* Create probing pool and read filesystems list if needed */
+static int scan_pool_start(struct params_t *params)
+{
+	if (NULL == params->fslist) {
+		params->fslist = scan_filesystems();
+		if (NULL == params->fslist) return -1;
+	}
+
+#ifdef USE_SCAN_THREADS
+	params->pool = scanpool_create(USE_SCAN_THREADS, probe_device, params,
+			params->scan_notify[1]);
+#else
+	params->pool = scanpool_create(0, probe_device, params, -1);
+#endif
+	if (NULL == params->pool) return -1;
+
+#ifdef USE_CPUFREQ
+	/* Probing and decompression are CPU-bound */
+	cpufreq_boost();
+#endif
+
+#ifdef USE_SCAN_LIMITS
+	scan_devices_limit(params);
+#endif
+
+#ifdef USE_SCAN_CACHE
+	scancache_load(USE_SCAN_CACHE);
+#endif
+#ifdef USE_PROBE_ORDER
+	probeorder_load(USE_PROBE_ORDER);
+#endif
+
+	return 0;
+}
+
+
+/* Detect filesystems on 'count' devices and hand them out to probing workers */
+static void scan_devices_queue(struct params_t *params, struct device_t *devs,
+		unsigned int count)
+{
+	unsigned int i, n, base;
+	kx_scan_job *job;
+	int rc;
+#ifdef USE_PROBE_ORDER
+	unsigned int *order;
+#endif
+
+	/* Read superblocks of all devices at once. If batch is failed
+	 * then devices will be detected by probing workers one by one */
+	rc = -1;
+#ifndef USE_PROBE_TIMEOUT
+	/* With timeouts superblocks are read by workers. Hung device
+	 * can be abandoned there but would stall batch */
+	if (count > 0) rc = devscan_detect_batch(devs, count, params->fslist);
+#endif
+
+#ifdef USE_PROBE_ORDER
+	/* Probe likely boot device first. Menu is kept in devices order */
+	order = malloc(count * sizeof(*order));
+	if (order) probeorder_sort(devs, count, order);
+#endif
+	base = params->pool->count;
+
+	for (i = 0; i < count; i++) {
+		n = i;
+#ifdef USE_PROBE_ORDER
+		if (order) n = order[i];
+#endif
+#ifdef USE_UEVENTS
+		addto_charlist(params->devices, devs[n].device);
+#endif
+		if ( (0 == rc) && (NULL == devs[n].fstype) ) {
+			free(devs[n].device);
+			continue;
+		}
+
+		job = scanpool_add(params->pool, &devs[n]);
+		if (NULL == job) {
+			free(devs[n].device);
+			continue;
+		}
+		job->no = base + n;
+	}
+
+#ifdef USE_PROBE_ORDER
+	dispose(order);
+#endif
+}
+
+
+/* Close probing pool and wait for results right here
+ * when event loop can't be woken up */
+static void scan_devices_close(struct params_t *params)
+{
+	scanpool_close(params->pool);
+
+	if ((params->scan_notify[0] < 0) || (0 == params->pool->workers))
+		scanpool_wait(params->pool);
+
+	scan_devices_collect(params);
+}
+
+
+#ifdef USE_SCAN_LIMITS
+/* Watch timer is expired. Give up probes which are out of time */
+static void scan_devices_watch(struct params_t *params)
+{
+	uint64_t expirations;
+	int ms;
+
+	if (params->watch_fd < 0) return;
+	if (read(params->watch_fd, &expirations, sizeof(expirations)) <= 0)
+		return;
+
+	if (NULL == params->pool) return;
+
+	ms = scanpool_expire(params->pool);
+
+	if (params->pool->deadline && (msec_now() >= params->pool->deadline)) {
+		/* Budget is spent. Go on with items we have */
+#ifdef USE_UEVENTS
+		params->settling = 0;
+#endif
+		scan_devices_close(params);
+		return;
+	}
+
+	scan_devices_collect(params);
+	if (params->pool) scan_devices_arm(params, ms);
+}
+#endif
+
+
+#ifdef USE_UEVENTS
+/* (Re)start settle deadline. Scan is finished after it is expired */
+static void scan_devices_settle(struct params_t *params)
+{
+	struct itimerspec its;
+
+	params->settling = 1;
+	if (params->settle_fd < 0) return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = USE_UEVENTS;
+	timerfd_settime(params->settle_fd, 0, &its, NULL);
+}
+
+
+/* Remove boot items of gone device from menu */
+static void scan_devices_remove(struct params_t *params, const char *device)
+{
+	kx_menu_level *ml = params->menu->top;
+	kx_menu_item *mi;
+	kx_menu_dim i;
+	unsigned int j;
+	int n;
+
+	/* Device is gone before it is probed */
+	for (j = 0; j < params->hotplug_count; j++) {
+		if (strcmp(device, params->hotplug[j].device)) continue;
+
+		free(params->hotplug[j].device);
+		params->hotplug[j] = params->hotplug[--params->hotplug_count];
+		return;
+	}
+
+	n = in_charlist(params->devices, device);
+	if (n < 0) return;
+
+	log_msg(lg, "Device '%s' is removed", device);
+	delfrom_charlist(params->devices, n);
+
+	for (i = 0; i < ml->count; ) {
+		mi = ml->list[i];
+		if ( (mi->id >= A_DEVICES) && !strcmp(device,
+				params->bootcfg->list[mi->id - A_DEVICES]->device) )
+		{
+#ifdef USE_BOOT_HANDLES
+			/* Let detached filesystem of removed device go */
+			close_boothandles(params->bootcfg->list[mi->id - A_DEVICES]);
+#endif
+			menu_item_remove(ml, i);
+		} else {
+			++i;
+		}
+	}
+}
+
+
+/* Queue hotplugged devices to probing pool. Pool is started when
+ * there is none */
+static void scan_devices_hotplug(struct params_t *params)
+{
+	if ( (NULL == params->pool) && (-1 == scan_pool_start(params)) )
+		return;
+
+	scan_devices_queue(params, params->hotplug, params->hotplug_count);
+	dispose(params->hotplug);
+	params->hotplug = NULL;
+	params->hotplug_count = 0;
+
+	if (params->settling) {
+		/* More devices may come. Wait for them */
+		scan_devices_settle(params);
+	} else {
+		scan_devices_close(params);
+	}
+}
+
+
+/* Return 1 when device is known to scanner or waits for probing */
+static int scan_devices_known(struct params_t *params, const char *device)
+{
+	unsigned int i;
+
+	for (i = 0; i < params->hotplug_count; i++) {
+		if (!strcmp(device, params->hotplug[i].device)) return 1;
+	}
+
+	return (in_charlist(params->devices, device) >= 0);
+}
+
+
+/* Process pending kernel uevents: probe added devices
+ * and remove gone ones from menu */
+int scan_devices_uevent(struct params_t *params)
+{
+	struct uevent_t ev;
+	unsigned int size = params->hotplug_count, count = 0;
+	char device[sizeof(ev.name) + 5];	/* 5 = strlen("/dev/") */
+	int rc;
+
+	if (NULL == params->bootcfg) return -1;
+
+	while ((rc = uevent_read(params->uevent_fd, &ev)) >= 0) {
+		if (0 == rc) continue;
+
+		snprintf(device, sizeof(device), "/dev/%s", ev.name);
+
+		if (UE_REMOVE == ev.action) {
+			scan_devices_remove(params, device);
+			continue;
+		}
+
+		/* Device may be found by coldplug already */
+		if (scan_devices_known(params, device)) continue;
+
+		/* Resize list when needed before reading item */
+		if (params->hotplug_count >= size) {
+			struct device_t *new_devs;
+
+			size = size ? size * 2 : 4;
+			new_devs = realloc(params->hotplug, size * sizeof(*new_devs));
+			if (NULL == new_devs) {
+				DPRINTF("Can't resize devices list");
+				break;
+			}
+			params->hotplug = new_devs;
+		}
+
+		if (devscan_sysfs_device(ev.name,
+				&params->hotplug[params->hotplug_count]) > 0) {
+			++params->hotplug_count;
+			++count;
+		}
+	}
+
+	if (0 == params->hotplug_count) return 0;
+
+	/* Previous pool is closed and can't take jobs anymore. Devices wait
+	 * until scan_devices_collect() finishes it on notification */
+	if (params->pool && !params->settling) return count;
+
+	scan_devices_hotplug(params);
+	return count;
+}
+
+
+/* Settle deadline is expired. No more devices are expected */
+void scan_devices_settled(struct params_t *params)
+{
+	uint64_t expirations;
+
+	/* Timer is shared with probing limits. Check that it is ours */
+	if ( (params->settle_fd >= 0) && (read(params->settle_fd,
+			&expirations, sizeof(expirations)) <= 0) )
+		return;
+
+	if (!params->settling) return;
+	params->settling = 0;
+
+	log_msg(lg, "Devices are settled");
+	if (params->pool) scan_devices_close(params);
+}
+#endif	/* USE_UEVENTS */
+
+
+/* Start devices scanning. Found boot items are added to bootconf
+ * and main menu by scan_devices_collect() as devices are probed */
+int scan_devices(struct params_t *params)
+{
+	struct bootconf_t *bootconf;
+	struct device_t *devs = NULL;
+	unsigned int size = 0, count = 0;
+	int rc;
+#ifdef USE_UEVENTS
+	struct charlist *names;
+	struct pollfd pfd;
+	unsigned int i = 0;
+	int ms;
+#else
+	FILE *f;
 #endif
 
 	bootconf = create_bootcfg(4);
@@ -399,16 +1205,25 @@ int scan_devices(struct params_t *params)
 		DPRINTF("Can't allocate bootconf structure");
 		return -1;
 	}
+	params->bootcfg = bootconf;
+
+#ifdef USE_UEVENTS
+	/* Coldplug: take devices which are present already from sysfs.
+	 * Devices which are coming later will be added by uevents */
+	names = devscan_sysfs_names();
+	if (NULL == names) return -1;
 
-	f = devscan_open(&fl);
+	if (params->devices) free_charlist(params->devices);
+	params->devices = create_charlist(names->fill + 1);
+#else
+	f = devscan_open(&params->fslist);
 	if (NULL == f) {
 		log_msg(lg, "Can't initiate device scan");
 		return -1;
 	}
+#endif
 
 #ifdef USE_ZAURUS
-	struct zaurus_partinfo_t pinfo;
-	int zaurus_error = 0;
 	zaurus_error = zaurus_read_partinfo(&pinfo);
 	if (0 == zaurus_error) {
 		/* Fix mtdparts tag */
@@ -417,115 +1232,80 @@ int scan_devices(struct params_t *params)
 	}
 #endif
 
-	for (;;) {
-		rc = devscan_next(f, fl, &dev);
-		if (rc < 0) continue;	/* Error */
-		if (0 == rc) break;		/* EOF */
-
-		/* initialize with defaults */
-		strcpy(mount_dev, dev.device);
-		strcpy(mount_fstype, dev.fstype);
-
-		/* We found an ubi erase counter */
-		if (!strncmp(dev.fstype, "ubi",3)) {
+	if (-1 == scan_pool_start(params)) {
+#ifdef USE_UEVENTS
+		free_charlist(names);
+#else
+		fclose(f);
+#endif
+		return -1;
+	}
 
-			/* attach ubi boot device - mtd id [0-15] */
-			if(isdigit(atoi(dev.device+strlen(dev.device)-2))) {
-				strcpy(str_mtd_id, dev.device+strlen(dev.device)-2);
-				strcat(str_mtd_id, dev.device+strlen(dev.device)-1);
-			} else {
-				strcpy(str_mtd_id, dev.device+strlen(dev.device)-1);
+	/* Read whole devices list */
+	for (;;) {
+		/* Resize list when needed before reading item */
+		if (count >= size) {
+			struct device_t *new_devs;
+
+			size = size ? size * 2 : 8;
+			new_devs = realloc(devs, size * sizeof(*devs));
+			if (NULL == new_devs) {
+				DPRINTF("Can't resize devices list");
+				break;
 			}
-			n = ubi_attach(str_mtd_id);
-
-			/* we have attached ubiX and we mount /dev/ubiX_0  */
-			sprintf(mount_dev, "/dev/ubi%d", n);
-			 /* HARDCODED: first volume */
-			strcat(mount_dev, "_0");
-
-			/* HARDCODED: we assume it's ubifs */
-			strcpy(mount_fstype, "ubifs");
+			devs = new_devs;
 		}
 
-		/* Mount device */
-		if (-1 == mount(mount_dev, MOUNTPOINT, mount_fstype, MS_RDONLY, NULL)) {
-			log_msg(lg, "+ can't mount device %s: %s", mount_dev, ERRMSG);
-			goto free_device;
-		}
+#ifdef USE_UEVENTS
+		if (i >= names->fill) break;
+		rc = devscan_sysfs_device(names->list[i++], &devs[count]);
+#else
+		rc = devscan_read(f, &devs[count]);
+#endif
+		if (rc < 0) continue;	/* Error */
+		if (0 == rc) break;		/* EOF */
+		++count;
+	}
+#ifdef USE_UEVENTS
+	free_charlist(names);
+#else
+	fclose(f);
+#endif
 
-		/* NOTE: Don't go out before umount'ing */
+	scan_devices_queue(params, devs, count);
+	dispose(devs);
 
-		/* Search boot method and return boot info */
-		rc = get_bootinfo(&cfgdata);
+#ifdef USE_UEVENTS
+	/* Slow devices may appear later. Wait until they settle */
+	if (params->uevent_fd >= 0) {
+		scan_devices_settle(params);
 
-		if (-1 == rc) {	/* Error */
-			goto umount;
+		/* Event loop will finish the scan when deadline is expired */
+		if (params->settle_fd >= 0) {
+			scan_devices_collect(params);
+			return 0;
 		}
 
-#ifdef USE_ICONS
-		/* Iterate over sections found */
-		if (params->gui) {
-			for (i = 0; i < cfgdata.count; i++) {
-				sc = cfgdata.list[i];
-				if (!sc) continue;
-
-				/* Load custom icon */
-				if (sc->iconpath) {
-					rows = xpm_load_image(&xpm_data, sc->iconpath);
-					if (-1 == rows) {
-						log_msg(lg, "+ can't load xpm icon %s", sc->iconpath);
-						continue;
-					}
-
-					sc->icondata = xpm_parse_image(xpm_data, rows);
-					if (!sc->icondata) {
-						log_msg(lg, "+ can't parse xpm icon %s", sc->iconpath);
-						continue;
-					}
-					xpm_destroy_image(xpm_data, rows);
-				}
-			}
-		}
+		/* No event loop. Wait for devices right here */
+		pfd.fd = params->uevent_fd;
+		pfd.events = POLLIN;
+		for (;;) {
+			ms = USE_UEVENTS * 1000;
+#ifdef USE_SCAN_BUDGET
+			/* Don't wait for devices beyond budget */
+			if (msec_now() + ms > params->scan_deadline)
+				ms = (msec_now() < params->scan_deadline) ?
+						params->scan_deadline - msec_now() : 0;
 #endif
-
-umount:
-		/* Umount device */
-		if (-1 == umount(MOUNTPOINT)) {
-			log_msg(lg, "+ can't umount device: %s", ERRMSG);
-			goto free_cfgdata;
-		}
-
-		if (-1 == rc) {	/* Error */
-			goto free_cfgdata;
-		}
-
-#ifdef USE_ZAURUS
-		/* Fix partition sizes. We can have kernel in root and home partitions on NAND */
-		/* HACK: mtdblock devices are hardcoded */
-		if (0 == zaurus_error) {
-			if (0 == strcmp(dev.device, "/dev/mtdblock2")) {	/* root */
-				log_msg(lg, "+ [zaurus root] size of %s will be changed from %llu to %lu",
-						dev.device, dev.blocks, pinfo.root);
-				dev.blocks = pinfo.root;
-			} else if (0 == strcmp(dev.device, "/dev/mtdblock3")) {	/* home */
-				log_msg(lg, "+ [zaurus home] size of %s will be changed from %llu to %lu",
-						dev.device, dev.blocks, pinfo.home);
-				dev.blocks = pinfo.home;
-			}
+			if (poll(&pfd, 1, ms) <= 0) break;
+			scan_devices_uevent(params);
 		}
-#endif
-
-		/* Now we have something in cfgdata */
-		rc = addto_bootcfg(bootconf, &dev, &cfgdata);
 
-free_cfgdata:
-		destroy_cfgdata(&cfgdata);
-free_device:
-		free(dev.device);
+		params->settling = 0;
 	}
+#endif
 
-	free_charlist(fl);
-	params->bootcfg = bootconf;
+	scan_devices_close(params);
 	return 0;
 }
 
@@ -581,6 +1361,13 @@ kx_menu *build_menu(struct params_t *params)
 	if (icons) menu_item_set_data(mi, icons[ICON_DEBUG]);
 #endif
 
+#ifdef USE_FAST_REBOOT
+	mi = menu_item_add(ml, A_FASTREBOOT, "Fast reboot", NULL, NULL);
+#ifdef USE_ICONS
+	if (icons) menu_item_set_data(mi, icons[ICON_REBOOT]);
+#endif
+#endif
+
 	mi = menu_item_add(ml, A_REBOOT, "Reboot", NULL, NULL);
 #ifdef USE_ICONS
 	if (icons) menu_item_set_data(mi, icons[ICON_REBOOT]);
@@ -604,118 +1391,6 @@ kx_menu *build_menu(struct params_t *params)
 }
 
 
-/* Fill main menu with boot items */
-int fill_menu(struct params_t *params)
-{
-	kx_menu_item *mi;
-	int i, b_items, max_pri, max_i, *a;
-	struct boot_item_t *tbi;
-	struct bootconf_t *bl;
-	const int sizeof_desc = 160;
-	char *desc, *label;
-#ifdef USE_ICONS
-	kx_picture *icon;
-	struct gui_t *gui;
-
-	gui = params->gui;
-#endif
-
-	bl = params->bootcfg;
-
-	if ( (NULL != bl) && (bl->fill > 0) ) b_items = bl->fill;
-	else {
-		log_msg(lg, "No items for menu found");
-		return 0;
-	}
-
-	log_msg(lg, "Populating menu: %d item(s)", b_items);
-
-	desc = malloc(sizeof_desc);
-	if (NULL == desc) {
-		DPRINTF("Can't allocate item description");
-		goto dirty_exit;
-	}
-
-	a = malloc(b_items * sizeof(*a));	/* Markers array */
-	if (NULL == a) {
-		DPRINTF("Can't allocate markers array");
-		goto dirty_exit;
-	}
-
-	for (i = 0; i < b_items; i++) a[i] = 0;	/* Clean markers array */
-
-	/* Create menu of sorted by priority boot items */
-	max_i = -1;
-	for(;;) {
-		max_pri = -1;
-		/* Search item with maximum priority */
-		for (i = 0; i < b_items; i++) {
-			if (0 == a[i]) {	/* Check that item is not processed yet */
-				tbi = bl->list[i];
-				if (tbi->priority > max_pri) {
-					max_pri = tbi->priority;	/* Max priority */
-					max_i = i;					/* Max priority item index */
-				}
-			}
-		}
-
-		if (max_pri >= 0) {
-			a[max_i] = 1;	/* Mark item as processed */
-			/* We have found new max priority - insert into menu */
-			tbi = bl->list[max_i];
-			snprintf(desc, sizeof_desc, "%s %s %lluMb",
-					tbi->device, tbi->fstype, tbi->blocks/1024);
-
-			if (tbi->label)
-				label = tbi->label;
-			else
-				label = tbi->kernelpath + sizeof(MOUNTPOINT) - 1;
-
-			log_msg(lg, "+ [%s]", label);
-			mi = menu_item_add(params->menu->top, A_DEVICES + max_i,
-					label, desc, NULL);
-
-#ifdef USE_ICONS
-			if (gui) {
-				/* Search associated with boot item icon if any */
-				icon = tbi->icondata;
-				if (!icon && (gui->icons)) {
-					/* We have no custom icon - use default */
-					switch (tbi->dtype) {
-					case DVT_STORAGE:
-						icon = gui->icons[ICON_STORAGE];
-						break;
-					case DVT_MMC:
-						icon = gui->icons[ICON_MMC];
-						break;
-					case DVT_MTD:
-						icon = gui->icons[ICON_MEMORY];
-						break;
-					case DVT_UNKNOWN:
-					default:
-						break;
-					}
-				}
-
-				/* Add icon to menu */
-				if (mi) mi->data = icon;
-			}
-#endif
-		}
-
-		if (-1 == max_pri) break;	/* We have no items to process */
-	}
-
-	free(a);
-	free(desc);
-	return 0;
-
-dirty_exit:
-	dispose(desc);
-	return -1;
-}
-
-
 /* Return 0 if we are ordinary app or 1 if we are init */
 int do_init(void)
 {
@@ -766,6 +1441,11 @@ int do_rescan(struct params_t *params)
 {
 	int i;
 
+	if (params->pool) {
+		log_msg(lg, "Devices scan is in progress already");
+		return 0;
+	}
+
 	/* Clean top menu level except system menu item */
 	/* FIXME should be done by some function from menu module */
 	kx_menu_item *mi;
@@ -779,6 +1459,9 @@ int do_rescan(struct params_t *params)
 		params->menu->top->list[i] = NULL;
 	}
 	params->menu->top->count = 1;
+	params->menu->top->current = params->menu->top->list[0];
+	params->menu->top->current_no = 0;
+	params->menu_touched = 0;
 
 #ifdef USE_ICONS
 	/* Destroy icons */
@@ -790,9 +1473,14 @@ int do_rescan(struct params_t *params)
 
 	free_bootcfg(params->bootcfg);
 	params->bootcfg = NULL;
+#ifdef USE_RESUME
+	params->resume_item = -1;
+#endif
+
+	/* Failed scan just gives empty menu */
 	scan_devices(params);
 
-	return fill_menu(params);
+	return 0;
 }
 
 
@@ -803,6 +1491,9 @@ int process_ctx_menu(struct params_t *params, int action) {
 	static int rc;
 	static int menu_action;
 	static kx_menu *menu;
+#ifdef USE_TIMEOUT
+	unsigned int i;
+#endif
 	menu = params->menu;
 
 #ifdef USE_NUMKEYS
@@ -818,9 +1509,21 @@ int process_ctx_menu(struct params_t *params, int action) {
 	}
 #endif
 
+	/* Don't move selection from under user anymore */
+	if ( (A_UP == action) || (A_DOWN == action) || (A_SUBMENU == action)
+			|| (A_PARENTMENU == action) || (A_SELECT == action)
+	) params->menu_touched = 1;
+
 	menu_action = (A_SELECT == action ? menu->current->current->id : action);
 	rc = 1;
 
+#ifdef USE_FAST_REBOOT
+	/* Reboot is fast by default when config or cmdline says so */
+	if ( (A_REBOOT == menu_action) && ( params->cfg->fast_reboot
+			|| (params->bootcfg && params->bootcfg->fast_reboot) ) )
+		menu_action = A_FASTREBOOT;
+#endif
+
 	switch (menu_action) {
 	case A_UP:
 		menu_item_select(menu, -1);
@@ -835,6 +1538,22 @@ int process_ctx_menu(struct params_t *params, int action) {
 		menu->current = menu->current->parent;
 		break;
 
+#ifdef USE_FAST_REBOOT
+	case A_FASTREBOOT:
+#ifdef USE_FBMENU
+		gui_show_msg(params->gui, "Restarting...");
+#endif
+#ifdef USE_TEXTUI
+		tui_show_msg(params->tui, "Restarting...");
+#endif
+		fast_reboot();
+#ifdef USE_HOST_DEBUG
+		break;
+#else
+		log_msg(lg, "Fast reboot failed, doing full one");
+		/* fall through */
+#endif
+#endif
 	case A_REBOOT:
 #ifdef USE_FBMENU
 		gui_show_msg(params->gui, "Rebooting...");
@@ -895,7 +1614,23 @@ int process_ctx_menu(struct params_t *params, int action) {
 		break;
 
 #ifdef USE_TIMEOUT
-	case A_TIMEOUT:		// timeout was reached - boot 1st kernel if exists
+	case A_TIMEOUT:		// timeout was reached - boot default or 1st kernel if exists
+		/* Wait for all devices. Better item may be found yet */
+#ifdef USE_PROBE_ORDER
+		if (params->pool && !params->confirmed) break;
+#else
+		if (params->pool) break;
+#endif
+		if (params->bootcfg && params->bootcfg->default_item) {
+			for (i = 0; i < params->bootcfg->fill; i++) {
+				if (params->bootcfg->list[i] == params->bootcfg->default_item)
+					break;
+			}
+			if (0 == menu_item_select_by_id(menu->current, A_DEVICES + i)) {
+				rc = 0;
+				break;
+			}
+		}
 		if (menu->current->count > 1) {
 			menu_item_select(menu, 0);	/* choose first item */
 			menu_item_select(menu, 1);	/* and switch to next item */
@@ -931,6 +1666,7 @@ int process_ctx_textview(struct params_t *params, int action) {
 	static int rc;
 
 	rc = 1;
+	log_lock();
 	switch (action) {
 	case A_UP:
 		if (lg->current_line_no > 0) --lg->current_line_no;
@@ -951,26 +1687,99 @@ int process_ctx_textview(struct params_t *params, int action) {
 		rc = -1;
 		break;
 	}
+	log_unlock();
 	return rc;
 }
 
 /* Draw text view context */
 void draw_ctx_textview(struct params_t *params)
 {
+	kx_text *text;
+
+	/* Probing threads may log while we are drawing and drawing
+	 * itself may log. Draw copy of visible rows without lock */
+	text = log_copy(lg, TEXTVIEW_ROWS);
+	if (NULL == text) return;
+
 #ifdef USE_FBMENU
-	gui_show_text(params->gui, lg);
+	gui_show_text(params->gui, text);
 #endif
 #ifdef USE_TEXTUI
-	tui_show_text(params->tui, lg);
+	tui_show_text(params->tui, text);
+#endif
+	log_close(text);
+}
+
+
+#if defined(USE_TIMEOUT) && (0 == USE_TIMEOUT)
+/* Check that nothing better than found items is expected from scan */
+static int scan_devices_done(struct params_t *params)
+{
+#ifdef USE_PROBE_ORDER
+	if (params->confirmed) return 1;
 #endif
+	return (NULL == params->pool);
 }
+#endif
 
 
 /* Main event loop */
+/* Process scanner events. Return 1 when action is consumed */
+static int process_notify(struct params_t *params, int action)
+{
+	switch (action) {
+	case A_NOTIFY:
+		/* Some devices are probed. Show what is found */
+		scan_devices_collect(params);
+		break;
+#ifdef USE_UEVENTS
+	case A_UEVENT:
+		/* Devices are added or removed */
+		scan_devices_uevent(params);
+		break;
+#endif
+#if defined(USE_UEVENTS) || defined(USE_SCAN_LIMITS)
+	case A_TIMER:
+		/* Settle or watch timer. Every handler checks its own one */
+#ifdef USE_UEVENTS
+		scan_devices_settled(params);
+#endif
+#ifdef USE_SCAN_LIMITS
+		scan_devices_watch(params);
+#endif
+		break;
+#endif
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+
+#ifdef USE_PRELOAD
+/* Load highlighted kernel while menu is idle */
+static void preload_highlighted(struct params_t *params)
+{
+	kx_menu_item *mi;
+
+	/* Don't compete with device scanning for I/O */
+	if (params->pool || (KX_CTX_MENU != params->context)) return;
+
+	mi = params->menu->current->current;
+	if (mi && (mi->id >= A_DEVICES))
+		preload_request(params->bootcfg->list[mi->id - A_DEVICES]);
+}
+#endif
+
+
 int do_main_loop(struct params_t *params, kx_inputs *inputs)
 {
 	int rc = 0;
 	int action;
+#if defined(USE_TIMEOUT) && (0 == USE_TIMEOUT)
+	int timeout_fired = 0;
+#endif
 
 	/* Start with menu context */
 	params->context = KX_CTX_MENU;
@@ -978,12 +1787,38 @@ int do_main_loop(struct params_t *params, kx_inputs *inputs)
 
 	/* Event loop */
 	do {
+#ifdef USE_RESUME
+		/* Hibernated system is resumed without asking */
+		if ( params->cfg->resume_auto && (params->resume_item >= 0)
+				&& !params->menu_touched
+				&& (0 == menu_item_select_by_id(params->menu->top,
+						A_DEVICES + params->resume_item)) )
+		{
+			params->menu->current = params->menu->top;
+			rc = 0;
+			break;
+		}
+#endif
+#ifdef USE_PRELOAD
+		preload_highlighted(params);
+#endif
+#if defined(USE_TIMEOUT) && (0 == USE_TIMEOUT)
+		/* Zero timeout: boot as soon as scan is finished */
+		if ( !timeout_fired && scan_devices_done(params)
+				&& !params->menu_touched && (KX_CTX_MENU == params->context) )
+		{
+			timeout_fired = 1;
+			action = A_TIMEOUT;
+		} else
+#endif
 		/* Read events */
 		action = inputs_process(inputs);
 		if (action != A_NONE) {
 
 			/* Process events in current context */
-			switch (params->context) {
+			if (process_notify(params, action)) {
+				rc = 1;
+			} else switch (params->context) {
 			case KX_CTX_MENU:
 				rc = process_ctx_menu(params, action);
 				break;
@@ -1016,6 +1851,97 @@ int do_main_loop(struct params_t *params, kx_inputs *inputs)
 }
 
 
+#ifdef USE_HEADLESS
+/* Check whether default item should be booted without UI */
+static int headless_wanted(struct params_t *params, kx_inputs *inputs)
+{
+	int autoboot = params->cfg->autoboot;
+
+#ifdef USE_SCAN_CACHE
+	/* AUTOBOOT of boot.cfg is known from last scan */
+	if (!autoboot) autoboot = scancache_autoboot(USE_SCAN_CACHE);
+#endif
+	if (!autoboot) return 0;
+
+	if (inputs_key_held(inputs)) {
+		log_msg(lg, "Key is held, menu is shown");
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/* Check progress of headless scan. Return 1 when default item is found
+ * and confirmed, 0 when more probes are needed or -1 when nothing is
+ * found at all */
+static int headless_ready(struct params_t *params)
+{
+	if (NULL == params->bootcfg->default_item)
+		return (NULL == params->pool) ? -1 : 0;
+
+#ifdef USE_PROBE_ORDER
+	/* Default item of last boot device. Other devices can't change it */
+	if (params->confirmed) return 1;
+#endif
+
+	/* Present devices are probed. Late ones are not waited for */
+	return (NULL == params->pool) || (0 == scanpool_pending(params->pool));
+}
+
+
+/* Scan devices and boot default item without UI.
+ * Return when UI is needed: scan results (and scan which is still
+ * running) are kept in params */
+static void boot_headless(struct params_t *params, kx_inputs *inputs)
+{
+	struct bootconf_t *bc;
+	unsigned int i;
+	int action, rc;
+
+	log_msg(lg, "Autoboot is requested, UI is not started");
+
+	/* Menu is filled by scan but is not shown */
+	params->menu = build_menu(params);
+	if (-1 == scan_devices(params)) return;
+
+	/* Run scan events until default item is known */
+	while (0 == (rc = headless_ready(params))) {
+		action = inputs_process(inputs);
+		if (A_NONE == action) continue;
+#ifdef USE_TIMEOUT
+		if (A_TIMEOUT == action) continue;
+#endif
+		if (process_notify(params, action)) continue;
+
+		log_msg(lg, "Key is pressed, menu is shown");
+		return;
+	}
+
+	if (rc < 0) {
+		log_msg(lg, "No default item is found");
+		return;
+	}
+
+	/* Key may be pressed while devices were probed */
+	if (inputs_key_held(inputs)) {
+		log_msg(lg, "Key is held, menu is shown");
+		return;
+	}
+
+	scan_devices_finish(params);
+
+	bc = params->bootcfg;
+	for (i = 0; i < bc->fill; i++) {
+		if (bc->list[i] == bc->default_item) break;
+	}
+
+	if (0 == load_boot_item(params, i)) boot_kernel();
+	log_msg(lg, "Can't boot default item");
+}
+#endif
+
+
 int main(int argc, char **argv)
 {
 	int rc = 0;
@@ -1026,6 +1952,15 @@ int main(int argc, char **argv)
 	lg = log_open(16);
 	log_msg(lg, "%s starting", PACKAGE_STRING);
 
+#ifdef USE_SCAN_LIMITS
+	/* Budget is counted from our start */
+	params.scan_deadline = 0;
+#ifdef USE_SCAN_BUDGET
+	params.scan_deadline = msec_now() + USE_SCAN_BUDGET * 1000;
+#endif
+	params.watch_fd = -1;
+#endif
+
 	initmode = do_init();
 
 	/* Get cmdline parameters */
@@ -1039,20 +1974,106 @@ int main(int argc, char **argv)
 	/* Setup function that will restore terminal when exit() will called */
 	atexit(atexit_restore_terminal);
 
+#ifdef USE_CPUFREQ
+	/* UI start and devices scan are going first */
+	cpufreq_boost();
+	atexit(cpufreq_restore);
+#endif
+
 	log_msg(lg, "FB angle is %d, tty is %s", cfg.angle, cfg.ttydev);
 
 #ifdef USE_MACHINE_KERNEL
 	machine_kernel = get_machine_kernelpath();	/* FIXME should be passed as arg to get_bootinfo() */
 #endif
 
+#ifdef USE_UEVENTS
+	/* Slow devices will be noticed by uevents so delay is not needed */
+	params.uevent_fd = uevent_open();
+	params.settle_fd = -1;
+	params.settling = 0;
+	params.devices = NULL;
+	params.hotplug = NULL;
+	params.hotplug_count = 0;
+	if (params.uevent_fd < 0)
+		log_msg(lg, "Can't open uevent socket: %s", ERRMSG);
+#endif
+
 #ifdef USE_DELAY
 	/* extra delay for initializing slow SD/CF */
+#ifdef USE_UEVENTS
+	if (params.uevent_fd < 0)
+#endif
 	sleep(USE_DELAY);
 #endif
 
-	int no_ui = 1;	/* UI presence flag */
+	params.menu = NULL;
+	params.menu_touched = 0;
+#ifdef USE_PROBE_ORDER
+	params.confirmed = 0;
+#endif
+#ifdef USE_RESUME
+	params.resume_item = -1;
+#endif
+	params.bootcfg = NULL;
+	params.pool = NULL;
+	params.scan_notify[0] = -1;
+	params.scan_notify[1] = -1;
+
+	/* Collect input devices */
+	inputs_init(&inputs, 8);
+	inputs_open(&inputs);
+
 #ifdef USE_FBMENU
 	params.gui = NULL;
+#endif
+#ifdef USE_TEXTUI
+	params.tui = NULL;
+#endif
+
+#ifdef USE_SCAN_THREADS
+	/* Menu is shown at once and filled while devices are probed.
+	 * Probing threads wake up event loop through this pipe */
+	if ( (inputs.count > 0) && (0 == pipe(params.scan_notify)) ) {
+		fcntl(params.scan_notify[0], F_SETFL, O_NONBLOCK);
+		fcntl(params.scan_notify[1], F_SETFL, O_NONBLOCK);
+		inputs_add_fd(&inputs, params.scan_notify[0], KX_IT_NOTIFY);
+	}
+#endif
+
+#ifdef USE_UEVENTS
+	/* Devices may come and go while menu is shown */
+	if ( (params.uevent_fd >= 0) && (inputs.count > 0) )
+		inputs_add_fd(&inputs, params.uevent_fd, KX_IT_UEVENT);
+
+	/* Settle deadline is checked by event loop in progressive mode */
+	if (params.scan_notify[0] >= 0) {
+		params.settle_fd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_NONBLOCK | TFD_CLOEXEC);
+		if (params.settle_fd >= 0)
+			inputs_add_fd(&inputs, params.settle_fd, KX_IT_TIMER);
+	}
+#endif
+
+#ifdef USE_SCAN_LIMITS
+	/* Probing limits are checked by event loop in progressive mode */
+	if (params.scan_notify[0] >= 0) {
+		params.watch_fd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_NONBLOCK | TFD_CLOEXEC);
+		if (params.watch_fd >= 0)
+			inputs_add_fd(&inputs, params.watch_fd, KX_IT_TIMER);
+	}
+#endif
+
+	inputs_preprocess(&inputs);
+
+#ifdef USE_HEADLESS
+	/* Framebuffer is not touched when default item is booted */
+	if (headless_wanted(&params, &inputs))
+		boot_headless(&params, &inputs);
+#endif
+
+	int no_ui = 1;	/* UI presence flag */
+#ifdef USE_FBMENU
 	if (no_ui) {
 		params.gui = gui_init(cfg.angle);
 		if (NULL == params.gui) {
@@ -1062,7 +2083,6 @@ int main(int argc, char **argv)
 #endif
 #ifdef USE_TEXTUI
 	FILE *ttyfp;
-	params.tui = NULL;
 	if (no_ui) {
 
 		if (cfg.ttydev) ttyfp = fopen(cfg.ttydev, "w");
@@ -1077,22 +2097,54 @@ int main(int argc, char **argv)
 #endif
 	if (no_ui) exit(-1); /* Exit if no one UI was initialized */
 	
+#ifdef USE_HEADLESS
+	/* Devices are scanned already (or still are). Show found items */
+	if (params.menu) menu_destroy(params.menu, 0);
 	params.menu = build_menu(&params);
-	params.bootcfg = NULL;
-	scan_devices(&params);
+	if (params.bootcfg) {
+		unsigned int i;
 
-	if (-1 == fill_menu(&params)) {
-		exit(-1);
+		for (i = 0; i < params.bootcfg->fill; i++) {
+			menu_add_boot_item(&params, i);
+			if (params.bootcfg->list[i] == params.bootcfg->default_item)
+				menu_item_select_by_id(params.menu->top, A_DEVICES + i);
+		}
 	}
+#else
+	params.menu = build_menu(&params);
+#endif
 
-	/* Collect input devices */
-	inputs_init(&inputs, 8);
-	inputs_open(&inputs);
-	inputs_preprocess(&inputs);
+#ifdef USE_HEADLESS
+	if (NULL == params.bootcfg)
+#endif
+	scan_devices(&params);
 
 	/* Run main event loop
 	 * Return values: <0 - error, >=0 - selected item id */
-	rc = do_main_loop(&params, &inputs);
+	while ((rc = do_main_loop(&params, &inputs)) >= A_DEVICES) {
+		/* Kernel is loaded while log is open so load messages can be
+		 * seen in debug view. Menu is shown again on failure */
+		scan_devices_finish(&params);
+		if (0 == load_boot_item(&params, rc - A_DEVICES)) break;
+
+		/* Don't autoboot failed item again */
+		params.menu_touched = 1;
+	}
+
+	/* Don't leave probing threads behind */
+	scan_devices_finish(&params);
+	if (params.scan_notify[1] >= 0) close(params.scan_notify[1]);
+#ifdef USE_UEVENTS
+	if (params.uevent_fd >= 0) close(params.uevent_fd);
+	if (params.settle_fd >= 0) close(params.settle_fd);
+	if (params.devices) free_charlist(params.devices);
+	while (params.hotplug_count > 0)
+		free(params.hotplug[--params.hotplug_count].device);
+	dispose(params.hotplug);
+#endif
+#ifdef USE_SCAN_LIMITS
+	if (params.watch_fd >= 0) close(params.watch_fd);
+#endif
 
 #ifdef USE_FBMENU
 	if (params.gui) {
@@ -1117,9 +2169,7 @@ int main(int argc, char **argv)
 
 	menu_destroy(params.menu, 0);
 
-	if (rc >= A_DEVICES) {
-		start_kernel(&params, rc - A_DEVICES);
-	}
+	if (rc >= A_DEVICES) boot_kernel();
 
 	/* When we reach this point then some error has occured */
 	DPRINTF("We should not reach this point!");
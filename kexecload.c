@@ -0,0 +1,745 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/mount.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <linux/reboot.h>
+
+#include "config.h"
+#include "util.h"
+#include "mntprofile.h"
+#include "imgread.h"
+#include "initrdcat.h"
+#ifdef USE_BOOTIMG
+#include "bootimg.h"
+#endif
+#include "kexecload.h"
+
+/* Values from linux/kexec.h which may be missing in libc headers */
+#define KX_KEXEC_FILE_NO_INITRAMFS	0x00000004
+#define KX_KEXEC_HARDBOOT			0x00000004	/* kexec-hardboot patch */
+#define KX_KEXEC_ARCH_ARM			(40 << 16)
+
+#ifdef USE_NATIVE_KEXEC
+
+/* Hardboot kernels should be loaded by kexec_load() */
+#if defined(__NR_kexec_file_load) && !defined(USE_HARDBOOT)
+#define USE_KEXEC_FILE
+#endif
+
+#if defined(__arm__) && defined(__NR_kexec_load)
+#define USE_KEXEC_SEGMENTS
+#endif
+
+#ifdef USE_KEXEC_FILE
+static int load_file(int kernel_fd, int initrd_fd, const char *cmdline)
+{
+	unsigned long flags = 0;
+	unsigned long long start, bytes = 0;
+	struct stat st;
+	int rc;
+
+	if (initrd_fd < 0) flags |= KX_KEXEC_FILE_NO_INITRAMFS;
+	if (NULL == cmdline) cmdline = "";
+
+	/* Syscall can't be interrupted. Files are read before it if needed */
+	if ( (-1 == imgread_cache(kernel_fd, "kernel"))
+			|| (-1 == imgread_cache(initrd_fd, "initrd")) )
+		return -1;
+
+	start = msec_now();
+	rc = syscall(__NR_kexec_file_load, kernel_fd, initrd_fd,
+			(unsigned long)strlen(cmdline) + 1, cmdline, flags);
+	if (-1 == rc) {
+		log_msg(lg, "kexec_file_load() failed: %s", ERRMSG);
+		return -1;
+	}
+
+	/* Kernel reads both files itself */
+	if (0 == fstat(kernel_fd, &st)) bytes += st.st_size;
+	if ( (initrd_fd >= 0) && (0 == fstat(initrd_fd, &st)) ) bytes += st.st_size;
+	imgread_report("kernel+initrd", bytes, msec_now() - start);
+
+	return 0;
+}
+#endif
+
+
+#ifdef USE_KEXEC_SEGMENTS
+
+/* Layout of boot memory, as kernel's machine_kexec() expects it */
+#define ARM_ATAGS_OFFSET	0x1000
+#define ARM_ZIMAGE_OFFSET	0x8000
+#define ARM_ZIMAGE_MAGIC	0x016f2818	/* at offset 0x24 */
+#define UIMAGE_MAGIC		0x27051956	/* big endian */
+#define UIMAGE_HEADER_SIZE	64
+
+#define ATAG_NONE		0x00000000
+#define ATAG_CORE		0x54410001
+#define ATAG_MEM		0x54410002
+#define ATAG_INITRD		0x54410005
+#define ATAG_INITRD2	0x54420005
+#define ATAG_CMDLINE	0x54410009
+
+/* Atags are placed between ATAGS and ZIMAGE offsets */
+#define ATAGS_MAX_WORDS	((ARM_ZIMAGE_OFFSET - ARM_ATAGS_OFFSET) / 4)
+
+struct kexec_segment {
+	const void *buf;
+	size_t bufsz;
+	unsigned long mem;
+	size_t memsz;
+};
+
+/* Bounded atags list */
+struct atags_t {
+	uint32_t words[ATAGS_MAX_WORDS];
+	unsigned int len;
+};
+
+
+/* Append tag with 'bytes' of data. Return -1 when there is no room */
+static int atags_add(struct atags_t *a, uint32_t tag, const void *data,
+		unsigned int bytes)
+{
+	unsigned int words = 2 + (bytes + 3) / 4;
+
+	if (a->len + words + 2 > ATAGS_MAX_WORDS) return -1;	/* 2 - ATAG_NONE */
+
+	a->words[a->len] = words;
+	a->words[a->len + 1] = tag;
+	a->words[a->len + words - 1] = 0;	/* Tail padding */
+	memcpy(&a->words[a->len + 2], data, bytes);
+	a->len += words;
+
+	return 0;
+}
+
+
+/* Take tags of running kernel except ones we will replace.
+ * Return -1 when there is no ATAG_MEM to describe memory to new kernel */
+static int atags_import(struct atags_t *a)
+{
+	uint32_t buf[ATAGS_MAX_WORDS];
+	unsigned int i = 0, n;
+	ssize_t len;
+	int fd, rc = -1;
+
+	fd = open("/proc/atags", O_RDONLY);
+	if (fd < 0) return -1;
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (len <= 0) return -1;
+
+	n = len / 4;
+	while (i + 2 <= n && buf[i] >= 2 && i + buf[i] <= n) {
+		if (ATAG_NONE == buf[i + 1]) break;
+		if (ATAG_MEM == buf[i + 1]) rc = 0;
+
+		if (ATAG_CMDLINE != buf[i + 1] && ATAG_INITRD != buf[i + 1]
+				&& ATAG_INITRD2 != buf[i + 1]
+		) {
+			if (-1 == atags_add(a, buf[i + 1], &buf[i + 2], (buf[i] - 2) * 4))
+				break;
+		}
+		i += buf[i];
+	}
+
+	return rc;
+}
+
+
+/* Find System RAM region with some room above 'min'. Return 0 or -1 */
+static int find_ram(unsigned long min, unsigned long *start, unsigned long *end)
+{
+	unsigned long s, e;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/iomem", "r");
+	if (NULL == f) return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		/* Top level regions only */
+		if (' ' == line[0]) continue;
+		if (2 != sscanf(line, "%lx-%lx", &s, &e)) continue;
+		if (NULL == strstr(line, ": System RAM")) continue;
+		if (e <= min) continue;
+
+		*start = (s > min) ? s : min;
+		*end = e;
+		fclose(f);
+		return 0;
+	}
+
+	fclose(f);
+	return -1;
+}
+
+
+
+#define PAGE_ALIGN(x, ps)	(((x) + (ps) - 1) & ~((unsigned long)(ps) - 1))
+
+/* Load kernel parts from memory with atags. 'initrd' may be NULL */
+static int load_buffers(const char *kernel, size_t klen, const char *initrd,
+		size_t ilen, const char *cmdline)
+{
+	struct kexec_segment seg[3];
+	struct atags_t *atags;
+	size_t ps = getpagesize();
+	unsigned long base, end, kaddr, iaddr = 0, flags, top;
+	uint32_t core[3], initrd2[2];
+	unsigned int nseg = 0;
+	int rc = -1;
+
+#ifdef USE_HARDBOOT
+	flags = KX_KEXEC_ARCH_ARM | KX_KEXEC_HARDBOOT;
+	if (-1 == find_ram(USE_HARDBOOT, &base, &end)) {
+#else
+	flags = KX_KEXEC_ARCH_ARM;
+	if (-1 == find_ram(0, &base, &end)) {
+#endif
+		log_msg(lg, "Can't find memory for kernel in /proc/iomem");
+		return -1;
+	}
+	base = PAGE_ALIGN(base, ps);
+
+	/* uImage is zImage with header */
+	if (klen > UIMAGE_HEADER_SIZE && UIMAGE_MAGIC == ntohl(*(uint32_t *)kernel)) {
+		kernel += UIMAGE_HEADER_SIZE;
+		klen -= UIMAGE_HEADER_SIZE;
+	}
+
+	if (klen < 0x30 || ARM_ZIMAGE_MAGIC != *(uint32_t *)(kernel + 0x24)) {
+		log_msg(lg, "Kernel is not zImage");
+		return -1;
+	}
+
+	/* Leave room for decompressed kernel below initrd */
+	kaddr = base + ARM_ZIMAGE_OFFSET;
+	top = kaddr + PAGE_ALIGN(klen * 4, ps);
+	if (initrd) {
+		iaddr = top;
+		top = iaddr + PAGE_ALIGN(ilen, ps);
+	}
+
+	if (top > end) {
+		log_msg(lg, "Kernel and initrd don't fit in memory");
+		return -1;
+	}
+
+	atags = malloc(sizeof(*atags));
+	if (NULL == atags) return -1;
+	atags->len = 0;
+
+	/* ATAG_CORE should be first */
+	core[0] = 1;	/* Read-only root */
+	core[1] = ps;
+	core[2] = 0;
+	atags_add(atags, ATAG_CORE, core, sizeof(core));
+	if (-1 == atags_import(atags)) {
+		/* No DT support here, kexec binary knows how to find memory */
+		log_msg(lg, "No ATAG_MEM in /proc/atags");
+		goto free;
+	}
+	if (atags->len > 5 && ATAG_CORE == atags->words[6]) {
+		/* Running kernel gave its own ATAG_CORE */
+		memmove(atags->words, atags->words + 5, (atags->len - 5) * 4);
+		atags->len -= 5;
+	}
+
+	if (initrd) {
+		initrd2[0] = iaddr;
+		initrd2[1] = ilen;
+		if (-1 == atags_add(atags, ATAG_INITRD2, initrd2, sizeof(initrd2)))
+			goto no_room;
+	}
+	if (cmdline && (-1 == atags_add(atags, ATAG_CMDLINE, cmdline,
+			strlen(cmdline) + 1))
+	) goto no_room;
+
+	atags->words[atags->len++] = 0;		/* ATAG_NONE */
+	atags->words[atags->len++] = ATAG_NONE;
+
+	seg[nseg].buf = atags->words;
+	seg[nseg].bufsz = atags->len * 4;
+	seg[nseg].mem = base + ARM_ATAGS_OFFSET;
+	seg[nseg].memsz = PAGE_ALIGN(seg[nseg].bufsz, ps);
+	++nseg;
+
+	seg[nseg].buf = kernel;
+	seg[nseg].bufsz = klen;
+	seg[nseg].mem = kaddr;
+	seg[nseg].memsz = PAGE_ALIGN(klen, ps);
+	++nseg;
+
+	if (initrd) {
+		seg[nseg].buf = initrd;
+		seg[nseg].bufsz = ilen;
+		seg[nseg].mem = iaddr;
+		seg[nseg].memsz = PAGE_ALIGN(ilen, ps);
+		++nseg;
+	}
+
+	rc = syscall(__NR_kexec_load, kaddr, (unsigned long)nseg, seg, flags);
+	if (-1 == rc) log_msg(lg, "kexec_load() failed: %s", ERRMSG);
+	rc = (0 == rc) ? 0 : -1;
+	goto free;
+
+no_room:
+	log_msg(lg, "Kernel command line is too long");
+
+free:
+	free(atags);
+	return rc;
+}
+
+
+static int load_segments(int kernel_fd, int initrd_fd, const char *cmdline)
+{
+	char *kbuf = NULL, *ibuf = NULL;
+	size_t klen, ilen = 0;
+	int rc = -1;
+
+	if (-1 == imgread_file(kernel_fd, "kernel", &kbuf, &klen)) return -1;
+
+	if ( (initrd_fd >= 0) && (-1 == imgread_file(initrd_fd, "initrd", &ibuf, &ilen)) )
+		goto free;
+
+	rc = load_buffers(kbuf, klen, ibuf, ilen, cmdline);
+
+free:
+	dispose(ibuf);
+	free(kbuf);
+	return rc;
+}
+#endif	/* USE_KEXEC_SEGMENTS */
+
+
+int kexecload_native(int kernel_fd, int initrd_fd, const char *cmdline)
+{
+#if defined(USE_KEXEC_FILE) || defined(USE_KEXEC_SEGMENTS)
+	unsigned long long start = msec_now();
+#endif
+
+#ifdef USE_KEXEC_FILE
+	if (0 == load_file(kernel_fd, initrd_fd, cmdline)) {
+		log_msg(lg, "Kernel is loaded by kexec_file_load() in %lu ms",
+				(unsigned long)(msec_now() - start));
+		return 0;
+	}
+#endif
+
+#ifdef USE_KEXEC_SEGMENTS
+	if (0 == load_segments(kernel_fd, initrd_fd, cmdline)) {
+		log_msg(lg, "Kernel is loaded by kexec_load() in %lu ms",
+				(unsigned long)(msec_now() - start));
+		return 0;
+	}
+#endif
+
+	return -1;
+}
+
+#else	/* USE_NATIVE_KEXEC */
+
+int kexecload_native(int kernel_fd, int initrd_fd, const char *cmdline)
+{
+	return -1;
+}
+
+#endif	/* USE_NATIVE_KEXEC */
+
+
+int kexecload_binary(const char *kexec_path, const char *kernel,
+		const char *initrd, const char *dtb, const char *cmdline)
+{
+	char *const envp[] = { NULL };
+	const char *argv[8];
+	char *cmdline_arg = NULL, *initrd_arg = NULL, *dtb_arg = NULL;
+	unsigned long long start = msec_now();
+	int n = 0, rc;
+#ifdef USE_HARDBOOT
+	char memmin_arg[32];
+#endif
+
+	argv[n++] = kexec_path;
+#ifdef USE_HARDBOOT
+	snprintf(memmin_arg, sizeof(memmin_arg), "--mem-min=0x%lx",
+			(unsigned long)USE_HARDBOOT);
+	argv[n++] = "--load-hardboot";
+	argv[n++] = memmin_arg;
+#else
+	argv[n++] = "-l";
+#endif
+
+	if (cmdline) {
+		cmdline_arg = malloc(sizeof("--command-line=") + strlen(cmdline));
+		if (NULL == cmdline_arg) return -1;
+		sprintf(cmdline_arg, "--command-line=%s", cmdline);
+		argv[n++] = cmdline_arg;
+	}
+
+	if (initrd) {
+		initrd_arg = malloc(sizeof("--initrd=") + strlen(initrd));
+		if (NULL == initrd_arg) {
+			dispose(cmdline_arg);
+			return -1;
+		}
+		sprintf(initrd_arg, "--initrd=%s", initrd);
+		argv[n++] = initrd_arg;
+	}
+
+	if (dtb) {
+		dtb_arg = malloc(sizeof("--dtb=") + strlen(dtb));
+		if (NULL == dtb_arg) {
+			dispose(cmdline_arg);
+			dispose(initrd_arg);
+			return -1;
+		}
+		sprintf(dtb_arg, "--dtb=%s", dtb);
+		argv[n++] = dtb_arg;
+	}
+
+	argv[n++] = kernel;
+	argv[n] = NULL;
+
+	rc = fexecw(kexec_path, (char *const *)argv, envp);
+
+	dispose(cmdline_arg);
+	dispose(initrd_arg);
+	dispose(dtb_arg);
+
+	if (0 != rc) {
+		log_msg(lg, "%s can't load kernel (status %d)", kexec_path, rc);
+		return -1;
+	}
+
+	log_msg(lg, "Kernel is loaded by %s in %lu ms", kexec_path,
+			(unsigned long)(msec_now() - start));
+	return 0;
+}
+
+
+/* Load kernel natively and by kexec binary when it fails */
+static int load_kernel(const char *kexec_path, int kernel_fd, int initrd_fd,
+		const char *kernel, const char *initrd, const char *cmdline)
+{
+	int rc;
+
+	imgread_prepare(kernel_fd);
+	imgread_prepare(initrd_fd);
+
+#ifndef USE_HOST_DEBUG
+	rc = kexecload_native(kernel_fd, initrd_fd, cmdline);
+	if ( (-1 == rc) && !imgread_interrupted() )
+#endif
+		rc = kexecload_binary(kexec_path, kernel, initrd, NULL, cmdline);
+
+	imgread_restore();
+	return rc;
+}
+
+
+/* Open kernel and initrd of item mounted at 'mountpoint' */
+static int open_item(struct boot_item_t *item, const char *mountpoint,
+		int *kfd, int *ifd)
+{
+	char *path;
+
+	path = mountpoint_path(mountpoint, item->kernelpath);
+	if (NULL == path) return -1;
+	*kfd = open(path, O_RDONLY);
+	if (*kfd < 0) {
+		log_msg(lg, "Can't open kernel %s: %s", path, ERRMSG);
+		free(path);
+		return -1;
+	}
+	DPRINTF("kernel: %s", path);
+	free(path);
+
+	if (NULL == item->initrd) return 0;
+
+	path = mountpoint_path(mountpoint, item->initrd);
+	if (NULL == path) return -1;
+	*ifd = open(path, O_RDONLY);
+	if (*ifd < 0) {
+		log_msg(lg, "Can't open initrd %s: %s", path, ERRMSG);
+		free(path);
+		return -1;
+	}
+	DPRINTF("initrd: %s", path);
+	free(path);
+
+	return 0;
+}
+
+
+#ifdef USE_INITRD_COMPOSE
+/* Build initrd of several parts. Return memfd or -1 when item has one
+ * part only or composing failed */
+static int compose_initrd(struct boot_item_t *item, const char *mountpoint,
+		int initrd_fd)
+{
+	unsigned int i, n = 0, parts;
+	char *path;
+	int *fds;
+	int mfd = -1;
+
+	if (!item->overlays && !item->bootdev) return -1;
+
+	parts = 1 + (item->overlays ? item->overlays->fill : 0);
+	fds = malloc(parts * sizeof(*fds));
+	if (NULL == fds) return -1;
+
+	if (initrd_fd >= 0) fds[n++] = initrd_fd;
+
+	for (i = 0; item->overlays && i < item->overlays->fill; i++) {
+		path = mountpoint_path(mountpoint, item->overlays->list[i]);
+		if (NULL == path) goto close;
+		fds[n] = open(path, O_RDONLY);
+		if (fds[n] < 0) {
+			log_msg(lg, "Can't open initrd %s: %s", path, ERRMSG);
+			free(path);
+			goto close;
+		}
+		imgread_prepare(fds[n]);
+		free(path);
+		++n;
+	}
+
+	mfd = initrdcat_compose(fds, n, item->bootdev, item->device);
+
+close:
+	for (i = (initrd_fd >= 0) ? 1 : 0; i < n; i++) close(fds[i]);
+	free(fds);
+
+	if (mfd < 0) log_msg(lg, "Booting with first initrd only");
+	return mfd;
+}
+#endif
+
+
+#ifdef USE_BOOTIMG
+/* Load kernel from boot image container opened as 'fd'.
+ * Return -2 when file is not a container */
+static int load_bootimg(const char *kexec_path, struct boot_item_t *item,
+		int fd)
+{
+	kx_bootimg *img;
+	char *cmdline = NULL;
+	char kpath[32], ipath[32], dpath[32];
+	int kfd = -1, ifd = -1, dfd = -1, rc = -1;
+	size_t len;
+
+	img = bootimg_open(fd);
+	if (NULL == img) return -2;
+
+	log_msg(lg, "Kernel is in %s container", img->type);
+	if (item->initrd) log_msg(lg, "Initrd %s is ignored", item->initrd);
+
+	/* Command line of item goes after embedded one */
+	if (img->cmdline && item->cmdline) {
+		len = strlen(img->cmdline);
+		cmdline = malloc(len + strlen(item->cmdline) + 2);
+		if (NULL == cmdline) goto close;
+		memcpy(cmdline, img->cmdline, len);
+		cmdline[len] = ' ';
+		strcpy(cmdline + len + 1, item->cmdline);
+	} else {
+		cmdline = strdup(img->cmdline ? img->cmdline :
+				(item->cmdline ? item->cmdline : ""));
+		if (NULL == cmdline) goto close;
+	}
+
+#if defined(USE_KEXEC_SEGMENTS) && !defined(USE_HOST_DEBUG)
+	/* Segments point into mapping, nothing is copied. Device tree needs
+	 * /chosen patched with cmdline and initrd, kexec binary does it */
+	if (NULL == img->dtb.data) {
+		rc = load_buffers(img->kernel.data, img->kernel.len,
+				img->ramdisk.data, img->ramdisk.len, cmdline);
+		if (0 == rc) {
+			log_msg(lg, "Kernel is loaded by kexec_load() from mapping");
+			goto close;
+		}
+	}
+#endif
+
+	/* Other loaders need files */
+	kfd = bootimg_part_fd(&img->kernel, "kernel");
+	if (kfd < 0) goto close;
+	if (img->ramdisk.data) {
+		ifd = bootimg_part_fd(&img->ramdisk, "initrd");
+		if (ifd < 0) goto close;
+	}
+
+	sprintf(kpath, "/proc/self/fd/%d", kfd);
+	sprintf(ipath, "/proc/self/fd/%d", ifd);
+
+	if (img->dtb.data) {
+		dfd = bootimg_part_fd(&img->dtb, "dtb");
+		if (dfd < 0) goto close;
+		sprintf(dpath, "/proc/self/fd/%d", dfd);
+		rc = kexecload_binary(kexec_path, kpath, (ifd >= 0) ? ipath : NULL,
+				dpath, cmdline);
+	} else {
+		rc = load_kernel(kexec_path, kfd, ifd, kpath,
+				(ifd >= 0) ? ipath : NULL, cmdline);
+	}
+
+close:
+	if (dfd >= 0) close(dfd);
+	if (ifd >= 0) close(ifd);
+	if (kfd >= 0) close(kfd);
+	dispose(cmdline);
+	bootimg_close(img);
+	return rc;
+}
+#endif
+
+
+int kexecload_item(const char *kexec_path, struct boot_item_t *item,
+		const char *mountpoint)
+{
+	char kpath[32], ipath[32];
+	int kfd = -1, ifd = -1, rc = -1;
+	int mounted = 0;
+#ifdef USE_INITRD_COMPOSE
+	int mfd;
+#endif
+
+#ifdef USE_BOOT_HANDLES
+	/* Filesystem is kept attached by handles taken during scan */
+	if ( (item->kernel_fd >= 0) && (!item->initrd || item->initrd_fd >= 0) ) {
+		kfd = dup(item->kernel_fd);
+		if (item->initrd_fd >= 0) ifd = dup(item->initrd_fd);
+		if (kfd < 0 || (item->initrd_fd >= 0 && ifd < 0)) goto close;
+	} else
+#endif
+#ifdef USE_BOOTIMG
+	if (bootimg_fstype(item->fstype)) {
+		/* Raw partition is boot image itself */
+		kfd = open(item->device, O_RDONLY);
+		if (kfd < 0) {
+			log_msg(lg, "Can't open boot device %s: %s", item->device, ERRMSG);
+			return -1;
+		}
+	} else
+#endif
+	{
+		if ( -1 == mntprofile_mount(item->device, mountpoint, item->fstype,
+				MNT_BOOT) ) {
+			log_msg(lg, "Can't mount boot device %s", item->device);
+			return -1;
+		}
+		mounted = 1;
+
+		if (-1 == open_item(item, mountpoint, &kfd, &ifd)) goto close;
+	}
+
+#ifdef USE_BOOTIMG
+	rc = load_bootimg(kexec_path, item, kfd);
+	if (-2 != rc) goto close;
+	rc = -1;
+#endif
+
+#ifdef USE_INITRD_COMPOSE
+	mfd = compose_initrd(item, mountpoint, ifd);
+	if (mfd >= 0) {
+		if (ifd >= 0) close(ifd);
+		ifd = mfd;
+	}
+#endif
+
+	/* kexec binary will find files in /proc/self/fd too */
+	sprintf(kpath, "/proc/self/fd/%d", kfd);
+	sprintf(ipath, "/proc/self/fd/%d", ifd);
+	rc = load_kernel(kexec_path, kfd, ifd, kpath, (ifd >= 0) ? ipath : NULL,
+			item->cmdline);
+
+close:
+	if (ifd >= 0) close(ifd);
+	if (kfd >= 0) close(kfd);
+	if (mounted) umount(mountpoint);
+	return rc;
+}
+
+
+#ifdef USE_FAST_REBOOT
+int kexecload_self(const char *kexec_path, const char *kernel)
+{
+	char cmdline[COMMAND_LINE_SIZE];
+	char kpath[32];
+	ssize_t len;
+	int fd, rc;
+
+	/* Same parameters give the same kexecboot */
+	fd = open("/proc/cmdline", O_RDONLY);
+	if (fd < 0) {
+		log_msg(lg, "Can't open /proc/cmdline: %s", ERRMSG);
+		return -1;
+	}
+	len = read(fd, cmdline, sizeof(cmdline) - 1);
+	close(fd);
+	if (len < 0) {
+		log_msg(lg, "Can't read /proc/cmdline: %s", ERRMSG);
+		return -1;
+	}
+	while (len > 0 && '\n' == cmdline[len - 1]) --len;
+	cmdline[len] = '\0';
+
+	fd = open(kernel, O_RDONLY);
+	if (fd < 0) {
+		log_msg(lg, "Can't open kernel %s: %s", kernel, ERRMSG);
+		return -1;
+	}
+
+	sprintf(kpath, "/proc/self/fd/%d", fd);
+	rc = load_kernel(kexec_path, fd, -1, kpath, NULL, cmdline);
+	close(fd);
+	return rc;
+}
+#endif
+
+
+int kexecload_boot(const char *kexec_path)
+{
+	char *const envp[] = { NULL };
+	const char *argv[] = { kexec_path, "-e", NULL };
+
+	sync();
+
+#ifdef USE_NATIVE_KEXEC
+	syscall(__NR_reboot, LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2,
+			LINUX_REBOOT_CMD_KEXEC, NULL);
+	log_msg(lg, "Can't reboot to loaded kernel: %s", ERRMSG);
+#endif
+
+	/* kexec binary knows better what to do */
+	fexecw(kexec_path, (char *const *)argv, envp);
+	return -1;
+}
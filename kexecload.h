@@ -0,0 +1,55 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_KEXECLOAD_H_
+#define _HAVE_KEXECLOAD_H_
+
+#include "config.h"
+#include "devicescan.h"
+
+/*
+ * Kernel loading and booting without shell and kexec binary.
+ * kexec_file_load() is tried first, kexec_load() with segments built
+ * here is used when kernel can't load file itself.
+ * 'initrd' and 'cmdline' may be NULL.
+ */
+
+/* Load kernel from opened files by syscalls ('initrd_fd' may be -1).
+ * Return 0 on success or -1 */
+int kexecload_native(int kernel_fd, int initrd_fd, const char *cmdline);
+
+/* Load kernel by kexec binary at 'kexec_path' with device tree 'dtb'
+ * (may be NULL). Return 0 on success or -1 */
+int kexecload_binary(const char *kexec_path, const char *kernel,
+		const char *initrd, const char *dtb, const char *cmdline);
+
+/* Mount item's device at 'mountpoint' (unless item has handles), load
+ * its kernel natively or by kexec binary and unmount.
+ * Return 0 on success or -1 */
+int kexecload_item(const char *kexec_path, struct boot_item_t *item,
+		const char *mountpoint);
+
+#ifdef USE_FAST_REBOOT
+/* Load 'kernel' (own kernel of kexecboot with built-in initramfs) with
+ * cmdline of running kernel. Return 0 on success or -1 */
+int kexecload_self(const char *kexec_path, const char *kernel);
+#endif
+
+/* Sync disks and boot loaded kernel. Return -1 on error only */
+int kexecload_boot(const char *kexec_path);
+
+#endif /* _HAVE_KEXECLOAD_H_ */
@@ -109,14 +109,17 @@ kx_menu_level *menu_level_create(kx_menu *menu, kx_menu_dim size,
 }
 
 
-/* Add menu item to menu level */
-kx_menu_item *menu_item_add(kx_menu_level *level, kx_menu_id id,
-		char *label, char *description, kx_menu_level *submenu)
+/* Insert menu item into menu level at position 'no' */
+kx_menu_item *menu_item_insert(kx_menu_level *level, kx_menu_dim no,
+		kx_menu_id id, char *label, char *description,
+		kx_menu_level *submenu)
 {
 	kx_menu_item *item;
+	kx_menu_dim i;
 
 	if (!level) return NULL;
-	
+	if (no > level->count) no = level->count;
+
 	/* Resize list when needed before adding item */
 	if (level->count >= level->size) {
 		kx_menu_item **new_list;
@@ -143,13 +146,20 @@ kx_menu_item *menu_item_add(kx_menu_level *level, kx_menu_id id,
 	item->description = ( description ? strdup(description) : NULL );
 	item->id = id;
 	item->submenu = submenu;
+	item->data = NULL;
 
-	level->list[level->count] = item;
+	/* Shift items down to make room */
+	for (i = level->count; i > no; i--)
+		level->list[i] = level->list[i - 1];
+	level->list[no] = item;
+
+	/* Keep current item selected */
+	if (level->current && level->current_no >= no) ++level->current_no;
 
 	/* If there is no current item yet then make this item current */
 	if (!level->current) {
 		level->current = item;
-		level->current_no = level->count;
+		level->current_no = no;
 	}
 
 	++level->count;
@@ -158,6 +168,48 @@ kx_menu_item *menu_item_add(kx_menu_level *level, kx_menu_id id,
 }
 
 
+/* Remove no'th item from menu level.
+ * Neighbour item is selected when current item is removed */
+int menu_item_remove(kx_menu_level *level, kx_menu_dim no)
+{
+	kx_menu_item *item;
+	kx_menu_dim i;
+
+	if (!level || no >= level->count) return -1;
+
+	item = level->list[no];
+	for (i = no; i + 1 < level->count; i++)
+		level->list[i] = level->list[i + 1];
+	--level->count;
+
+	if (level->current_no > no) {
+		--level->current_no;
+	} else if (level->current == item) {
+		if (level->current_no >= level->count && level->count > 0)
+			level->current_no = level->count - 1;
+		level->current = (level->count > 0) ?
+				level->list[level->current_no] : NULL;
+	}
+
+	dispose(item->label);
+	dispose(item->description);
+	free(item);
+
+	return 0;
+}
+
+
+/* Add menu item to menu level */
+kx_menu_item *menu_item_add(kx_menu_level *level, kx_menu_id id,
+		char *label, char *description, kx_menu_level *submenu)
+{
+	if (!level) return NULL;
+
+	return menu_item_insert(level, level->count, id, label,
+			description, submenu);
+}
+
+
 void menu_destroy(kx_menu *menu, int destroy_data)
 {
 	int i,j;
@@ -251,6 +303,23 @@ kx_menu_dim menu_item_select_by_no(kx_menu *menu, int no)
 }
 
 
+/* Select item with specified id in menu level */
+int menu_item_select_by_id(kx_menu_level *level, kx_menu_id id)
+{
+	kx_menu_dim i;
+
+	for (i = 0; i < level->count; i++) {
+		if (level->list[i] && level->list[i]->id == id) {
+			level->current_no = i;
+			level->current = level->list[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
 inline void menu_item_set_data(kx_menu_item *item, void *data)
 {
 	item->data = data;
@@ -74,6 +74,18 @@ kx_menu_level *menu_level_create(kx_menu *menu, kx_menu_dim size,
 kx_menu_item *menu_item_add(kx_menu_level *level, kx_menu_id id,
 		char *label, char *description, kx_menu_level *submenu);
 
+/* Insert menu item into menu level at position 'no'.
+ * Current item of level stays selected */
+kx_menu_item *menu_item_insert(kx_menu_level *level, kx_menu_dim no,
+		kx_menu_id id, char *label, char *description,
+		kx_menu_level *submenu);
+
+/* Remove no'th item from menu level */
+int menu_item_remove(kx_menu_level *level, kx_menu_dim no);
+
+/* Select item with specified id in menu level */
+int menu_item_select_by_id(kx_menu_level *level, kx_menu_id id);
+
 void menu_item_set_data(kx_menu_item *item, void *data);
 
 void menu_destroy(kx_menu *menu, int destroy_data);
@@ -0,0 +1,109 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/mount.h>
+
+#include "config.h"
+#include "util.h"
+#include "mntprofile.h"
+
+#ifndef MS_SILENT
+#define MS_SILENT	32768
+#endif
+
+/* Flags of every mount. Nothing is written or executed there */
+#define MNT_BASE_FLAGS	(MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOATIME | MS_NODIRATIME)
+
+struct mnt_profile {
+	const char *fstype;
+	unsigned long probe_flags;
+	const char *probe_data;
+	unsigned long boot_flags;
+	const char *boot_data;
+};
+
+/*
+ * Probe options don't replay journals: stale config is better than
+ * waiting for recovery of every device. Boot mount replays them to read
+ * kernel which could be written just before reboot.
+ */
+static const struct mnt_profile profiles[] = {
+	{ "ext3",	MS_SILENT | MS_NOEXEC, "noload",	0, NULL },
+	{ "ext4",	MS_SILENT | MS_NOEXEC, "noload",	0, NULL },
+	{ "ext4dev",	MS_SILENT | MS_NOEXEC, "noload",	0, NULL },
+	{ "xfs",	MS_SILENT | MS_NOEXEC, "norecovery",	0, NULL },
+	{ "nilfs2",	MS_SILENT | MS_NOEXEC, "norecovery",	0, NULL },
+	{ "btrfs",	MS_SILENT | MS_NOEXEC, "nologreplay",	0, NULL },
+	{ NULL,		MS_SILENT | MS_NOEXEC, NULL,		0, NULL }	/* default */
+};
+
+
+static const struct mnt_profile *find_profile(const char *fstype)
+{
+	const struct mnt_profile *p;
+
+	for (p = profiles; p->fstype; p++) {
+		if (fstype && !strcmp(p->fstype, fstype)) break;
+	}
+
+	return p;
+}
+
+
+int mntprofile_mount(const char *device, const char *mountpoint,
+		const char *fstype, enum mnt_purpose purpose)
+{
+	const struct mnt_profile *p;
+	unsigned long flags;
+	unsigned long long start;
+	const char *data;
+	int rc;
+
+	p = find_profile(fstype);
+	if (MNT_PROBE == purpose) {
+		flags = MNT_BASE_FLAGS | p->probe_flags;
+		data = p->probe_data;
+	} else {
+		flags = MNT_BASE_FLAGS | p->boot_flags;
+		data = p->boot_data;
+	}
+
+	start = msec_now();
+	rc = mount(device, mountpoint, fstype, flags, data);
+
+	/* Older kernels don't know some options. Try without them */
+	if (-1 == rc && EINVAL == errno && data) {
+		log_msg(lg, "+ %s doesn't accept '%s', mounting without it",
+				fstype, data);
+		data = NULL;
+		rc = mount(device, mountpoint, fstype, flags, data);
+	}
+
+	if (-1 == rc) return -1;
+
+	log_msg(lg, "+ %s mounted as %s (%s) in %lu ms", device, fstype,
+			data ? data : "defaults", (unsigned long)(msec_now() - start));
+	return 0;
+}
+
+
+int mntprofile_bootable(const char *fstype)
+{
+	return (NULL == find_profile(fstype)->probe_data);
+}
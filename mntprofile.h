@@ -0,0 +1,45 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_MNTPROFILE_H_
+#define _HAVE_MNTPROFILE_H_
+
+#include "config.h"
+
+/*
+ * Mount options by filesystem type.
+ * Probe mount is used to peek at config files only so it skips
+ * journal replay and recovery where filesystem allows it.
+ * Boot mount is used to read kernel and initrd.
+ */
+
+enum mnt_purpose {
+	MNT_PROBE,
+	MNT_BOOT
+};
+
+/* Mount 'device' of 'fstype' read-only with options of profile.
+ * Options which are unknown to kernel are dropped.
+ * Return 0 on success or -1 with errno set */
+int mntprofile_mount(const char *device, const char *mountpoint,
+		const char *fstype, enum mnt_purpose purpose);
+
+/* Return 1 when probe mount of 'fstype' sees the same data as boot mount
+ * (no journal replay is skipped) so files opened there may be booted */
+int mntprofile_bootable(const char *fstype);
+
+#endif /* _HAVE_MNTPROFILE_H_ */
@@ -0,0 +1,280 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+#ifdef USE_PRELOAD
+#include "util.h"
+#include "kexecload.h"
+#include "imgread.h"
+#include "preload.h"
+
+/* Private mountpoint of loader thread */
+#define PRELOAD_MOUNTPOINT	MOUNTPOINT "/.preload"
+
+#ifdef USE_HOST_DEBUG
+#define PRELOAD_KEXEC_PATH	"/bin/echo"
+#else
+#define PRELOAD_KEXEC_PATH	KEXEC_PATH
+#endif
+
+static pthread_mutex_t preload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t preload_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t preload_thread;
+static int preload_state;		/* 0 - not started, 1 - running, 2 - stopping */
+
+static struct boot_item_t *wanted;	/* Item to load next */
+static struct boot_item_t *loading;	/* Item being loaded */
+static struct boot_item_t *staged;	/* Item loaded into kernel */
+static struct boot_item_t *failed;	/* Item which can't be loaded */
+
+
+static void preload_item_free(struct boot_item_t *item)
+{
+	if (NULL == item) return;
+	dispose(item->device);
+	dispose((char *)item->fstype);
+	dispose(item->kernelpath);
+	dispose(item->initrd);
+	dispose(item->cmdline);
+#ifdef USE_INITRD_COMPOSE
+	if (item->overlays) free_charlist(item->overlays);
+	dispose(item->bootdev);
+#endif
+#ifdef USE_BOOT_HANDLES
+	close_boothandles(item);
+#endif
+	free(item);
+}
+
+
+/* Copy fields needed to load item */
+static struct boot_item_t *preload_item_copy(struct boot_item_t *item)
+{
+	struct boot_item_t *p;
+#ifdef USE_INITRD_COMPOSE
+	unsigned int i;
+#endif
+
+	p = calloc(1, sizeof(*p));
+	if (NULL == p) return NULL;
+
+#ifdef USE_BOOT_HANDLES
+	/* Own handles. Original ones may be closed by rescan */
+	p->kernel_fd = (item->kernel_fd >= 0) ? dup(item->kernel_fd) : -1;
+	p->initrd_fd = (item->initrd_fd >= 0) ? dup(item->initrd_fd) : -1;
+#endif
+
+	p->device = strdup(item->device);
+	p->fstype = strdup(item->fstype);
+	p->kernelpath = strdup(item->kernelpath);
+	if (item->initrd) p->initrd = strdup(item->initrd);
+	if (item->cmdline) p->cmdline = strdup(item->cmdline);
+#ifdef USE_INITRD_COMPOSE
+	if (item->overlays) {
+		p->overlays = create_charlist(item->overlays->fill + 1);
+		for (i = 0; i < item->overlays->fill; i++)
+			addto_charlist(p->overlays, item->overlays->list[i]);
+	}
+	if (item->bootdev) p->bootdev = strdup(item->bootdev);
+#endif
+
+	if (!p->device || !p->fstype || !p->kernelpath
+			|| (item->initrd && !p->initrd)
+			|| (item->cmdline && !p->cmdline)
+	) {
+		preload_item_free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+
+static int streq(const char *a, const char *b)
+{
+	if (NULL == a || NULL == b) return (a == b);
+	return (0 == strcmp(a, b));
+}
+
+
+/* Check that 'p' will load same kernel as 'item' */
+static int preload_item_same(struct boot_item_t *p, struct boot_item_t *item)
+{
+#ifdef USE_INITRD_COMPOSE
+	unsigned int i;
+#endif
+
+	if (NULL == p || NULL == item) return 0;
+
+#ifdef USE_INITRD_COMPOSE
+	if (!streq(p->bootdev, item->bootdev)) return 0;
+	if (p->overlays || item->overlays) {
+		if (!p->overlays || !item->overlays
+				|| p->overlays->fill != item->overlays->fill)
+			return 0;
+		for (i = 0; i < p->overlays->fill; i++)
+			if (!streq(p->overlays->list[i], item->overlays->list[i]))
+				return 0;
+	}
+#endif
+
+	return streq(p->device, item->device)
+			&& streq(p->kernelpath, item->kernelpath)
+			&& streq(p->initrd, item->initrd)
+			&& streq(p->cmdline, item->cmdline);
+}
+
+
+static void *preload_worker(void *arg)
+{
+	unsigned long long start;
+	int rc;
+
+	pthread_mutex_lock(&preload_lock);
+	for (;;) {
+		while (NULL == wanted && 1 == preload_state)
+			pthread_cond_wait(&preload_cond, &preload_lock);
+		if (1 != preload_state) break;
+
+		loading = wanted;
+		wanted = NULL;
+		/* Staged kernel is replaced (or lost) by new load */
+		preload_item_free(staged);
+		staged = NULL;
+		/* Chosen item may be other one. Let preload_finish() stop us */
+		imgread_interruptible(1);
+		pthread_mutex_unlock(&preload_lock);
+
+		start = msec_now();
+		rc = kexecload_item(PRELOAD_KEXEC_PATH, loading, PRELOAD_MOUNTPOINT);
+		log_msg(lg, "Preloading of %s from %s %s in %lu ms",
+				loading->kernelpath, loading->device,
+				(0 == rc) ? "is done" : "failed",
+				(unsigned long)(msec_now() - start));
+
+		pthread_mutex_lock(&preload_lock);
+		imgread_interruptible(0);
+		if (0 == rc) {
+			staged = loading;
+		} else {
+			/* Don't retry until selection is changed */
+			preload_item_free(failed);
+			failed = loading;
+		}
+		loading = NULL;
+		pthread_cond_broadcast(&preload_cond);
+	}
+	pthread_mutex_unlock(&preload_lock);
+
+	return NULL;
+}
+
+
+void preload_request(struct boot_item_t *item)
+{
+	struct boot_item_t *p;
+
+	if (NULL == item || NULL == item->device || NULL == item->kernelpath)
+		return;
+
+	pthread_mutex_lock(&preload_lock);
+
+	if (2 == preload_state || preload_item_same(wanted, item)
+			|| preload_item_same(loading, item)
+			|| preload_item_same(staged, item)
+			|| preload_item_same(failed, item)
+	) goto unlock;
+
+	/* Selection is changed, failed item may be tried again later */
+	preload_item_free(failed);
+	failed = NULL;
+
+	p = preload_item_copy(item);
+	if (NULL == p) goto unlock;
+
+	if (0 == preload_state) {
+		/* We don't care about result */
+		mkdir(PRELOAD_MOUNTPOINT, 0755);
+
+		if (0 != pthread_create(&preload_thread, NULL, preload_worker, NULL)) {
+			log_msg(lg, "Can't create preload thread: %s", ERRMSG);
+			failed = p;
+			goto unlock;
+		}
+		preload_state = 1;
+	}
+
+	/* Older request is not needed anymore */
+	preload_item_free(wanted);
+	wanted = p;
+	pthread_cond_signal(&preload_cond);
+
+unlock:
+	pthread_mutex_unlock(&preload_lock);
+}
+
+
+int preload_finish(struct boot_item_t *item)
+{
+	int rc, running;
+
+	pthread_mutex_lock(&preload_lock);
+
+	running = (1 == preload_state);
+	preload_state = 2;
+	preload_item_free(wanted);
+	wanted = NULL;
+	pthread_cond_signal(&preload_cond);
+
+	/* Kernel can't be loaded while other one is loading. Load of item
+	 * which is not needed is interrupted between read chunks */
+	if (loading && !preload_item_same(loading, item)) imgread_interrupt();
+	while (loading)
+		pthread_cond_wait(&preload_cond, &preload_lock);
+
+	preload_item_free(failed);
+	failed = NULL;
+
+	rc = preload_item_same(staged, item) ? 0 : -1;
+	if (-1 == rc) {
+		/* Caller loads kernel itself and replaces staged one */
+		preload_item_free(staged);
+		staged = NULL;
+	}
+	pthread_mutex_unlock(&preload_lock);
+
+	if (running) pthread_join(preload_thread, NULL);
+
+	/* Loader is started again by next request if boot fails */
+	pthread_mutex_lock(&preload_lock);
+	preload_state = 0;
+	pthread_mutex_unlock(&preload_lock);
+
+	return rc;
+}
+
+#endif	/* USE_PRELOAD */
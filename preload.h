@@ -0,0 +1,37 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_PRELOAD_H_
+#define _HAVE_PRELOAD_H_
+
+#include "config.h"
+#include "devicescan.h"
+
+/*
+ * Background loading of highlighted boot item while menu is idle.
+ * Only one kernel may be loaded by kexec so every new request replaces
+ * staged one. Items are copied, caller may free them at any time.
+ */
+
+/* Load item's kernel in background unless it is loaded already */
+void preload_request(struct boot_item_t *item);
+
+/* Stop loader. Return 0 when 'item' (may be NULL) is staged or -1.
+ * Next request starts loader again */
+int preload_finish(struct boot_item_t *item);
+
+#endif /* _HAVE_PRELOAD_H_ */
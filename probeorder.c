@@ -0,0 +1,308 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
+
+#ifdef USE_PROBE_ORDER
+#include "util.h"
+#include "probeorder.h"
+
+#ifdef USE_SCAN_THREADS
+#include <pthread.h>
+
+/* Hints are updated by device probing threads */
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+#define ORDER_LOCK()	pthread_mutex_lock(&order_lock)
+#define ORDER_UNLOCK()	pthread_mutex_unlock(&order_lock)
+#else
+#define ORDER_LOCK()	do { } while (0)
+#define ORDER_UNLOCK()	do { } while (0)
+#endif
+
+/* Probe time of device which was never probed */
+#define PROBE_MS_UNKNOWN	((unsigned int)-1)
+
+/* Device hints */
+struct probeorder_entry_t {
+	char *device;				/* Device path */
+	unsigned long long blocks;	/* Device size */
+	unsigned int ms;			/* Last probe time */
+	int booted;					/* Device gave booted item last time */
+};
+
+static struct probeorder_entry_t *entries = NULL;
+static unsigned int size = 0;		/* Allocated entries count */
+static unsigned int fill = 0;		/* Used entries count */
+static int loaded = 0;				/* File is loaded already */
+static int dirty = 0;				/* Hints should be saved */
+
+
+static struct probeorder_entry_t *find_entry(const char *device,
+		unsigned long long blocks)
+{
+	unsigned int i;
+
+	for (i = 0; i < fill; i++) {
+		if (entries[i].blocks == blocks && !strcmp(entries[i].device, device))
+			return &entries[i];
+	}
+
+	return NULL;
+}
+
+
+/* Find entry of device or add new one */
+static struct probeorder_entry_t *get_entry(const char *device,
+		unsigned long long blocks)
+{
+	struct probeorder_entry_t *e;
+
+	e = find_entry(device, blocks);
+	if (e) return e;
+
+	/* Resize list when needed before adding item */
+	if (fill >= size) {
+		struct probeorder_entry_t *new_entries;
+		unsigned int new_size;
+
+		new_size = size ? size * 2 : 8;
+		new_entries = realloc(entries, new_size * sizeof(*entries));
+		if (NULL == new_entries) {
+			DPRINTF("Can't resize probe order list");
+			return NULL;
+		}
+		size = new_size;
+		entries = new_entries;
+	}
+
+	e = &entries[fill];
+	e->device = strdup(device);
+	if (NULL == e->device) return NULL;
+
+	e->blocks = blocks;
+	e->ms = PROBE_MS_UNKNOWN;
+	e->booted = 0;
+	++fill;
+
+	return e;
+}
+
+
+int probeorder_load(const char *path)
+{
+	struct probeorder_entry_t *e;
+	char line[160], device[128];
+	unsigned long long blocks;
+	unsigned int ms;
+	int booted;
+	FILE *f;
+
+	if (loaded) return 0;
+	loaded = 1;
+
+	f = fopen(path, "r");
+	if (NULL == f) {
+		if (ENOENT != errno)
+			log_msg(lg, "Can't open probe order %s: %s", path, ERRMSG);
+		return -1;
+	}
+
+	/* Line format: device blocks probe_ms booted */
+	while (fgets(line, sizeof(line), f)) {
+		if (4 != sscanf(line, "%127s %llu %u %d", device, &blocks, &ms, &booted))
+			continue;
+
+		e = get_entry(device, blocks);
+		if (NULL == e) break;
+
+		e->ms = ms;
+		e->booted = booted;
+	}
+	fclose(f);
+
+	log_msg(lg, "Probe order: %u device(s) loaded from %s", fill, path);
+	return 0;
+}
+
+
+int probeorder_save(const char *path)
+{
+	char *tmppath;
+	unsigned int i;
+	int rc = 0;
+	FILE *f;
+
+	if (!dirty) return 0;
+
+	tmppath = malloc(strlen(path) + sizeof(".new"));
+	if (NULL == tmppath) {
+		DPRINTF("Can't allocate memory for probe order file name");
+		return -1;
+	}
+	strcpy(tmppath, path);
+	strcat(tmppath, ".new");
+
+	f = fopen(tmppath, "w");
+	if (NULL == f) {
+		log_msg(lg, "Can't create probe order %s: %s", tmppath, ERRMSG);
+		free(tmppath);
+		return -1;
+	}
+
+	ORDER_LOCK();
+	for (i = 0; i < fill; i++) {
+		if (fprintf(f, "%s %llu %u %d\n", entries[i].device,
+				entries[i].blocks, entries[i].ms, entries[i].booted) < 0
+		) {
+			rc = -1;
+			break;
+		}
+	}
+	ORDER_UNLOCK();
+
+	if (0 != fclose(f)) rc = -1;
+
+	if (0 == rc && -1 == rename(tmppath, path)) rc = -1;
+
+	if (0 == rc) {
+		dirty = 0;
+	} else {
+		log_msg(lg, "Can't save probe order %s: %s", path, ERRMSG);
+		unlink(tmppath);
+	}
+
+	free(tmppath);
+	return rc;
+}
+
+
+/* Return sort key of device. Less is probed earlier */
+static unsigned int probe_rank(struct device_t *dev)
+{
+	struct probeorder_entry_t *e;
+
+	e = find_entry(dev->device, dev->blocks);
+	if (NULL == e) return PROBE_MS_UNKNOWN;
+	if (e->booted) return 0;
+
+	/* Never zero so booted device is always first */
+	return (e->ms < PROBE_MS_UNKNOWN - 1) ? e->ms + 1 : PROBE_MS_UNKNOWN - 1;
+}
+
+
+void probeorder_sort(struct device_t *devs, unsigned int count,
+		unsigned int *order)
+{
+	unsigned int i, j, n, *rank;
+
+	for (i = 0; i < count; i++) order[i] = i;
+
+	rank = malloc(count * sizeof(*rank));
+	if (NULL == rank) {
+		DPRINTF("Can't allocate probe ranks");
+		return;		/* Keep devices order */
+	}
+
+	ORDER_LOCK();
+	for (i = 0; i < count; i++) rank[i] = probe_rank(&devs[i]);
+	ORDER_UNLOCK();
+
+	/* Insertion sort. Devices of same rank are kept in their order */
+	for (i = 0; i < count; i++) {
+		n = i;
+		for (j = i; j > 0 && rank[order[j - 1]] > rank[n]; j--)
+			order[j] = order[j - 1];
+		order[j] = n;
+	}
+
+	free(rank);
+}
+
+
+int probeorder_is_last(struct device_t *dev)
+{
+	struct probeorder_entry_t *e;
+	int rc;
+
+	ORDER_LOCK();
+	e = find_entry(dev->device, dev->blocks);
+	rc = (e && e->booted);
+	ORDER_UNLOCK();
+
+	return rc;
+}
+
+
+/* Return whether probe time of 'e' changed from 'old' to 'ms' moves it
+ * relative to other device. Times change every boot, order rarely does */
+static int order_changed(struct probeorder_entry_t *e, unsigned int old,
+		unsigned int ms)
+{
+	unsigned int i, other;
+
+	if (PROBE_MS_UNKNOWN == old) return 1;
+
+	for (i = 0; i < fill; i++) {
+		if (&entries[i] == e || entries[i].booted) continue;
+
+		other = entries[i].ms;
+		if ( ((old < other) != (ms < other)) || ((old > other) != (ms > other)) )
+			return 1;
+	}
+
+	return 0;
+}
+
+
+void probeorder_probed(struct device_t *dev, unsigned int ms)
+{
+	struct probeorder_entry_t *e;
+	unsigned int old;
+
+	ORDER_LOCK();
+	e = get_entry(dev->device, dev->blocks);
+	if (e) {
+		old = e->ms;
+		e->ms = ms;
+		if (!e->booted && order_changed(e, old, ms)) dirty = 1;
+	}
+	ORDER_UNLOCK();
+}
+
+
+void probeorder_booted(const char *device)
+{
+	unsigned int i;
+	int booted;
+
+	/* Size of boot item may be fixed by machine code. Take name only */
+	ORDER_LOCK();
+	for (i = 0; i < fill; i++) {
+		booted = !strcmp(entries[i].device, device);
+		if (entries[i].booted != booted) dirty = 1;
+		entries[i].booted = booted;
+	}
+	ORDER_UNLOCK();
+}
+
+#endif	/* USE_PROBE_ORDER */
@@ -0,0 +1,50 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_PROBEORDER_H_
+#define _HAVE_PROBEORDER_H_
+
+#include "config.h"
+#include "devicescan.h"
+
+/*
+ * Hints of devices probing order.
+ * Device which gave booted item last time is probed first and
+ * others are probed in order of their last probe time.
+ * Devices are identified by path and size.
+ */
+
+/* Load hints file once. Missing or broken file means no hints */
+int probeorder_load(const char *path);
+
+/* Save hints file when something was changed */
+int probeorder_save(const char *path);
+
+/* Fill 'order' with indexes of 'count' devices in probing order */
+void probeorder_sort(struct device_t *devs, unsigned int count,
+		unsigned int *order);
+
+/* Return 1 when device gave booted item last time or 0 otherwise */
+int probeorder_is_last(struct device_t *dev);
+
+/* Remember probe time of device */
+void probeorder_probed(struct device_t *dev, unsigned int ms);
+
+/* Remember device which gave booted item */
+void probeorder_booted(const char *device);
+
+#endif /* _HAVE_PROBEORDER_H_ */
@@ -0,0 +1,281 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "config.h"
+
+#ifdef USE_RESUME
+#include "util.h"
+#include "cfgparser.h"
+#include "resume.h"
+
+#ifdef USE_SCAN_THREADS
+#include <pthread.h>
+static pthread_mutex_t resume_lock = PTHREAD_MUTEX_INITIALIZER;
+#define RESUME_LOCK()	pthread_mutex_lock(&resume_lock)
+#define RESUME_UNLOCK()	pthread_mutex_unlock(&resume_lock)
+#else
+#define RESUME_LOCK()	do { } while (0)
+#define RESUME_UNLOCK()	do { } while (0)
+#endif
+
+/* Signature of kernel hibernation image at end of first page
+ * (kernel/power/swap.c) */
+#define HIBERNATE_SIG		"S1SUSPEND"
+#define HIBERNATE_SIG_LEN	9
+
+/* Tail of swsusp_header: crc32, image, flags, orig_sig[10], sig[10].
+ * 'image' is 64-bit sector_t or 32-bit one on old 32-bit kernels */
+#define HDR_SIG_OFF(ps)		((ps) - 10)
+#define HDR_IMAGE64_OFF(ps)	((ps) - 32)
+#define HDR_IMAGE32_OFF(ps)	((ps) - 28)
+
+/* Size of release field of new_utsname which starts swsusp_info */
+#define UTS_LEN			65
+#define UTS_RELEASE_OFF	(2 * UTS_LEN)
+
+/* Found image */
+static char *image_device = NULL;
+static char image_release[UTS_LEN];
+
+
+/* Read page 'no' of device. Return 0 or -1 */
+static int read_page(int fd, unsigned long long no, char *buf, size_t ps)
+{
+	return ((ssize_t)ps == pread(fd, buf, ps, no * ps)) ? 0 : -1;
+}
+
+
+/* Find kernel release of image starting at swap page 'map'.
+ * First entry of first swap map page points to swsusp_info page */
+static int read_release(int fd, unsigned long long map, unsigned long long pages,
+		char *buf, size_t ps, char *release)
+{
+	uint64_t info64;
+	uint32_t info32;
+	unsigned long long info;
+
+	if (0 == map || map >= pages || -1 == read_page(fd, map, buf, ps))
+		return -1;
+
+	/* Entries are sector_t too */
+	memcpy(&info64, buf, sizeof(info64));
+	memcpy(&info32, buf, sizeof(info32));
+	info = (info64 > 0 && info64 < pages) ? info64 : info32;
+
+	if (0 == info || info >= pages || -1 == read_page(fd, info, buf, ps))
+		return -1;
+
+	if (strncmp(buf, "Linux", UTS_LEN)) return -1;
+
+	memcpy(release, buf + UTS_RELEASE_OFF, UTS_LEN);
+	release[UTS_LEN - 1] = '\0';
+	return 0;
+}
+
+
+int resume_check(const char *device)
+{
+	char release[UTS_LEN] = "";
+	size_t ps = getpagesize();
+	unsigned long long size = 0, pages;
+	uint64_t image64;
+	uint32_t image32;
+	struct stat st;
+	char *buf;
+	int fd, rc = -1;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		log_msg(lg, "+ can't open device %s: %s", device, ERRMSG);
+		return -1;
+	}
+
+	buf = malloc(ps);
+	if (NULL == buf) goto close;
+
+	if (-1 == read_page(fd, 0, buf, ps)) goto free;
+	if (memcmp(buf + HDR_SIG_OFF(ps), HIBERNATE_SIG, HIBERNATE_SIG_LEN)) {
+		log_msg(lg, "+ hibernation image of unknown format");
+		goto free;
+	}
+
+	if (0 == fstat(fd, &st)) size = st.st_size;
+	if (S_ISBLK(st.st_mode)) ioctl(fd, BLKGETSIZE64, &size);
+	pages = size / ps;
+
+	memcpy(&image64, buf + HDR_IMAGE64_OFF(ps), sizeof(image64));
+	memcpy(&image32, buf + HDR_IMAGE32_OFF(ps), sizeof(image32));
+
+	if ( -1 == read_release(fd, image64, pages, buf, ps, release)
+			&& -1 == read_release(fd, image32, pages, buf, ps, release) )
+		log_msg(lg, "+ can't find kernel release of hibernation image");
+
+	log_msg(lg, "+ hibernation image of kernel '%s' found", release);
+	rc = 0;
+
+	RESUME_LOCK();
+	if (NULL == image_device) {
+		image_device = strdup(device);
+		strcpy(image_release, release);
+	}
+	RESUME_UNLOCK();
+
+free:
+	free(buf);
+close:
+	close(fd);
+	return rc;
+}
+
+
+const char *resume_device(void)
+{
+	const char *dev;
+
+	RESUME_LOCK();
+	dev = image_device;
+	RESUME_UNLOCK();
+
+	return dev;
+}
+
+
+/* Check that 'opt' is in cmdline as separate word */
+static int has_option(const char *cmdline, const char *opt)
+{
+	size_t len = strlen(opt);
+	const char *p = cmdline;
+
+	while (NULL != (p = strstr(p, opt))) {
+		if ( (p == cmdline || ' ' == p[-1])
+				&& ('\0' == p[len] || ' ' == p[len]) )
+			return 1;
+		p += len;
+	}
+
+	return 0;
+}
+
+
+/* Return 1 when item resumes from image device already */
+static int resumes_itself(const struct boot_item_t *bi)
+{
+	char opt[sizeof("resume=") + 64];
+
+	if (NULL == bi->cmdline) return 0;
+	snprintf(opt, sizeof(opt), "resume=%s", image_device);
+	return has_option(bi->cmdline, opt);
+}
+
+
+int resume_match(const struct boot_item_t *bi)
+{
+	if (NULL == resume_device() || NULL == bi->kernelpath) return 0;
+
+	if (resumes_itself(bi)) return 1;
+
+	/* Versioned kernel name (zImage-5.10.0) or label */
+	if ('\0' == image_release[0]) return 0;
+	if (strstr(bi->kernelpath, image_release)) return 1;
+	if (bi->label && strstr(bi->label, image_release)) return 1;
+
+	return 0;
+}
+
+
+int resume_add_item(struct bootconf_t *bc, const struct boot_item_t *bi)
+{
+	struct cfgdata_t cfgdata;
+	struct device_t dev;
+	kx_cfg_section *sc;
+	const char *label;
+	unsigned int fill = bc->fill;
+	int rc = -1;
+
+	init_cfgdata(&cfgdata);
+	cfgdata.ui = bc->ui;	/* Global values are merged too */
+	sc = cfg_section_new(&cfgdata);
+	if (NULL == sc) goto free;
+
+	label = bi->label ? bi->label : bi->kernelpath + sizeof(MOUNTPOINT) - 1;
+	sc->label = malloc(sizeof("Resume ") + strlen(label));
+	if (sc->label) sprintf(sc->label, "Resume %s", label);
+
+	if (resumes_itself(bi)) {
+		sc->cmdline = strdup(bi->cmdline);
+	} else {
+		sc->cmdline = malloc((bi->cmdline ? strlen(bi->cmdline) + 1 : 0)
+				+ sizeof("resume=") + strlen(image_device));
+		if (sc->cmdline) sprintf(sc->cmdline, "%s%sresume=%s",
+				bi->cmdline ? bi->cmdline : "", bi->cmdline ? " " : "",
+				image_device);
+	}
+
+	sc->kernelpath = strdup(bi->kernelpath);
+	if (bi->initrd) sc->initrd = strdup(bi->initrd);
+#ifdef USE_INITRD_COMPOSE
+	if (bi->overlays) {
+		unsigned int i;
+
+		sc->overlays = create_charlist(bi->overlays->fill + 1);
+		for (i = 0; sc->overlays && i < bi->overlays->fill; i++)
+			addto_charlist(sc->overlays, bi->overlays->list[i]);
+	}
+	if (bi->bootdev) sc->bootdev = strdup(bi->bootdev);
+#endif
+	sc->priority = bi->priority + 1;	/* Above item it is made of */
+	sc->is_default = 1;
+
+	if (sc->label && sc->cmdline && sc->kernelpath
+			&& (!bi->initrd || sc->initrd)
+	) {
+		dev.device = bi->device;
+		dev.fstype = bi->fstype;
+		dev.blocks = bi->blocks;
+		rc = addto_bootcfg(bc, &dev, &cfgdata);
+	}
+
+	/* Strings are owned by bootconf when item is added */
+	if (fill == bc->fill) {
+		dispose(sc->label);
+		dispose(sc->cmdline);
+		dispose(sc->kernelpath);
+		dispose(sc->initrd);
+#ifdef USE_INITRD_COMPOSE
+		if (sc->overlays) free_charlist(sc->overlays);
+		dispose(sc->bootdev);
+#endif
+	}
+
+free:
+	destroy_cfgdata(&cfgdata);
+	return rc;
+}
+
+#endif	/* USE_RESUME */
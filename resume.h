@@ -0,0 +1,43 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_RESUME_H_
+#define _HAVE_RESUME_H_
+
+#include "config.h"
+#include "devicescan.h"
+
+/*
+ * Resume from hibernation image found on swap partition.
+ * Image is resumed by the kernel which made it, so boot item with
+ * this kernel is offered again with resume= pointing to the image.
+ */
+
+/* Check swap device for hibernation image and remember first one found.
+ * Return 0 when image is found or -1 */
+int resume_check(const char *device);
+
+/* Return device with hibernation image or NULL */
+const char *resume_device(void);
+
+/* Return 1 when boot item boots kernel which made the image */
+int resume_match(const struct boot_item_t *bi);
+
+/* Add copy of 'bi' resuming the image to bootconf. Return 0 or -1 */
+int resume_add_item(struct bootconf_t *bc, const struct boot_item_t *bi);
+
+#endif /* _HAVE_RESUME_H_ */
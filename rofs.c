@@ -0,0 +1,1125 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#ifdef USE_ROFS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <asm/byteorder.h>
+#include <linux/types.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include "util.h"
+#include "cfgparser.h"
+#include "rofs.h"
+#include "fstype/ext2_fs.h"
+#include "fstype/ext3_fs.h"
+#include "fstype/squashfs_fs.h"
+
+/* Directories bigger than this are not read into memory */
+#define ROFS_MAX_DIR	(256 * 1024)
+
+/* Longest name we can look up */
+#define ROFS_MAX_NAME	255
+
+/* Not defined by fstype/ext3_fs.h */
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG	0x0200
+#define EXT4_FEATURE_INCOMPAT_EA_INODE	0x0400
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED	0x2000
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR	0x4000
+
+/* Incompatible features which don't change the way we read files.
+ * Filesystems needing journal recovery are mounted to get it replayed */
+#define EXT_INCOMPAT_SUPP	(EXT2_FEATURE_INCOMPAT_FILETYPE | \
+		EXT3_FEATURE_INCOMPAT_EXTENTS | EXT4_FEATURE_INCOMPAT_64BIT | \
+		EXT4_FEATURE_INCOMPAT_MMP | EXT4_FEATURE_INCOMPAT_FLEX_BG | \
+		EXT4_FEATURE_INCOMPAT_EA_INODE | EXT4_FEATURE_INCOMPAT_CSUM_SEED | \
+		EXT4_FEATURE_INCOMPAT_LARGEDIR)
+
+#define EXT_ROOT_INO		2
+#define EXT_DESC_SIZE_OFFSET	0xFE	/* s_desc_size in superblock */
+#define EXT4_EXTENTS_FL		0x00080000
+#define EXT4_INLINE_DATA_FL	0x10000000
+#define EXT4_EXT_MAGIC		0xF30A
+#define EXT4_EXT_MAX_DEPTH	5
+
+/* squashfs 4.0 layout. fstype/squashfs_fs.h describes older one */
+#define SQ_SB_SIZE			96
+#define SQ_METADATA_SIZE	8192
+#define SQ_META_UNCOMPRESSED	(1 << 15)
+#define SQ_BLOCK_UNCOMPRESSED	(1 << 24)
+#define SQ_INVALID_FRAG		0xFFFFFFFF
+#define SQ_ZLIB				1
+
+enum sq_inode_type_t {
+	SQ_DIR		= 1,
+	SQ_FILE		= 2,
+	SQ_SYMLINK	= 3,
+	SQ_LDIR		= 8,
+	SQ_LFILE	= 9,
+	SQ_LSYMLINK	= 10,
+};
+
+/* Inode of any supported filesystem */
+struct rofs_inode {
+	unsigned long long size;
+	int dir;					/* Is directory */
+	union {
+		struct {
+			unsigned int flags;
+			unsigned char block[60];	/* i_block[] as is on disk */
+		} ext;
+		unsigned int cluster;	/* FAT: first cluster. 0 is FAT12/16 root */
+		struct {
+			unsigned long long start;	/* Directory metadata or first data block */
+			unsigned int offset;		/* Directory offset in metadata block */
+			unsigned int fragment;
+			unsigned int frag_offset;
+			unsigned long long list;	/* Block list position in inode table */
+			unsigned int list_offset;
+		} sq;
+	} u;
+};
+
+struct rofs_ops {
+	const char *name;
+	int (*open)(kx_rofs *fs);
+	int (*lookup)(kx_rofs *fs, struct rofs_inode *dir, const char *name,
+			struct rofs_inode *ino);
+	int (*read)(kx_rofs *fs, struct rofs_inode *ino, char *buf,
+			unsigned int len);
+};
+
+struct kx_rofs {
+	int fd;
+	const struct rofs_ops *ops;
+	struct rofs_inode root;
+	unsigned int block_size;
+	union {
+		struct {
+			unsigned int inodes_per_group;
+			unsigned int inode_size;
+			unsigned int desc_size;
+			unsigned int first_data_block;
+			int filetype;			/* Directory entries have file type */
+		} ext;
+		struct {
+			int bits;				/* FAT12/16/32 */
+			unsigned int clusters;
+			unsigned int cluster_size;
+			unsigned long long fat_start;
+			unsigned long long root_start;
+			unsigned long long data_start;
+		} fat;
+		struct {
+			unsigned int compression;
+			unsigned long long inode_table;
+			unsigned long long dir_table;
+			unsigned long long frag_table;
+			unsigned int fragments;
+			/* Last unpacked metadata block */
+			unsigned char *cache;
+			unsigned int cache_len;
+			unsigned long long cached;
+			unsigned long long cached_next;
+		} sq;
+	} u;
+};
+
+
+static inline unsigned int get_le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline unsigned int get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline unsigned long long get_le64(const unsigned char *p)
+{
+	return get_le32(p) | ((unsigned long long)get_le32(p + 4) << 32);
+}
+
+
+/* Read exactly 'len' bytes at 'off' */
+static int rofs_pread(kx_rofs *fs, unsigned long long off, void *buf,
+		unsigned int len)
+{
+	ssize_t n;
+
+	n = pread(fs->fd, buf, len, (off_t)off);
+	if (n != len) {
+		DPRINTF("Can't read %u bytes at %llu", len, off);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * ext2/3/4
+ */
+
+/* Read inode 'no' */
+static int ext_inode(kx_rofs *fs, unsigned int no, struct rofs_inode *ino)
+{
+	unsigned char desc[64], raw[128];
+	unsigned int group, index, mode;
+	unsigned long long table;
+
+	if (0 == no) return -1;
+	group = (no - 1) / fs->u.ext.inodes_per_group;
+	index = (no - 1) % fs->u.ext.inodes_per_group;
+
+	if (-1 == rofs_pread(fs, (unsigned long long)(fs->u.ext.first_data_block + 1)
+			* fs->block_size + (unsigned long long)group * fs->u.ext.desc_size,
+			desc, fs->u.ext.desc_size))
+		return -2;
+
+	table = get_le32(desc + 8);
+	if (fs->u.ext.desc_size >= 64)
+		table |= (unsigned long long)get_le32(desc + 0x28) << 32;
+
+	if (-1 == rofs_pread(fs, table * fs->block_size
+			+ (unsigned long long)index * fs->u.ext.inode_size, raw, sizeof(raw)))
+		return -2;
+
+	mode = get_le16(raw) & 0xF000;
+	ino->u.ext.flags = get_le32(raw + 0x20);
+	memcpy(ino->u.ext.block, raw + 0x28, sizeof(ino->u.ext.block));
+	ino->size = get_le32(raw + 4)
+			| ((unsigned long long)get_le32(raw + 0x6C) << 32);
+
+	switch (mode) {
+	case 0x4000:	/* S_IFDIR */
+		ino->dir = 1;
+		break;
+	case 0x8000:	/* S_IFREG */
+		ino->dir = 0;
+		break;
+	case 0xA000:	/* S_IFLNK. Kernel will follow it */
+		return -2;
+	default:
+		return -1;
+	}
+
+	if (ino->u.ext.flags & EXT4_INLINE_DATA_FL) return -2;
+
+	return 0;
+}
+
+/* Map logical block through extents tree. 0 is hole */
+static int ext_extent_map(kx_rofs *fs, struct rofs_inode *ino,
+		unsigned int lblk, unsigned long long *pblk)
+{
+	const unsigned char *node = ino->u.ext.block, *e;
+	unsigned char *buf = NULL;
+	unsigned int i, entries, depth, level, first, len;
+	unsigned long long child;
+	int rc = -2;
+
+	*pblk = 0;
+	for (level = 0; level <= EXT4_EXT_MAX_DEPTH; level++) {
+		if (EXT4_EXT_MAGIC != get_le16(node)) break;
+		entries = get_le16(node + 2);
+		depth = get_le16(node + 6);
+		if (entries > ((node == buf) ? (fs->block_size - 12) / 12 : 4)) break;
+
+		if (0 == depth) {
+			/* Leaf: find extent containing block */
+			for (i = 0; i < entries; i++) {
+				e = node + 12 + i * 12;
+				first = get_le32(e);
+				len = get_le16(e + 4);
+				if (len > 32768) {
+					/* Uninitialized extent reads as zeroes */
+					len -= 32768;
+					if ( (lblk >= first) && (lblk - first < len) ) break;
+					continue;
+				}
+				if ( (lblk >= first) && (lblk - first < len) ) {
+					*pblk = (((unsigned long long)get_le16(e + 6) << 32)
+							| get_le32(e + 8)) + (lblk - first);
+					break;
+				}
+			}
+			rc = 0;
+			break;
+		}
+
+		/* Index: take last entry starting before block */
+		e = NULL;
+		for (i = 0; i < entries; i++) {
+			if (get_le32(node + 12 + i * 12) > lblk) break;
+			e = node + 12 + i * 12;
+		}
+		if (NULL == e) {
+			rc = 0;		/* Hole */
+			break;
+		}
+
+		child = get_le32(e + 4) | ((unsigned long long)get_le16(e + 8) << 32);
+		if (NULL == buf) {
+			buf = malloc(fs->block_size);
+			if (NULL == buf) break;
+		}
+		if (-1 == rofs_pread(fs, child * fs->block_size, buf, fs->block_size))
+			break;
+		node = buf;
+	}
+
+	dispose(buf);
+	return rc;
+}
+
+/* Map logical block through (double, triple) indirect blocks. 0 is hole */
+static int ext_indirect_map(kx_rofs *fs, struct rofs_inode *ino,
+		unsigned int lblk, unsigned long long *pblk)
+{
+	unsigned int apb = fs->block_size / 4;	/* Addresses per block */
+	unsigned int idx[3], levels, i;
+	unsigned char addr[4];
+	unsigned int blk;
+
+	if (lblk < 12) {
+		*pblk = get_le32(ino->u.ext.block + lblk * 4);
+		return 0;
+	}
+
+	lblk -= 12;
+	if (lblk < apb) {
+		levels = 1;
+		blk = get_le32(ino->u.ext.block + 12 * 4);
+		idx[0] = lblk;
+	} else if ((lblk -= apb) < apb * apb) {
+		levels = 2;
+		blk = get_le32(ino->u.ext.block + 13 * 4);
+		idx[0] = lblk / apb;
+		idx[1] = lblk % apb;
+	} else {
+		lblk -= apb * apb;
+		levels = 3;
+		blk = get_le32(ino->u.ext.block + 14 * 4);
+		idx[0] = lblk / (apb * apb);
+		idx[1] = (lblk / apb) % apb;
+		idx[2] = lblk % apb;
+	}
+
+	for (i = 0; (i < levels) && (0 != blk); i++) {
+		if (-1 == rofs_pread(fs, (unsigned long long)blk * fs->block_size
+				+ idx[i] * 4, addr, sizeof(addr)))
+			return -2;
+		blk = get_le32(addr);
+	}
+
+	*pblk = blk;
+	return 0;
+}
+
+static int ext_read(kx_rofs *fs, struct rofs_inode *ino, char *buf,
+		unsigned int len)
+{
+	unsigned long long pblk;
+	unsigned int lblk, n, done;
+	int rc;
+
+	for (lblk = 0, done = 0; done < len; lblk++, done += n) {
+		n = len - done;
+		if (n > fs->block_size) n = fs->block_size;
+
+		if (ino->u.ext.flags & EXT4_EXTENTS_FL)
+			rc = ext_extent_map(fs, ino, lblk, &pblk);
+		else
+			rc = ext_indirect_map(fs, ino, lblk, &pblk);
+		if (rc < 0) return rc;
+
+		if (0 == pblk) {
+			memset(buf + done, 0, n);
+		} else if (-1 == rofs_pread(fs, pblk * fs->block_size, buf + done, n)) {
+			return -2;
+		}
+	}
+
+	return done;
+}
+
+static int ext_lookup(kx_rofs *fs, struct rofs_inode *dir, const char *name,
+		struct rofs_inode *ino)
+{
+	unsigned char *buf, *e;
+	unsigned int pos, rec_len, name_len, len, nlen;
+	int rc;
+
+	if (dir->size > ROFS_MAX_DIR) return -2;
+	len = dir->size;
+	nlen = strlen(name);
+
+	buf = malloc(len);
+	if (NULL == buf) return -2;
+
+	rc = ext_read(fs, dir, (char *)buf, len);
+	if (rc < 0) {
+		free(buf);
+		return rc;
+	}
+
+	rc = -1;
+	for (pos = 0; pos + 8 <= len; pos += rec_len) {
+		e = buf + pos;
+		rec_len = get_le16(e + 4);
+		if ( (rec_len < 8) || (pos + rec_len > len) ) {
+			rc = -2;	/* Broken directory */
+			break;
+		}
+
+		name_len = fs->u.ext.filetype ? e[6] : get_le16(e + 6);
+		if ( (0 == get_le32(e)) || (name_len != nlen)
+				|| (8 + name_len > rec_len) )
+			continue;
+
+		if (0 == memcmp(e + 8, name, nlen)) {
+			rc = ext_inode(fs, get_le32(e), ino);
+			break;
+		}
+	}
+
+	free(buf);
+	return rc;
+}
+
+static int ext_open(kx_rofs *fs)
+{
+	unsigned char raw[1024];
+	struct ext2_super_block *sb = (struct ext2_super_block *)raw;
+	unsigned int incompat = 0, log_bs;
+
+	if (-1 == rofs_pread(fs, 1024, raw, sizeof(raw))) return -1;
+	if (__le16_to_cpu(sb->s_magic) != EXT2_SUPER_MAGIC) return -1;
+
+	fs->u.ext.inode_size = 128;
+	if (__le32_to_cpu(sb->s_rev_level) > 0) {
+		incompat = __le32_to_cpu(sb->s_feature_incompat);
+		fs->u.ext.inode_size = __le16_to_cpu(sb->s_inode_size);
+	}
+
+	if (incompat & ~EXT_INCOMPAT_SUPP) {
+		log_msg(lg, "+ ext features 0x%x need mount", incompat & ~EXT_INCOMPAT_SUPP);
+		return -1;
+	}
+	fs->u.ext.filetype = !!(incompat & EXT2_FEATURE_INCOMPAT_FILETYPE);
+
+	fs->u.ext.desc_size = 32;
+	if (incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		fs->u.ext.desc_size = get_le16(raw + EXT_DESC_SIZE_OFFSET);
+		if (fs->u.ext.desc_size > 64) fs->u.ext.desc_size = 64;
+		if (fs->u.ext.desc_size < 32) fs->u.ext.desc_size = 32;
+	}
+
+	log_bs = __le32_to_cpu(sb->s_log_block_size);
+	fs->u.ext.inodes_per_group = __le32_to_cpu(sb->s_inodes_per_group);
+	fs->u.ext.first_data_block = __le32_to_cpu(sb->s_first_data_block);
+	if ( (log_bs > 6) || (0 == fs->u.ext.inodes_per_group)
+			|| (fs->u.ext.inode_size < 128) )
+		return -1;
+	fs->block_size = 1024 << log_bs;
+
+	if (0 != ext_inode(fs, EXT_ROOT_INO, &fs->root)) return -1;
+	return 0;
+}
+
+
+/*
+ * FAT12/16/32
+ */
+
+/* Get next cluster in chain. 0 is end of chain */
+static int fat_next(kx_rofs *fs, unsigned int cluster, unsigned int *next)
+{
+	unsigned char raw[4];
+	unsigned long long off;
+	unsigned int v, eoc;
+
+	switch (fs->u.fat.bits) {
+	case 12:
+		off = cluster + cluster / 2;
+		eoc = 0xFF8;
+		break;
+	case 16:
+		off = cluster * 2;
+		eoc = 0xFFF8;
+		break;
+	default:
+		off = cluster * 4;
+		eoc = 0x0FFFFFF8;
+		break;
+	}
+
+	if (-1 == rofs_pread(fs, fs->u.fat.fat_start + off, raw,
+			(32 == fs->u.fat.bits) ? 4 : 2))
+		return -2;
+
+	switch (fs->u.fat.bits) {
+	case 12:
+		v = get_le16(raw);
+		v = (cluster & 1) ? (v >> 4) : (v & 0xFFF);
+		break;
+	case 16:
+		v = get_le16(raw);
+		break;
+	default:
+		v = get_le32(raw) & 0x0FFFFFFF;
+		break;
+	}
+
+	if ( (v >= eoc) || (v < 2) || (v >= fs->u.fat.clusters + 2) ) v = 0;
+	*next = v;
+	return 0;
+}
+
+/* Read up to 'len' bytes of cluster chain or FAT12/16 root directory */
+static int fat_read_chain(kx_rofs *fs, struct rofs_inode *ino, char *buf,
+		unsigned int len)
+{
+	unsigned int cluster, n, done, hops;
+
+	if (0 == ino->u.cluster) {
+		if (!ino->dir) return 0;	/* Empty file */
+		if (len > ino->size) len = ino->size;
+		if (-1 == rofs_pread(fs, fs->u.fat.root_start, buf, len)) return -2;
+		return len;
+	}
+
+	cluster = ino->u.cluster;
+	for (done = 0, hops = 0; (done < len) && (0 != cluster); done += n) {
+		if (++hops > fs->u.fat.clusters) return -2;	/* Loop in chain */
+
+		n = len - done;
+		if (n > fs->u.fat.cluster_size) n = fs->u.fat.cluster_size;
+
+		if (-1 == rofs_pread(fs, fs->u.fat.data_start
+				+ (unsigned long long)(cluster - 2) * fs->u.fat.cluster_size,
+				buf + done, n))
+			return -2;
+
+		if (-1 == fat_next(fs, cluster, &cluster)) return -2;
+	}
+
+	return done;
+}
+
+static int fat_read(kx_rofs *fs, struct rofs_inode *ino, char *buf,
+		unsigned int len)
+{
+	int n;
+
+	n = fat_read_chain(fs, ino, buf, len);
+	if ( (n >= 0) && (n < len) ) return -2;	/* Chain is too short */
+	return n;
+}
+
+/* Store 13 UCS-2 chars of long name entry. Non-ASCII chars can't match */
+static void fat_lfn_part(const unsigned char *e, char *lfn)
+{
+	static const unsigned char offsets[13] = {
+		1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+	};
+	unsigned int i, c;
+
+	for (i = 0; i < 13; i++) {
+		c = get_le16(e + offsets[i]);
+		if ( (0 == c) || (0xFFFF == c) ) {
+			lfn[i] = '\0';
+			break;
+		}
+		lfn[i] = (c < 0x80) ? c : '?';
+	}
+}
+
+static int fat_lookup(kx_rofs *fs, struct rofs_inode *dir, const char *name,
+		struct rofs_inode *ino)
+{
+	char lfn[20 * 13 + 1], sfn[13];
+	unsigned char *buf, *e;
+	unsigned int seq, i, j, len;
+	int n, rc = -1, have_lfn = 0;
+
+	len = dir->size;
+	if (0 != dir->u.cluster) len = ROFS_MAX_DIR;	/* Whole chain */
+
+	buf = malloc(len);
+	if (NULL == buf) return -2;
+
+	n = fat_read_chain(fs, dir, (char *)buf, len);
+	if (n < 0) {
+		free(buf);
+		return n;
+	}
+
+	for (e = buf; e + 32 <= buf + n; e += 32) {
+		if (0x00 == e[0]) break;	/* End of directory */
+		if (0xE5 == e[0]) {			/* Deleted entry */
+			have_lfn = 0;
+			continue;
+		}
+
+		if (0x0F == e[11]) {		/* Long name part */
+			seq = e[0] & 0x1F;
+			if ( (seq < 1) || (seq > 20) ) {
+				have_lfn = 0;
+				continue;
+			}
+			if (e[0] & 0x40) {		/* Last part comes first */
+				memset(lfn, 0, sizeof(lfn));
+				have_lfn = 1;
+			}
+			fat_lfn_part(e, lfn + (seq - 1) * 13);
+			continue;
+		}
+
+		if (e[11] & 0x08) {			/* Volume label */
+			have_lfn = 0;
+			continue;
+		}
+
+		/* Make "NAME.EXT" from short name */
+		for (i = 0, j = 0; (i < 8) && (' ' != e[i]); i++)
+			sfn[j++] = ( (0 == i) && (0x05 == e[0]) ) ? 0xE5 : e[i];
+		if (' ' != e[8]) {
+			sfn[j++] = '.';
+			for (i = 8; (i < 11) && (' ' != e[i]); i++) sfn[j++] = e[i];
+		}
+		sfn[j] = '\0';
+
+		if ( (have_lfn && !strcasecmp(lfn, name)) || !strcasecmp(sfn, name) ) {
+			ino->dir = !!(e[11] & 0x10);
+			ino->size = get_le32(e + 28);
+			ino->u.cluster = get_le16(e + 26);
+			if (32 == fs->u.fat.bits) ino->u.cluster |= get_le16(e + 20) << 16;
+
+			/* ".." of first level directory points to root */
+			if (ino->dir && (0 == ino->u.cluster)) *ino = fs->root;
+			rc = 0;
+			break;
+		}
+		have_lfn = 0;
+	}
+
+	free(buf);
+	return rc;
+}
+
+static int fat_open(kx_rofs *fs)
+{
+	unsigned char bs[512];
+	unsigned int bps, spc, reserved, nfats, root_entries, root_secs;
+	unsigned int total, fatsz, data_sec;
+
+	if (-1 == rofs_pread(fs, 0, bs, sizeof(bs))) return -1;
+
+	bps = get_le16(bs + 11);
+	spc = bs[13];
+	reserved = get_le16(bs + 14);
+	nfats = bs[16];
+	root_entries = get_le16(bs + 17);
+	total = get_le16(bs + 19);
+	if (0 == total) total = get_le32(bs + 32);
+	fatsz = get_le16(bs + 22);
+	if (0 == fatsz) fatsz = get_le32(bs + 36);
+
+	if ( (bps < 512) || (bps > 4096) || (bps & (bps - 1))
+			|| (0 == spc) || (spc & (spc - 1))
+			|| (0 == reserved) || (0 == nfats) || (0 == fatsz) )
+		return -1;
+
+	root_secs = (root_entries * 32 + bps - 1) / bps;
+	data_sec = reserved + nfats * fatsz + root_secs;
+	if (total <= data_sec) return -1;
+
+	fs->block_size = bps;
+	fs->u.fat.clusters = (total - data_sec) / spc;
+	fs->u.fat.cluster_size = bps * spc;
+	fs->u.fat.fat_start = (unsigned long long)reserved * bps;
+	fs->u.fat.root_start = (unsigned long long)(reserved + nfats * fatsz) * bps;
+	fs->u.fat.data_start = (unsigned long long)data_sec * bps;
+
+	if (fs->u.fat.clusters < 4085) fs->u.fat.bits = 12;
+	else if (fs->u.fat.clusters < 65525) fs->u.fat.bits = 16;
+	else fs->u.fat.bits = 32;
+
+	fs->root.dir = 1;
+	if (32 == fs->u.fat.bits) {
+		fs->root.size = 0;
+		fs->root.u.cluster = get_le32(bs + 44);
+	} else {
+		fs->root.size = root_entries * 32;
+		fs->root.u.cluster = 0;
+	}
+
+	return 0;
+}
+
+
+/*
+ * squashfs 4.0
+ */
+
+/* Unpack block. Only zlib is supported */
+static int sq_uncompress(kx_rofs *fs, unsigned char *dst, unsigned int *dlen,
+		const unsigned char *src, unsigned int slen)
+{
+#ifdef HAVE_LIBZ
+	uLongf n = *dlen;
+
+	if ( (SQ_ZLIB == fs->u.sq.compression)
+			&& (Z_OK == uncompress(dst, &n, src, slen)) )
+	{
+		*dlen = n;
+		return 0;
+	}
+#endif
+	return -2;
+}
+
+/* Load metadata block at 'blk' into cache */
+static int sq_meta_load(kx_rofs *fs, unsigned long long blk)
+{
+	unsigned char hdr[2], raw[SQ_METADATA_SIZE];
+	unsigned int size, len;
+
+	if (blk == fs->u.sq.cached) return 0;
+
+	if (-1 == rofs_pread(fs, blk, hdr, sizeof(hdr))) return -2;
+	size = get_le16(hdr) & ~SQ_META_UNCOMPRESSED;
+	if ( (0 == size) || (size > SQ_METADATA_SIZE) ) return -2;
+
+	/* Cache is overwritten below */
+	fs->u.sq.cached = 0;
+
+	if (get_le16(hdr) & SQ_META_UNCOMPRESSED) {
+		if (-1 == rofs_pread(fs, blk + 2, fs->u.sq.cache, size)) return -2;
+		len = size;
+	} else {
+		if (-1 == rofs_pread(fs, blk + 2, raw, size)) return -2;
+		len = SQ_METADATA_SIZE;
+		if (0 != sq_uncompress(fs, fs->u.sq.cache, &len, raw, size)) return -2;
+	}
+
+	fs->u.sq.cache_len = len;
+	fs->u.sq.cached = blk;
+	fs->u.sq.cached_next = blk + 2 + size;
+	return 0;
+}
+
+/* Read metadata stream starting at 'offset' of block '*blk' */
+static int sq_meta_read(kx_rofs *fs, unsigned long long *blk,
+		unsigned int *offset, void *buf, unsigned int len)
+{
+	unsigned char *p = buf;
+	unsigned int n;
+
+	while (len > 0) {
+		if (0 != sq_meta_load(fs, *blk)) return -2;
+
+		if (*offset >= fs->u.sq.cache_len) {
+			*offset -= fs->u.sq.cache_len;
+			*blk = fs->u.sq.cached_next;
+			continue;
+		}
+
+		n = fs->u.sq.cache_len - *offset;
+		if (n > len) n = len;
+		memcpy(p, fs->u.sq.cache + *offset, n);
+		p += n;
+		len -= n;
+		*offset += n;
+	}
+
+	return 0;
+}
+
+/* Read inode by reference (metadata block << 16 | offset) */
+static int sq_inode(kx_rofs *fs, unsigned long long ref, struct rofs_inode *ino)
+{
+	unsigned char raw[40];
+	unsigned long long blk = fs->u.sq.inode_table + (ref >> 16);
+	unsigned int offset = ref & 0xFFFF;
+
+	if (0 != sq_meta_read(fs, &blk, &offset, raw, 16)) return -2;
+
+	switch (get_le16(raw)) {
+	case SQ_DIR:
+		if (0 != sq_meta_read(fs, &blk, &offset, raw, 16)) return -2;
+		ino->dir = 1;
+		ino->size = get_le16(raw + 8);
+		ino->u.sq.start = fs->u.sq.dir_table + get_le32(raw);
+		ino->u.sq.offset = get_le16(raw + 10);
+		break;
+	case SQ_LDIR:
+		if (0 != sq_meta_read(fs, &blk, &offset, raw, 24)) return -2;
+		ino->dir = 1;
+		ino->size = get_le32(raw + 4);
+		ino->u.sq.start = fs->u.sq.dir_table + get_le32(raw + 8);
+		ino->u.sq.offset = get_le16(raw + 18);
+		break;
+	case SQ_FILE:
+		if (0 != sq_meta_read(fs, &blk, &offset, raw, 16)) return -2;
+		ino->dir = 0;
+		ino->u.sq.start = get_le32(raw);
+		ino->u.sq.fragment = get_le32(raw + 4);
+		ino->u.sq.frag_offset = get_le32(raw + 8);
+		ino->size = get_le32(raw + 12);
+		break;
+	case SQ_LFILE:
+		if (0 != sq_meta_read(fs, &blk, &offset, raw, 40)) return -2;
+		ino->dir = 0;
+		ino->u.sq.start = get_le64(raw);
+		ino->size = get_le64(raw + 8);
+		ino->u.sq.fragment = get_le32(raw + 28);
+		ino->u.sq.frag_offset = get_le32(raw + 32);
+		break;
+	case SQ_SYMLINK:
+	case SQ_LSYMLINK:
+		return -2;
+	default:
+		return -1;
+	}
+
+	/* Block list follows file inode */
+	ino->u.sq.list = blk;
+	ino->u.sq.list_offset = offset;
+	return 0;
+}
+
+static int sq_lookup(kx_rofs *fs, struct rofs_inode *dir, const char *name,
+		struct rofs_inode *ino)
+{
+	unsigned char hdr[12], ent[8];
+	char ename[ROFS_MAX_NAME + 2];
+	unsigned long long blk = dir->u.sq.start;
+	unsigned int offset = dir->u.sq.offset;
+	unsigned int count, start, nlen, left;
+
+	/* Parent is not stored in directory, leave ".." to mounted FS */
+	if (0 == strcmp(name, "..")) return -2;
+
+	/* Directory size includes 3 bytes of "." and ".." */
+	if (dir->size <= 3) return -1;
+	left = dir->size - 3;
+
+	while (left >= sizeof(hdr)) {
+		if (0 != sq_meta_read(fs, &blk, &offset, hdr, sizeof(hdr))) return -2;
+		left -= sizeof(hdr);
+
+		count = get_le32(hdr) + 1;
+		start = get_le32(hdr + 4);
+		if (count > 256) return -2;
+
+		for (; count > 0; count--) {
+			if (0 != sq_meta_read(fs, &blk, &offset, ent, sizeof(ent))) return -2;
+			nlen = get_le16(ent + 6) + 1;
+			if ( (nlen > ROFS_MAX_NAME + 1) || (left < sizeof(ent) + nlen) ) return -2;
+			if (0 != sq_meta_read(fs, &blk, &offset, ename, nlen)) return -2;
+			left -= sizeof(ent) + nlen;
+			ename[nlen] = '\0';
+
+			if (0 == strcmp(ename, name))
+				return sq_inode(fs, ((unsigned long long)start << 16)
+						| get_le16(ent), ino);
+		}
+	}
+
+	return -1;
+}
+
+/* Read data block of 'size' (as stored in block list) at 'pos' and unpack it */
+static int sq_data_block(kx_rofs *fs, unsigned long long pos, unsigned int size,
+		unsigned char *out, unsigned int *len)
+{
+	unsigned char *raw;
+	unsigned int csize = size & (SQ_BLOCK_UNCOMPRESSED - 1);
+	int rc;
+
+	if (0 == csize) {		/* Sparse block */
+		memset(out, 0, *len);
+		return 0;
+	}
+	if (csize > fs->block_size) return -2;
+
+	if (size & SQ_BLOCK_UNCOMPRESSED) {
+		if (-1 == rofs_pread(fs, pos, out, csize)) return -2;
+		*len = csize;
+		return 0;
+	}
+
+	raw = malloc(csize);
+	if (NULL == raw) return -2;
+	rc = -2;
+	if (0 == rofs_pread(fs, pos, raw, csize))
+		rc = sq_uncompress(fs, out, len, raw, csize);
+	free(raw);
+	return rc;
+}
+
+static int sq_read(kx_rofs *fs, struct rofs_inode *ino, char *buf,
+		unsigned int len)
+{
+	unsigned char raw[16], *block;
+	unsigned long long pos = ino->u.sq.start, blk = ino->u.sq.list;
+	unsigned int offset = ino->u.sq.list_offset;
+	unsigned int nblocks, i, n, blen, done = 0;
+	int rc = -2;
+
+	block = malloc(fs->block_size);
+	if (NULL == block) return -2;
+
+	if (SQ_INVALID_FRAG == ino->u.sq.fragment)
+		nblocks = (ino->size + fs->block_size - 1) / fs->block_size;
+	else
+		nblocks = ino->size / fs->block_size;
+
+	for (i = 0; (i < nblocks) && (done < len); i++, done += n) {
+		if (0 != sq_meta_read(fs, &blk, &offset, raw, 4)) goto out;
+
+		blen = fs->block_size;
+		if (0 != sq_data_block(fs, pos, get_le32(raw), block, &blen)) goto out;
+		pos += get_le32(raw) & (SQ_BLOCK_UNCOMPRESSED - 1);
+
+		n = len - done;
+		if (n > blen) n = blen;
+		memcpy(buf + done, block, n);
+	}
+
+	if ( (done < len) && (SQ_INVALID_FRAG != ino->u.sq.fragment) ) {
+		/* Tail is packed into fragment block */
+		if (ino->u.sq.fragment >= fs->u.sq.fragments) goto out;
+		if (-1 == rofs_pread(fs, fs->u.sq.frag_table
+				+ (ino->u.sq.fragment / 512) * 8, raw, 8))
+			goto out;
+
+		blk = get_le64(raw);
+		offset = (ino->u.sq.fragment % 512) * 16;
+		if (0 != sq_meta_read(fs, &blk, &offset, raw, 16)) goto out;
+
+		blen = fs->block_size;
+		if (0 != sq_data_block(fs, get_le64(raw), get_le32(raw + 8), block, &blen))
+			goto out;
+
+		n = len - done;
+		if (ino->u.sq.frag_offset + n > blen) goto out;
+		memcpy(buf + done, block + ino->u.sq.frag_offset, n);
+		done += n;
+	}
+
+	if (done == len) rc = done;
+out:
+	free(block);
+	return rc;
+}
+
+static int sq_open(kx_rofs *fs)
+{
+	unsigned char sb[SQ_SB_SIZE];
+
+	if (-1 == rofs_pread(fs, 0, sb, sizeof(sb))) return -1;
+	if ( (SQUASHFS_MAGIC != get_le32(sb)) || (4 != get_le16(sb + 28)) )
+		return -1;
+
+	fs->block_size = get_le32(sb + 12);
+	fs->u.sq.fragments = get_le32(sb + 16);
+	fs->u.sq.compression = get_le16(sb + 20);
+	fs->u.sq.inode_table = get_le64(sb + 64);
+	fs->u.sq.dir_table = get_le64(sb + 72);
+	fs->u.sq.frag_table = get_le64(sb + 80);
+
+	if ( (fs->block_size < 4096) || (fs->block_size > 1024 * 1024) )
+		return -1;
+
+#ifdef HAVE_LIBZ
+	if (SQ_ZLIB != fs->u.sq.compression) {
+#endif
+		log_msg(lg, "+ squashfs compression %u needs mount", fs->u.sq.compression);
+		return -1;
+#ifdef HAVE_LIBZ
+	}
+#endif
+
+	fs->u.sq.cache = malloc(SQ_METADATA_SIZE);
+	if (NULL == fs->u.sq.cache) return -1;
+	fs->u.sq.cached = 0;	/* Superblock is never metadata block */
+
+	if (0 != sq_inode(fs, get_le64(sb + 32), &fs->root)) {
+		free(fs->u.sq.cache);
+		return -1;
+	}
+	return 0;
+}
+
+
+static const struct rofs_ops rofs_types[] = {
+	{ "ext2", ext_open, ext_lookup, ext_read },
+	{ "ext3", ext_open, ext_lookup, ext_read },
+	{ "ext4", ext_open, ext_lookup, ext_read },
+	{ "ext4dev", ext_open, ext_lookup, ext_read },
+	{ "vfat", fat_open, fat_lookup, fat_read },
+	{ "squashfs", sq_open, sq_lookup, sq_read },
+	{ NULL, NULL, NULL, NULL }
+};
+
+
+kx_rofs *rofs_open(const char *device, const char *fstype)
+{
+	const struct rofs_ops *ops;
+	kx_rofs *fs;
+
+	for (ops = rofs_types; ops->name; ops++) {
+		if (0 == strcmp(ops->name, fstype)) break;
+	}
+	if (NULL == ops->name) return NULL;
+
+	fs = malloc(sizeof(*fs));
+	if (NULL == fs) {
+		DPRINTF("Can't allocate rofs structure");
+		return NULL;
+	}
+	memset(fs, 0, sizeof(*fs));
+	fs->ops = ops;
+
+	fs->fd = open(device, O_RDONLY);
+	if (fs->fd < 0) {
+		log_msg(lg, "+ can't open %s: %s", device, ERRMSG);
+		free(fs);
+		return NULL;
+	}
+
+	if (0 != ops->open(fs)) {
+		close(fs->fd);
+		free(fs);
+		return NULL;
+	}
+
+	return fs;
+}
+
+
+void rofs_close(kx_rofs *fs)
+{
+	if (NULL == fs) return;
+
+	if (sq_open == fs->ops->open) dispose(fs->u.sq.cache);
+	close(fs->fd);
+	free(fs);
+}
+
+
+/* Walk 'path' from root directory */
+static int rofs_lookup(kx_rofs *fs, const char *path, struct rofs_inode *ino)
+{
+	const int mplen = sizeof(MOUNTPOINT) - 1;
+	char name[ROFS_MAX_NAME + 1];
+	struct rofs_inode dir;
+	const char *e;
+	int rc;
+
+	/* Paths from config are prefixed by our default mountpoint */
+	if ( (0 == strncmp(path, MOUNTPOINT, mplen))
+			&& ( ('/' == path[mplen]) || ('\0' == path[mplen]) )
+	) path += mplen;
+
+	*ino = fs->root;
+	for (;;) {
+		while ('/' == *path) ++path;
+		if ('\0' == *path) break;
+
+		e = strchr(path, '/');
+		if (NULL == e) e = path + strlen(path);
+		if (e - path > ROFS_MAX_NAME) return -1;
+
+		memcpy(name, path, e - path);
+		name[e - path] = '\0';
+		path = e;
+
+		if (!ino->dir) return -1;
+		if (0 == strcmp(name, ".")) continue;
+
+		dir = *ino;
+		rc = fs->ops->lookup(fs, &dir, name, ino);
+		if (0 != rc) return rc;
+	}
+
+	return 0;
+}
+
+
+int rofs_stat(kx_rofs *fs, const char *path, unsigned long long *size)
+{
+	struct rofs_inode ino;
+	int rc;
+
+	rc = rofs_lookup(fs, path, &ino);
+	if (0 != rc) return rc;
+	if (ino.dir) return -1;
+
+	if (size) *size = ino.size;
+	return 0;
+}
+
+
+int rofs_read(kx_rofs *fs, const char *path, char **buf, unsigned int maxlen)
+{
+	struct rofs_inode ino;
+	char *p;
+	int rc;
+
+	rc = rofs_lookup(fs, path, &ino);
+	if (0 != rc) return rc;
+	if (ino.dir) return -1;
+
+	if (ino.size > maxlen) {
+		log_msg(lg, "+ %s is too big (%llu bytes)", path, ino.size);
+		return -2;
+	}
+
+	p = malloc(ino.size + 1);
+	if (NULL == p) {
+		DPRINTF("Can't allocate %llu bytes for %s", ino.size, path);
+		return -2;
+	}
+
+	rc = fs->ops->read(fs, &ino, p, ino.size);
+	if (rc < 0) {
+		free(p);
+		return rc;
+	}
+
+	p[rc] = '\0';
+	*buf = p;
+	return rc;
+}
+
+#endif	/* USE_ROFS */
@@ -0,0 +1,48 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_ROFS_H_
+#define _HAVE_ROFS_H_
+
+#include "config.h"
+
+/*
+ * Read-only access to files on devices which are not mounted.
+ * Only small part of ext2/3/4, vfat and squashfs is supported:
+ * path lookup, file size and reading of small files.
+ * Functions return -2 when answer can't be given without mounting
+ * (unsupported feature, symlink in path, compressed data we can't unpack).
+ */
+
+typedef struct kx_rofs kx_rofs;
+
+/* Open filesystem 'fstype' on device. Return NULL when it is not supported */
+kx_rofs *rofs_open(const char *device, const char *fstype);
+
+/* Close filesystem and free its caches */
+void rofs_close(kx_rofs *fs);
+
+/* Return 0 when regular file 'path' exists, -1 when it doesn't or -2.
+ * 'size' may be NULL */
+int rofs_stat(kx_rofs *fs, const char *path, unsigned long long *size);
+
+/* Read whole file not bigger than 'maxlen' into allocated NUL-terminated
+ * buffer. Return file length, -1 when file is missing or -2 (also when
+ * it is too big, so that caller can deal with it on mounted FS) */
+int rofs_read(kx_rofs *fs, const char *path, char **buf, unsigned int maxlen);
+
+#endif /* _HAVE_ROFS_H_ */
@@ -0,0 +1,389 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
+#include "util.h"
+#include "sbprobe.h"
+#include "fstype/fstype.h"
+
+#ifdef USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Submission queue size. Bigger batches are split */
+#define SBPROBE_RING_SIZE	32
+#endif
+
+#ifdef USE_SCAN_THREADS
+#include <pthread.h>
+#endif
+
+
+/* Read probe window of one device with ordinary pread() */
+static void sbprobe_pread(struct sbprobe_t *p)
+{
+	if (p->fd < 0) return;	/* Failed already */
+
+	p->len = pread(p->fd, p->buf, FSTYPE_PROBE_SIZE, 0);
+	if (p->len < 0) p->err = errno;
+}
+
+
+#ifdef USE_IO_URING
+/* io_uring instance */
+struct sbprobe_ring_t {
+	int fd;
+	unsigned int entries;
+
+	void *sq_ptr;
+	size_t sq_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ptr;
+	size_t cq_size;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static void sbprobe_ring_close(struct sbprobe_ring_t *r)
+{
+	if (r->sqes) munmap(r->sqes, r->sqes_size);
+	if (r->cq_ptr) munmap(r->cq_ptr, r->cq_size);
+	if (r->sq_ptr) munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+}
+
+static int sbprobe_ring_open(struct sbprobe_ring_t *r)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+
+	r->fd = syscall(__NR_io_uring_setup, SBPROBE_RING_SIZE, &p);
+	if (r->fd < 0) return -1;
+
+	r->entries = p.sq_entries;
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == r->sq_ptr) {
+		r->sq_ptr = NULL;
+		goto fail;
+	}
+
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (MAP_FAILED == r->cq_ptr) {
+		r->cq_ptr = NULL;
+		goto fail;
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == r->sqes) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	r->sq_head = r->sq_ptr + p.sq_off.head;
+	r->sq_tail = r->sq_ptr + p.sq_off.tail;
+	r->sq_mask = r->sq_ptr + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ptr + p.sq_off.array;
+
+	r->cq_head = r->cq_ptr + p.cq_off.head;
+	r->cq_tail = r->cq_ptr + p.cq_off.tail;
+	r->cq_mask = r->cq_ptr + p.cq_off.ring_mask;
+	r->cqes = r->cq_ptr + p.cq_off.cqes;
+
+	return 0;
+
+fail:
+	sbprobe_ring_close(r);
+	return -1;
+}
+
+/* Store results of completed reads. Return number of them */
+static unsigned int sbprobe_ring_reap(struct sbprobe_ring_t *r,
+		struct sbprobe_t *probes)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, n, reaped = 0;
+
+	head = *r->cq_head;
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &r->cqes[head & *r->cq_mask];
+		n = cqe->user_data;
+		if (cqe->res < 0) {
+			probes[n].len = -1;
+			probes[n].err = -cqe->res;
+		} else {
+			probes[n].len = cqe->res;
+			probes[n].err = 0;
+		}
+		++head;
+		++reaped;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	return reaped;
+}
+
+/* Submit reads of all windows in chunks of ring size and reap them */
+static int sbprobe_uring(struct sbprobe_t *probes, unsigned int count)
+{
+	struct sbprobe_ring_t r;
+	struct io_uring_sqe *sqe;
+	struct iovec *iov;
+	unsigned int i, n, tail, done, queued, left, flight;
+	int ret;
+
+	if (-1 == sbprobe_ring_open(&r)) {
+		log_msg(lg, "+ io_uring is not available: %s", ERRMSG);
+		return -1;
+	}
+
+	iov = malloc(count * sizeof(*iov));
+	if (NULL == iov) {
+		sbprobe_ring_close(&r);
+		return -1;
+	}
+
+	for (i = 0; i < count; ) {
+		/* Fill submission queue */
+		tail = *r.sq_tail;
+		for (queued = 0; (queued < r.entries) && (i < count); i++) {
+			struct sbprobe_t *p = &probes[i];
+
+			if (p->fd < 0) continue;	/* Failed already */
+			p->err = EINPROGRESS;		/* Until completion is reaped */
+
+			iov[i].iov_base = p->buf;
+			iov[i].iov_len = FSTYPE_PROBE_SIZE;
+
+			sqe = &r.sqes[tail & *r.sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = p->fd;
+			sqe->addr = (unsigned long)&iov[i];
+			sqe->len = 1;
+			sqe->off = 0;
+			sqe->user_data = i;
+
+			r.sq_array[tail & *r.sq_mask] = tail & *r.sq_mask;
+			++tail;
+			++queued;
+		}
+		__atomic_store_n(r.sq_tail, tail, __ATOMIC_RELEASE);
+
+		/* Submit whole chunk and wait for all completions. Kernel may
+		 * take part of chunk only, rest is submitted again */
+		done = 0;
+		left = queued;
+		while (done < queued) {
+			if (left > 0) {
+				ret = syscall(__NR_io_uring_enter, r.fd, left, 0, 0, NULL, 0);
+				if (ret > 0) left -= ret;
+				else if ( (ret < 0) && (EINTR == errno) ) continue;
+				else if ( (ret < 0) && (EAGAIN != errno) && (EBUSY != errno) )
+					goto fail;
+			}
+
+			/* Wait for reads in flight. One is enough to go on submitting */
+			flight = queued - left - done;
+			if (0 == flight) {
+				log_msg(lg, "+ io_uring takes no reads");
+				goto abort;
+			}
+
+			ret = syscall(__NR_io_uring_enter, r.fd, 0,
+					(left > 0) ? 1 : flight, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret < 0) {
+				if (EINTR == errno) continue;
+				goto fail;
+			}
+
+			done += sbprobe_ring_reap(&r, probes);
+		}
+	}
+
+	free(iov);
+	sbprobe_ring_close(&r);
+	return 0;
+
+fail:
+	log_msg(lg, "+ io_uring_enter failed: %s", ERRMSG);
+
+abort:
+	/* Reads in flight still write to windows. Wait for them before
+	 * windows are read again by fallback */
+	flight = queued - left - done;
+	while (flight > 0) {
+		ret = syscall(__NR_io_uring_enter, r.fd, 0, flight,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if ( (ret < 0) && (EINTR != errno) ) break;
+		flight -= sbprobe_ring_reap(&r, probes);
+	}
+
+	if (flight > 0) {
+		/* Kernel may still own windows. Leave them to it with ring */
+		log_msg(lg, "+ can't reap io_uring reads: %s", ERRMSG);
+		for (n = 0; n < count; n++) {
+			if (EINPROGRESS != probes[n].err) continue;
+			close(probes[n].fd);
+			probes[n].fd = -1;
+			probes[n].buf = NULL;
+			probes[n].err = EIO;
+		}
+		return -1;
+	}
+
+	free(iov);
+	sbprobe_ring_close(&r);
+	return -1;
+}
+#endif	/* USE_IO_URING */
+
+
+#ifdef USE_SCAN_THREADS
+/* Shared state of probing threads */
+struct sbprobe_batch_t {
+	struct sbprobe_t *probes;
+	unsigned int count;
+	unsigned int next;
+	pthread_mutex_t lock;
+};
+
+static void *sbprobe_thread(void *arg)
+{
+	struct sbprobe_batch_t *b = arg;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+
+		if (i >= b->count) break;
+		sbprobe_pread(&b->probes[i]);
+	}
+	return NULL;
+}
+
+/* Read windows by USE_SCAN_THREADS threads */
+static int sbprobe_threads(struct sbprobe_t *probes, unsigned int count)
+{
+	struct sbprobe_batch_t b;
+	pthread_t threads[USE_SCAN_THREADS];
+	unsigned int i, n;
+
+	b.probes = probes;
+	b.count = count;
+	b.next = 0;
+	pthread_mutex_init(&b.lock, NULL);
+
+	for (n = 0; (n < USE_SCAN_THREADS) && (n < count); n++) {
+		if (0 != pthread_create(&threads[n], NULL, sbprobe_thread, &b))
+			break;
+	}
+
+	/* Caller works too. It will do everything if no threads were created */
+	sbprobe_thread(&b);
+
+	for (i = 0; i < n; i++) pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&b.lock);
+
+	return 0;
+}
+#endif	/* USE_SCAN_THREADS */
+
+
+int sbprobe_read(struct sbprobe_t *probes, unsigned int count)
+{
+	struct sbprobe_t *p;
+	unsigned int i, n;
+	int rc = -1;
+
+	/* Open devices and allocate windows */
+	for (i = 0, n = 0; i < count; i++) {
+		p = &probes[i];
+		p->len = -1;
+		p->err = 0;
+		p->buf = NULL;
+
+		p->fd = open(p->device, O_RDONLY);
+		if (p->fd < 0) {
+			p->err = errno;
+			continue;
+		}
+
+		p->buf = malloc(FSTYPE_PROBE_SIZE);
+		if (NULL == p->buf) {
+			DPRINTF("Can't allocate probe window for %s", p->device);
+			p->err = ENOMEM;
+			close(p->fd);
+			p->fd = -1;
+			continue;
+		}
+		++n;
+	}
+
+	if (0 == n) return -1;
+
+#ifdef USE_IO_URING
+	rc = sbprobe_uring(probes, count);
+#endif
+#ifdef USE_SCAN_THREADS
+	if (-1 == rc) rc = sbprobe_threads(probes, count);
+#endif
+	if (-1 == rc) {
+		for (i = 0; i < count; i++) sbprobe_pread(&probes[i]);
+		rc = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (probes[i].fd >= 0) close(probes[i].fd);
+		probes[i].fd = -1;
+	}
+
+	return rc;
+}
+
+
+void sbprobe_free(struct sbprobe_t *probes, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		dispose(probes[i].buf);
+		probes[i].buf = NULL;
+	}
+}
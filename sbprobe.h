@@ -0,0 +1,44 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_SBPROBE_H_
+#define _HAVE_SBPROBE_H_
+
+#include "config.h"
+
+/* Superblock read request */
+struct sbprobe_t {
+	const char *device;	/* Device path (in) */
+	char *buf;			/* Probe window of FSTYPE_PROBE_SIZE bytes (out) */
+	int len;			/* Bytes read or -1 on error (out) */
+	int err;			/* errno value when len is -1 (out) */
+	int fd;				/* Device descriptor (internal) */
+};
+
+/*
+ * Read probe windows of 'count' devices at once.
+ * Reads are submitted as one batch through io_uring when it is available
+ * and fall back to probing threads or plain reads otherwise.
+ * Return -1 when nothing could be done or 0 otherwise.
+ * Check len of every request for individual results.
+ */
+int sbprobe_read(struct sbprobe_t *probes, unsigned int count);
+
+/* Free buffers allocated by sbprobe_read() */
+void sbprobe_free(struct sbprobe_t *probes, unsigned int count);
+
+#endif /* _HAVE_SBPROBE_H_ */
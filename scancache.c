@@ -0,0 +1,792 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
+
+#ifdef USE_SCAN_CACHE
+#include "util.h"
+#include "scancache.h"
+
+#ifdef USE_ICONS
+#include "fb.h"
+#endif
+
+#ifdef USE_SCAN_THREADS
+#include <pthread.h>
+
+/* Cache is shared with device probing threads */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_LOCK()	pthread_mutex_lock(&cache_lock)
+#define CACHE_UNLOCK()	pthread_mutex_unlock(&cache_lock)
+#else
+#define CACHE_LOCK()	do { } while (0)
+#define CACHE_UNLOCK()	do { } while (0)
+#endif
+
+/* File header. Increase version on every format change */
+#define SCANCACHE_MAGIC		0x4358424bU	/* "KBXC" */
+#define SCANCACHE_VERSION	4
+
+/* Marker of NULL string in file */
+#define SCANCACHE_NOSTR		0xFFFFFFFFU
+
+/* Cached config section */
+struct scancache_item_t {
+	char *label;
+	char *kernelpath;
+	char *cmdline;
+	char *initrd;
+	char *iconpath;
+	int is_default;
+	int priority;
+#ifdef USE_INITRD_COMPOSE
+	struct charlist *overlays;
+	char *bootdev;
+#endif
+#ifdef USE_ICONS
+	kx_picture *icon;
+#endif
+};
+
+/* Cached device */
+struct scancache_entry_t {
+	int major, minor;				/* Device numbers */
+	unsigned long long blocks;		/* Device size */
+	unsigned long long fingerprint;	/* Superblock fingerprint */
+	char *fstype;					/* Filesystem */
+	int icons;						/* Icons were loaded */
+	int used;						/* Entry was used in this run (-1 - device is gone) */
+
+	int timeout;					/* Global cfgdata values */
+	int ui;
+	int debug;
+#ifdef USE_FAST_REBOOT
+	int fast_reboot;
+#endif
+#ifdef USE_HEADLESS
+	int autoboot;
+#endif
+
+	unsigned int count;				/* Sections count (0 - nothing to boot) */
+	struct scancache_item_t *items;	/* Sections */
+};
+
+/* Cache contents */
+static struct scancache_entry_t **entries = NULL;
+static unsigned int size = 0;		/* Allocated entries count */
+static unsigned int fill = 0;		/* Used entries count */
+static int loaded = 0;				/* File is loaded already */
+static int dirty = 0;				/* Cache should be saved */
+
+/* Statistics of current scan */
+static unsigned int hits = 0;
+static unsigned int misses = 0;
+static unsigned int uncached = 0;
+
+
+#ifdef USE_ICONS
+static kx_picture *copy_picture(const kx_picture *pic)
+{
+	kx_picture *p;
+	size_t len;
+
+	if (NULL == pic) return NULL;
+
+	p = malloc(sizeof(*p));
+	if (NULL == p) return NULL;
+
+	len = pic->width * pic->height * sizeof(*(pic->pixels));
+	p->width = pic->width;
+	p->height = pic->height;
+	p->pixels = malloc(len);
+	if (NULL == p->pixels) {
+		free(p);
+		return NULL;
+	}
+	memcpy(p->pixels, pic->pixels, len);
+
+	return p;
+}
+#endif
+
+
+static char *copy_str(const char *s)
+{
+	return (NULL == s) ? NULL : strdup(s);
+}
+
+
+#ifdef USE_INITRD_COMPOSE
+static struct charlist *copy_list(const struct charlist *cl)
+{
+	struct charlist *p;
+	unsigned int i;
+
+	if (NULL == cl) return NULL;
+
+	p = create_charlist(cl->fill + 1);
+	for (i = 0; i < cl->fill; i++) addto_charlist(p, cl->list[i]);
+
+	return p;
+}
+#endif
+
+
+static void free_entry(struct scancache_entry_t *e)
+{
+	unsigned int i;
+
+	for (i = 0; i < e->count; i++) {
+		dispose(e->items[i].label);
+		dispose(e->items[i].kernelpath);
+		dispose(e->items[i].cmdline);
+		dispose(e->items[i].initrd);
+		dispose(e->items[i].iconpath);
+#ifdef USE_INITRD_COMPOSE
+		if (e->items[i].overlays) free_charlist(e->items[i].overlays);
+		dispose(e->items[i].bootdev);
+#endif
+#ifdef USE_ICONS
+		fb_destroy_picture(e->items[i].icon);
+#endif
+	}
+	dispose(e->items);
+	dispose(e->fstype);
+	free(e);
+}
+
+
+/* Find entry by device numbers. Should be called with cache locked */
+static int find_entry(int major, int minor)
+{
+	unsigned int i;
+
+	for (i = 0; i < fill; i++) {
+		if (entries[i]->major == major && entries[i]->minor == minor)
+			return i;
+	}
+	return -1;
+}
+
+
+/* Return 1 when device of entry is still present in system */
+static int entry_present(struct scancache_entry_t *e)
+{
+	char path[48];
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%d:%d", e->major, e->minor);
+	return (0 == access(path, F_OK));
+}
+
+
+/* Add entry to cache. Should be called with cache locked */
+static int add_entry(struct scancache_entry_t *e)
+{
+	if (fill >= size) {
+		struct scancache_entry_t **new_list;
+		unsigned int new_size;
+
+		new_size = size ? size * 2 : 8;
+		new_list = realloc(entries, new_size * sizeof(*entries));
+		if (NULL == new_list) {
+			DPRINTF("Can't resize scan cache");
+			return -1;
+		}
+
+		size = new_size;
+		entries = new_list;
+	}
+
+	entries[fill++] = e;
+	return 0;
+}
+
+
+/*
+ * File I/O helpers. Cache file is private to this machine
+ * so values are stored in native byte order.
+ */
+static int put_u32(FILE *f, uint32_t v)
+{
+	return (1 == fwrite(&v, sizeof(v), 1, f)) ? 0 : -1;
+}
+
+static int put_u64(FILE *f, uint64_t v)
+{
+	return (1 == fwrite(&v, sizeof(v), 1, f)) ? 0 : -1;
+}
+
+static int put_str(FILE *f, const char *s)
+{
+	uint32_t len;
+
+	if (NULL == s) return put_u32(f, SCANCACHE_NOSTR);
+
+	len = strlen(s);
+	if (-1 == put_u32(f, len)) return -1;
+	return (len == fwrite(s, 1, len, f)) ? 0 : -1;
+}
+
+static int get_u32(FILE *f, uint32_t *v)
+{
+	return (1 == fread(v, sizeof(*v), 1, f)) ? 0 : -1;
+}
+
+static int get_u64(FILE *f, uint64_t *v)
+{
+	return (1 == fread(v, sizeof(*v), 1, f)) ? 0 : -1;
+}
+
+static int get_int(FILE *f, int *v)
+{
+	uint32_t u;
+
+	if (-1 == get_u32(f, &u)) return -1;
+	*v = (int)u;
+	return 0;
+}
+
+static int get_str(FILE *f, char **s)
+{
+	uint32_t len;
+	char *p;
+
+	*s = NULL;
+	if (-1 == get_u32(f, &len)) return -1;
+	if (SCANCACHE_NOSTR == len) return 0;
+	if (len > 4096) return -1;	/* NOTE: hardcoded sanity limit */
+
+	p = malloc(len + 1);
+	if (NULL == p) return -1;
+
+	if (len != fread(p, 1, len, f)) {
+		free(p);
+		return -1;
+	}
+	p[len] = '\0';
+
+	*s = p;
+	return 0;
+}
+
+
+#ifdef USE_INITRD_COMPOSE
+/* List is stored as strings count (0 - NULL list) and strings */
+static int put_list(FILE *f, const struct charlist *cl)
+{
+	unsigned int i;
+
+	if (NULL == cl) return put_u32(f, 0);
+
+	if (-1 == put_u32(f, cl->fill)) return -1;
+	for (i = 0; i < cl->fill; i++)
+		if (-1 == put_str(f, cl->list[i])) return -1;
+
+	return 0;
+}
+
+static int get_list(FILE *f, struct charlist **cl)
+{
+	uint32_t count;
+	char *s;
+
+	*cl = NULL;
+	if (-1 == get_u32(f, &count)) return -1;
+	if (0 == count) return 0;
+	if (count > 64) return -1;	/* NOTE: hardcoded sanity limit */
+
+	*cl = create_charlist(count + 1);
+	while (count--) {
+		if (-1 == get_str(f, &s) || NULL == s) return -1;
+		addto_charlist(*cl, s);
+		free(s);
+	}
+
+	return 0;
+}
+#endif
+#ifdef USE_ICONS
+static int put_picture(FILE *f, const kx_picture *pic)
+{
+	size_t n;
+
+	if (NULL == pic) return put_u32(f, 0);
+
+	n = pic->width * pic->height;
+	if (-1 == put_u32(f, pic->width)) return -1;
+	if (-1 == put_u32(f, pic->height)) return -1;
+	return (n == fwrite(pic->pixels, sizeof(*(pic->pixels)), n, f)) ? 0 : -1;
+}
+
+static int get_picture(FILE *f, kx_picture **pic)
+{
+	kx_picture *p;
+	uint32_t width, height;
+	size_t n;
+
+	*pic = NULL;
+	if (-1 == get_u32(f, &width)) return -1;
+	if (0 == width) return 0;
+	if (-1 == get_u32(f, &height)) return -1;
+	if (width > 1024 || height > 1024) return -1;	/* NOTE: sanity limit */
+
+	p = malloc(sizeof(*p));
+	if (NULL == p) return -1;
+
+	n = width * height;
+	p->width = width;
+	p->height = height;
+	p->pixels = malloc(n * sizeof(*(p->pixels)));
+	if (NULL == p->pixels) {
+		free(p);
+		return -1;
+	}
+
+	if (n != fread(p->pixels, sizeof(*(p->pixels)), n, f)) {
+		fb_destroy_picture(p);
+		return -1;
+	}
+
+	*pic = p;
+	return 0;
+}
+#endif
+
+
+static struct scancache_entry_t *read_entry(FILE *f)
+{
+	struct scancache_entry_t *e;
+	struct scancache_item_t *it;
+	uint64_t v;
+	uint32_t count;
+	unsigned int i;
+
+	e = malloc(sizeof(*e));
+	if (NULL == e) return NULL;
+	memset(e, 0, sizeof(*e));
+
+	if (-1 == get_int(f, &e->major)) goto fail;
+	if (-1 == get_int(f, &e->minor)) goto fail;
+	if (-1 == get_u64(f, &v)) goto fail;
+	e->blocks = v;
+	if (-1 == get_u64(f, &v)) goto fail;
+	e->fingerprint = v;
+	if (-1 == get_str(f, &e->fstype) || NULL == e->fstype) goto fail;
+	if (-1 == get_int(f, &e->icons)) goto fail;
+	if (-1 == get_int(f, &e->timeout)) goto fail;
+	if (-1 == get_int(f, &e->ui)) goto fail;
+	if (-1 == get_int(f, &e->debug)) goto fail;
+#ifdef USE_FAST_REBOOT
+	if (-1 == get_int(f, &e->fast_reboot)) goto fail;
+#endif
+#ifdef USE_HEADLESS
+	if (-1 == get_int(f, &e->autoboot)) goto fail;
+#endif
+	if (-1 == get_u32(f, &count)) goto fail;
+	if (count > 256) goto fail;	/* NOTE: sanity limit */
+
+	if (0 == count) return e;
+
+	e->items = malloc(count * sizeof(*(e->items)));
+	if (NULL == e->items) goto fail;
+	memset(e->items, 0, count * sizeof(*(e->items)));
+	e->count = count;
+
+	for (i = 0; i < e->count; i++) {
+		it = &e->items[i];
+		if (-1 == get_str(f, &it->label)) goto fail;
+		if (-1 == get_str(f, &it->kernelpath)) goto fail;
+		if (-1 == get_str(f, &it->cmdline)) goto fail;
+		if (-1 == get_str(f, &it->initrd)) goto fail;
+		if (-1 == get_str(f, &it->iconpath)) goto fail;
+		if (-1 == get_int(f, &it->is_default)) goto fail;
+		if (-1 == get_int(f, &it->priority)) goto fail;
+#ifdef USE_INITRD_COMPOSE
+		if (-1 == get_list(f, &it->overlays)) goto fail;
+		if (-1 == get_str(f, &it->bootdev)) goto fail;
+#endif
+#ifdef USE_ICONS
+		if (-1 == get_picture(f, &it->icon)) goto fail;
+#endif
+	}
+
+	return e;
+
+fail:
+	free_entry(e);
+	return NULL;
+}
+
+
+static int write_entry(FILE *f, struct scancache_entry_t *e)
+{
+	struct scancache_item_t *it;
+	unsigned int i;
+
+	if (-1 == put_u32(f, e->major)) return -1;
+	if (-1 == put_u32(f, e->minor)) return -1;
+	if (-1 == put_u64(f, e->blocks)) return -1;
+	if (-1 == put_u64(f, e->fingerprint)) return -1;
+	if (-1 == put_str(f, e->fstype)) return -1;
+	if (-1 == put_u32(f, e->icons)) return -1;
+	if (-1 == put_u32(f, e->timeout)) return -1;
+	if (-1 == put_u32(f, e->ui)) return -1;
+	if (-1 == put_u32(f, e->debug)) return -1;
+#ifdef USE_FAST_REBOOT
+	if (-1 == put_u32(f, e->fast_reboot)) return -1;
+#endif
+#ifdef USE_HEADLESS
+	if (-1 == put_u32(f, e->autoboot)) return -1;
+#endif
+	if (-1 == put_u32(f, e->count)) return -1;
+
+	for (i = 0; i < e->count; i++) {
+		it = &e->items[i];
+		if (-1 == put_str(f, it->label)) return -1;
+		if (-1 == put_str(f, it->kernelpath)) return -1;
+		if (-1 == put_str(f, it->cmdline)) return -1;
+		if (-1 == put_str(f, it->initrd)) return -1;
+		if (-1 == put_str(f, it->iconpath)) return -1;
+		if (-1 == put_u32(f, it->is_default)) return -1;
+		if (-1 == put_u32(f, it->priority)) return -1;
+#ifdef USE_INITRD_COMPOSE
+		if (-1 == put_list(f, it->overlays)) return -1;
+		if (-1 == put_str(f, it->bootdev)) return -1;
+#endif
+#ifdef USE_ICONS
+		if (-1 == put_picture(f, it->icon)) return -1;
+#endif
+	}
+
+	return 0;
+}
+
+
+/* Load cache file once. Missing or broken file means empty cache */
+int scancache_load(const char *path)
+{
+	struct scancache_entry_t *e;
+	uint32_t magic, version, count;
+	unsigned int i;
+	FILE *f;
+
+	if (loaded) return 0;
+	loaded = 1;
+
+	f = fopen(path, "r");
+	if (NULL == f) {
+		log_msg(lg, "Scan cache %s is not loaded: %s", path, ERRMSG);
+		return -1;
+	}
+
+	if (-1 == get_u32(f, &magic) || -1 == get_u32(f, &version)
+			|| -1 == get_u32(f, &count)
+			|| SCANCACHE_MAGIC != magic || SCANCACHE_VERSION != version
+	) {
+		log_msg(lg, "Scan cache %s has wrong format, ignored", path);
+		fclose(f);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		e = read_entry(f);
+		if (NULL == e) {
+			log_msg(lg, "Scan cache %s is truncated", path);
+			break;
+		}
+
+		if (-1 == add_entry(e)) {
+			free_entry(e);
+			break;
+		}
+	}
+	fclose(f);
+
+	log_msg(lg, "Scan cache: %u device(s) loaded from %s", fill, path);
+	return 0;
+}
+
+
+/* Save cache file when something was changed */
+int scancache_save(const char *path)
+{
+	char *tmppath;
+	unsigned int i, count;
+	int rc = -1;
+	FILE *f;
+
+	if (!dirty) return 0;
+
+	tmppath = malloc(strlen(path) + sizeof(".new"));
+	if (NULL == tmppath) {
+		DPRINTF("Can't allocate memory for cache file name");
+		return -1;
+	}
+	strcpy(tmppath, path);
+	strcat(tmppath, ".new");
+
+	f = fopen(tmppath, "w");
+	if (NULL == f) {
+		log_msg(lg, "Can't create scan cache %s: %s", tmppath, ERRMSG);
+		free(tmppath);
+		return -1;
+	}
+
+	/* Entries of devices gone away are not saved. Devices which were not
+	 * probed in this run (early stop, time budget) keep their entries */
+	for (i = 0, count = 0; i < fill; i++) {
+		if (!entries[i]->used && !entry_present(entries[i]))
+			entries[i]->used = -1;
+		if (entries[i]->used >= 0) ++count;
+	}
+
+	if (-1 == put_u32(f, SCANCACHE_MAGIC) || -1 == put_u32(f, SCANCACHE_VERSION)
+			|| -1 == put_u32(f, count)
+	) goto close;
+
+	for (i = 0; i < fill; i++) {
+		if (entries[i]->used < 0) continue;
+		if (-1 == write_entry(f, entries[i])) goto close;
+	}
+
+	rc = 0;
+
+close:
+	if (0 != fclose(f)) rc = -1;
+
+	if (0 == rc && -1 == rename(tmppath, path)) rc = -1;
+
+	if (0 == rc) {
+		dirty = 0;
+		log_msg(lg, "Scan cache: %u device(s) saved to %s", count, path);
+	} else {
+		log_msg(lg, "Can't save scan cache %s: %s", path, ERRMSG);
+		unlink(tmppath);
+	}
+
+	free(tmppath);
+	return rc;
+}
+
+
+/* Find device in cache */
+int scancache_lookup(struct device_t *dev, int icons,
+		struct cfgdata_t *cfgdata)
+{
+	struct scancache_entry_t *e;
+	struct scancache_item_t *it;
+	kx_cfg_section *sc;
+	unsigned int i;
+	int n;
+
+	CACHE_LOCK();
+
+	if (0 == dev->fingerprint) {
+		/* Filesystem changes can't be noticed. Don't cache it */
+		++uncached;
+		CACHE_UNLOCK();
+		return -1;
+	}
+
+	n = find_entry(dev->major, dev->minor);
+	if (n < 0) goto miss;
+
+	e = entries[n];
+	if (e->fingerprint != dev->fingerprint || e->blocks != dev->blocks
+			|| strcmp(e->fstype, dev->fstype)
+			|| (icons && !e->icons)
+	) goto miss;
+
+	init_cfgdata(cfgdata);
+	if (NULL == cfgdata->list) goto miss;
+
+	cfgdata->timeout = e->timeout;
+	cfgdata->ui = e->ui;
+	cfgdata->debug = e->debug;
+#ifdef USE_FAST_REBOOT
+	cfgdata->fast_reboot = e->fast_reboot;
+#endif
+#ifdef USE_HEADLESS
+	cfgdata->autoboot = e->autoboot;
+#endif
+
+	for (i = 0; i < e->count; i++) {
+		it = &e->items[i];
+
+		sc = cfg_section_new(cfgdata);
+		if (NULL == sc) {
+			destroy_cfgdata(cfgdata);
+			cfgdata->list = NULL;
+			goto miss;
+		}
+
+		sc->label = copy_str(it->label);
+		sc->kernelpath = copy_str(it->kernelpath);
+		sc->cmdline = copy_str(it->cmdline);
+		sc->initrd = copy_str(it->initrd);
+		sc->iconpath = copy_str(it->iconpath);
+		sc->is_default = it->is_default;
+		sc->priority = it->priority;
+#ifdef USE_INITRD_COMPOSE
+		sc->overlays = copy_list(it->overlays);
+		sc->bootdev = copy_str(it->bootdev);
+#endif
+#ifdef USE_ICONS
+		if (icons) sc->icondata = copy_picture(it->icon);
+#endif
+	}
+
+	e->used = 1;
+	++hits;
+	CACHE_UNLOCK();
+
+	log_msg(lg, "+ %s is unchanged, %d section(s) taken from scan cache",
+			dev->device, cfgdata->count);
+	return 0;
+
+miss:
+	++misses;
+	CACHE_UNLOCK();
+	return -1;
+}
+
+
+/* Remember probing result of device */
+void scancache_store(struct device_t *dev, int icons,
+		struct cfgdata_t *cfgdata)
+{
+	struct scancache_entry_t *e;
+	struct scancache_item_t *it;
+	kx_cfg_section *sc;
+	unsigned int i;
+	int n;
+
+	if (0 == dev->fingerprint) return;
+
+	e = malloc(sizeof(*e));
+	if (NULL == e) {
+		DPRINTF("Can't allocate scan cache entry");
+		return;
+	}
+	memset(e, 0, sizeof(*e));
+
+	e->major = dev->major;
+	e->minor = dev->minor;
+	e->blocks = dev->blocks;
+	e->fingerprint = dev->fingerprint;
+	e->fstype = strdup(dev->fstype);
+	e->icons = icons;
+	e->used = 1;
+
+	if (NULL == e->fstype) goto fail;
+
+	if (cfgdata && cfgdata->count > 0) {
+		e->timeout = cfgdata->timeout;
+		e->ui = cfgdata->ui;
+		e->debug = cfgdata->debug;
+#ifdef USE_FAST_REBOOT
+		e->fast_reboot = cfgdata->fast_reboot;
+#endif
+#ifdef USE_HEADLESS
+		e->autoboot = cfgdata->autoboot;
+#endif
+
+		e->items = malloc(cfgdata->count * sizeof(*(e->items)));
+		if (NULL == e->items) goto fail;
+		memset(e->items, 0, cfgdata->count * sizeof(*(e->items)));
+
+		for (i = 0; i < cfgdata->count; i++) {
+			sc = cfgdata->list[i];
+			if (!sc) continue;
+
+			it = &e->items[e->count++];
+			it->label = copy_str(sc->label);
+			it->kernelpath = copy_str(sc->kernelpath);
+			it->cmdline = copy_str(sc->cmdline);
+			it->initrd = copy_str(sc->initrd);
+			it->iconpath = copy_str(sc->iconpath);
+			it->is_default = sc->is_default;
+			it->priority = sc->priority;
+#ifdef USE_INITRD_COMPOSE
+			it->overlays = copy_list(sc->overlays);
+			it->bootdev = copy_str(sc->bootdev);
+#endif
+#ifdef USE_ICONS
+			it->icon = copy_picture(sc->icondata);
+#endif
+		}
+	}
+
+	CACHE_LOCK();
+	n = find_entry(dev->major, dev->minor);
+	if (n >= 0) {
+		free_entry(entries[n]);
+		entries[n] = e;
+	} else if (-1 == add_entry(e)) {
+		CACHE_UNLOCK();
+		goto fail;
+	}
+	dirty = 1;
+	CACHE_UNLOCK();
+	return;
+
+fail:
+	free_entry(e);
+}
+
+
+#ifdef USE_HEADLESS
+/* Find cached device with default item and AUTOBOOT */
+int scancache_autoboot(const char *path)
+{
+	unsigned int i, j;
+	int rc = 0;
+
+	scancache_load(path);
+
+	CACHE_LOCK();
+	for (i = 0; i < fill && !rc; i++) {
+		if (!entries[i]->autoboot) continue;
+		for (j = 0; j < entries[i]->count; j++) {
+			if (entries[i]->items[j].is_default) rc = 1;
+		}
+	}
+	CACHE_UNLOCK();
+
+	return rc;
+}
+#endif
+
+
+/* Log and reset hit/miss counters */
+void scancache_report(void)
+{
+	log_msg(lg, "Scan cache: %u hit(s), %u miss(es), %u uncacheable",
+			hits, misses, uncached);
+	hits = 0;
+	misses = 0;
+	uncached = 0;
+}
+
+#endif	/* USE_SCAN_CACHE */
@@ -0,0 +1,58 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_SCANCACHE_H_
+#define _HAVE_SCANCACHE_H_
+
+#include "config.h"
+#include "devicescan.h"
+#include "cfgparser.h"
+
+/*
+ * Cache of device probing results.
+ * Entries are keyed by device numbers and superblock fingerprint
+ * so devices with unchanged filesystems are not mounted again.
+ * Cache file is useful only on storage which survives reboot.
+ */
+
+/* Load cache file once. Missing or broken file means empty cache */
+int scancache_load(const char *path);
+
+/* Save cache file when something was changed */
+int scancache_save(const char *path);
+
+/* Find device in cache. Return 0 and fill cfgdata on hit or -1 on miss.
+ * Hit with cfgdata->count == 0 means that device has nothing to boot.
+ * 'icons' should be set when custom icons are required */
+int scancache_lookup(struct device_t *dev, int icons,
+		struct cfgdata_t *cfgdata);
+
+/* Remember probing result of device (cfgdata may be NULL when
+ * nothing was found). 'icons' should be set when icons were loaded */
+void scancache_store(struct device_t *dev, int icons,
+		struct cfgdata_t *cfgdata);
+
+#ifdef USE_HEADLESS
+/* Return 1 when some cached device has default item and asks to boot
+ * it without menu (AUTOBOOT) */
+int scancache_autoboot(const char *path);
+#endif
+
+/* Log and reset hit/miss counters */
+void scancache_report(void);
+
+#endif /* _HAVE_SCANCACHE_H_ */
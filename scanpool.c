@@ -0,0 +1,559 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "config.h"
+#include "util.h"
+#include "scanpool.h"
+
+/* Private mountpoint of every worker thread (MOUNTPOINT/.scanN) */
+#define SCAN_MOUNTPOINT_FMT	MOUNTPOINT "/.scan%u"
+
+#ifdef USE_SCAN_THREADS
+/* Worker thread arguments */
+struct scan_worker_t {
+	kx_scanpool *pool;
+	char mountpoint[sizeof(SCAN_MOUNTPOINT_FMT) + 8];
+};
+
+static void *scanpool_worker(void *arg);
+
+
+/* Start new worker thread. Should be called with pool locked
+ * (or before pool is shared) */
+static int scanpool_spawn(kx_scanpool *pool, pthread_t *thread)
+{
+	struct scan_worker_t *w;
+
+	w = malloc(sizeof(*w));
+	if (NULL == w) return -1;
+
+	w->pool = pool;
+	snprintf(w->mountpoint, sizeof(w->mountpoint),
+			SCAN_MOUNTPOINT_FMT, pool->spawned++);
+
+	/* Create private mountpoint. We don't care about result */
+	mkdir(w->mountpoint, 0755);
+
+	if (0 != pthread_create(thread, NULL, scanpool_worker, w)) {
+		log_msg(lg, "Can't create scan thread: %s", ERRMSG);
+		free(w);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+
+/* Create pool of 'workers' probing threads */
+kx_scanpool *scanpool_create(unsigned int workers, kx_probe_func probe,
+		void *data, int notify_fd)
+{
+	kx_scanpool *pool;
+#ifdef USE_SCAN_THREADS
+	pthread_condattr_t attr;
+#endif
+
+	pool = malloc(sizeof(*pool));
+	if (NULL == pool) {
+		DPRINTF("Can't allocate scan pool");
+		return NULL;
+	}
+
+	pool->size = 8;		/* NOTE: hardcoded value */
+	pool->jobs = malloc(pool->size * sizeof(*(pool->jobs)));
+	if (NULL == pool->jobs) {
+		DPRINTF("Can't allocate scan jobs array");
+		free(pool);
+		return NULL;
+	}
+
+	pool->count = 0;
+	pool->next = 0;
+	pool->finished = 0;
+	pool->taken = 0;
+	pool->closed = 0;
+	pool->probe = probe;
+	pool->data = data;
+	pool->notify_fd = notify_fd;
+	pool->timeout = 0;
+	pool->deadline = 0;
+	pool->abandoned = 0;
+	pool->orphaned = 0;
+	pool->spawned = 0;
+	pool->workers = 0;
+
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_init(&pool->lock, NULL);
+
+	/* scanpool_wait() counts time by monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pool->threads = malloc(workers * sizeof(*(pool->threads)));
+	if (NULL == pool->threads) {
+		DPRINTF("Can't allocate scan threads array");
+		return pool;	/* We still can probe in caller */
+	}
+
+	for (; pool->workers < workers; pool->workers++) {
+		if (-1 == scanpool_spawn(pool, &pool->threads[pool->workers]))
+			break;
+	}
+
+	log_msg(lg, "Probing devices with %u thread(s)", pool->workers);
+#endif
+
+	return pool;
+}
+
+
+void scanpool_set_limits(kx_scanpool *pool, unsigned int timeout,
+		unsigned long long deadline)
+{
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+	pool->timeout = timeout;
+	pool->deadline = deadline;
+#ifdef USE_SCAN_THREADS
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+
+/* Take next queued job or return NULL when there is nothing to do.
+ * Should be called with pool locked */
+static kx_scan_job *scanpool_take(kx_scanpool *pool)
+{
+	kx_scan_job *job;
+
+	if (pool->next >= pool->count) return NULL;
+
+	job = pool->jobs[pool->next++];
+	job->state = SJ_RUNNING;
+	job->started = msec_now();
+	return job;
+}
+
+
+/* Give up queued jobs. Should be called with pool locked */
+static void scanpool_drop(kx_scanpool *pool)
+{
+	for (; pool->next < pool->count; pool->next++) {
+		pool->jobs[pool->next]->state = SJ_ABANDONED;
+		++pool->finished;
+		++pool->taken;
+	}
+}
+
+
+/* Run probe function on job */
+static void scanpool_probe(kx_scanpool *pool, kx_scan_job *job,
+		const char *mountpoint)
+{
+	job->rc = pool->probe(job, mountpoint, pool->data);
+}
+
+
+/* Free pool with all jobs */
+static void scanpool_free(kx_scanpool *pool)
+{
+	unsigned int i;
+
+#ifdef USE_SCAN_THREADS
+	dispose(pool->threads);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+#endif
+
+	for (i = 0; i < pool->count; i++) {
+		if (pool->jobs[i]->cfgdata.list)
+			destroy_cfgdata(&pool->jobs[i]->cfgdata);
+		dispose(pool->jobs[i]->dev.device);
+		free(pool->jobs[i]);
+	}
+	free(pool->jobs);
+	free(pool);
+}
+
+
+#ifdef USE_SCAN_THREADS
+/* Worker thread: probe jobs until pool is closed and drained */
+static void *scanpool_worker(void *arg)
+{
+	struct scan_worker_t *w = arg;
+	kx_scanpool *pool = w->pool;
+	kx_scan_job *job;
+	int last;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		job = scanpool_take(pool);
+		if (NULL == job) {
+			if (pool->closed) break;
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+		job->thread = pthread_self();
+
+		pthread_mutex_unlock(&pool->lock);
+		scanpool_probe(pool, job, w->mountpoint);
+		pthread_mutex_lock(&pool->lock);
+
+		/* We are replaced already. Result is not needed anymore */
+		if (SJ_ABANDONED == job->state) {
+			log_msg(lg, "Abandoned probe of %s is finished", job->dev.device);
+			--pool->abandoned;
+			break;
+		}
+
+		job->state = SJ_DONE;
+		++pool->finished;
+		if (job->rc > 0) scanpool_drop(pool);
+		pthread_cond_broadcast(&pool->cond);
+
+		/* Wake up event loop. Full pipe is woken already */
+		if (pool->notify_fd >= 0) write(pool->notify_fd, "", 1);
+	}
+	last = pool->orphaned && (0 == pool->abandoned);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (last) scanpool_free(pool);
+
+	free(w);
+	return NULL;
+}
+
+
+/* Leave running job to its worker and start new worker instead
+ * unless 'replace' is 0. Should be called with pool locked */
+static void scanpool_abandon(kx_scanpool *pool, kx_scan_job *job, int replace)
+{
+	unsigned int i;
+
+	job->state = SJ_ABANDONED;
+	++pool->finished;
+	++pool->taken;
+	++pool->abandoned;
+
+	for (i = 0; i < pool->workers; i++) {
+		if (pthread_equal(pool->threads[i], job->thread)) break;
+	}
+	if (i >= pool->workers) return;	/* Should not happen */
+
+	pthread_detach(pool->threads[i]);
+	if (replace && (0 == scanpool_spawn(pool, &pool->threads[i]))) return;
+
+	pool->threads[i] = pool->threads[--pool->workers];
+}
+#endif
+
+
+/* Give up jobs which are out of time. Return ms to next check or -1.
+ * Should be called with pool locked */
+static int scanpool_expire_locked(kx_scanpool *pool)
+{
+	unsigned long long now, end, next = 0;
+	kx_scan_job *job;
+	unsigned int i;
+	int all;
+
+	if ((0 == pool->timeout) && (0 == pool->deadline)) return -1;
+
+	now = msec_now();
+	all = pool->deadline && (now >= pool->deadline);
+	if (all) {
+		if (pool->finished < pool->count)
+			log_msg(lg, "Scan time budget is spent, giving up probing");
+		scanpool_drop(pool);
+	}
+
+	for (i = 0; i < pool->next; i++) {
+		job = pool->jobs[i];
+		if (SJ_RUNNING != job->state) continue;
+
+		end = pool->timeout ? job->started + pool->timeout : 0;
+		if (!all && (0 == end || now < end)) {
+			if (end && (0 == next || end < next)) next = end;
+			continue;
+		}
+
+		log_msg(lg, "Probe of %s takes too long, abandoning it",
+				job->dev.device);
+#ifdef USE_SCAN_THREADS
+		scanpool_abandon(pool, job, !all);
+#endif
+	}
+
+	if (all) {
+#ifdef USE_SCAN_THREADS
+		pthread_cond_broadcast(&pool->cond);
+#endif
+		return -1;
+	}
+
+	/* Jobs started later will expire after full timeout */
+	if (0 == next && pool->timeout) next = now + pool->timeout;
+	if (pool->deadline && (0 == next || pool->deadline < next))
+		next = pool->deadline;
+
+#ifdef USE_SCAN_THREADS
+	pthread_cond_broadcast(&pool->cond);
+#endif
+	return next - now;
+}
+
+
+int scanpool_expire(kx_scanpool *pool)
+{
+	int rc;
+
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+	rc = scanpool_expire_locked(pool);
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return rc;
+}
+
+
+/* Queue device for probing. Device is moved into job */
+kx_scan_job *scanpool_add(kx_scanpool *pool, struct device_t *dev)
+{
+	kx_scan_job *job;
+
+	job = malloc(sizeof(*job));
+	if (NULL == job) {
+		DPRINTF("Can't allocate scan job");
+		return NULL;
+	}
+
+	job->state = SJ_QUEUED;
+	job->rc = -1;
+	job->dev = *dev;
+	job->cfgdata.list = NULL;
+	job->started = 0;
+
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+
+	/* Resize list when needed before adding item */
+	if (pool->count >= pool->size) {
+		kx_scan_job **new_list;
+		unsigned int new_size;
+
+		new_size = pool->size * 2;
+		new_list = realloc(pool->jobs, new_size * sizeof(*(pool->jobs)));
+		if (NULL == new_list) {
+			DPRINTF("Can't resize scan jobs list");
+#ifdef USE_SCAN_THREADS
+			pthread_mutex_unlock(&pool->lock);
+#endif
+			free(job);
+			return NULL;
+		}
+
+		pool->size = new_size;
+		pool->jobs = new_list;
+	}
+
+	job->no = pool->count;
+	pool->jobs[pool->count++] = job;
+
+#ifdef USE_SCAN_THREADS
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return job;
+}
+
+
+/* Tell workers that no more jobs will be queued */
+void scanpool_close(kx_scanpool *pool)
+{
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&pool->lock);
+	pool->closed = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+#else
+	pool->closed = 1;
+#endif
+}
+
+
+/* Wait until all queued jobs are done */
+void scanpool_wait(kx_scanpool *pool)
+{
+	kx_scan_job *job;
+#ifdef USE_SCAN_THREADS
+	struct timespec ts;
+	int ms;
+#endif
+
+	if (0 == pool->workers) {
+		/* No threads. Probe jobs right here in device order.
+		 * Hung probe can't be abandoned but budget is still honoured */
+		for (;;) {
+			scanpool_expire_locked(pool);
+			job = scanpool_take(pool);
+			if (NULL == job) break;
+
+			scanpool_probe(pool, job, MOUNTPOINT);
+			job->state = SJ_DONE;
+			++pool->finished;
+			if (job->rc > 0) scanpool_drop(pool);
+		}
+		return;
+	}
+
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&pool->lock);
+	while (pool->finished < pool->count) {
+		ms = scanpool_expire_locked(pool);
+		if (pool->finished >= pool->count) break;
+
+		if (ms < 0) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += ms / 1000;
+		ts.tv_nsec += (ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			++ts.tv_sec;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+	}
+	pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+
+/* Take finished job with lowest index or return NULL */
+kx_scan_job *scanpool_collect(kx_scanpool *pool)
+{
+	kx_scan_job *job = NULL;
+	unsigned int i;
+
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+	for (i = 0; i < pool->next; i++) {
+		if (SJ_DONE == pool->jobs[i]->state) {
+			job = pool->jobs[i];
+			job->state = SJ_TAKEN;
+			++pool->taken;
+			break;
+		}
+	}
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return job;
+}
+
+
+/* Return count of jobs which are not collected yet */
+unsigned int scanpool_pending(kx_scanpool *pool)
+{
+	unsigned int n;
+
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+	n = pool->count - pool->taken;
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return n;
+}
+
+
+/* Drop queued jobs. Running jobs will be finished */
+void scanpool_cancel(kx_scanpool *pool)
+{
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+	scanpool_drop(pool);
+	pool->closed = 1;
+#ifdef USE_SCAN_THREADS
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+
+/* Stop workers and free pool with all jobs */
+void scanpool_destroy(kx_scanpool *pool)
+{
+#ifdef USE_SCAN_THREADS
+	unsigned int i;
+#endif
+
+	if (NULL == pool) return;
+
+	scanpool_close(pool);
+
+#ifdef USE_SCAN_THREADS
+	/* Don't wait for running probes. Hung device would stall us */
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->next; i++) {
+		if (SJ_RUNNING == pool->jobs[i]->state)
+			scanpool_abandon(pool, pool->jobs[i], 0);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->workers; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	/* Abandoned workers still use pool. Last of them will free it */
+	pthread_mutex_lock(&pool->lock);
+	if (pool->abandoned > 0) {
+		pool->orphaned = 1;
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	scanpool_free(pool);
+}
@@ -0,0 +1,125 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_SCANPOOL_H_
+#define _HAVE_SCANPOOL_H_
+
+#include "config.h"
+
+#ifdef USE_SCAN_THREADS
+#include <pthread.h>
+#endif
+
+#include "devicescan.h"
+#include "cfgparser.h"
+
+/* Job states */
+enum scan_state_t {
+	SJ_QUEUED,		/* Waiting for worker */
+	SJ_RUNNING,		/* Probing now */
+	SJ_DONE,		/* Probe is finished */
+	SJ_TAKEN,		/* Result is taken by scanpool_collect() */
+	SJ_ABANDONED	/* Given up by timeout. Worker may be still running */
+};
+
+/* Probe job structure */
+typedef struct {
+	unsigned int no;			/* Job number (device ordering) */
+	enum scan_state_t state;	/* Job state */
+	int rc;						/* Probe result (>= 0 - cfgdata is filled) */
+	struct device_t dev;		/* Device to probe */
+	struct cfgdata_t cfgdata;	/* Config found on device */
+	unsigned long long started;	/* msec_now() when probe is started */
+#ifdef USE_SCAN_THREADS
+	pthread_t thread;			/* Worker probing this job */
+#endif
+} kx_scan_job;
+
+/* Probe function. Called from worker with private mountpoint.
+ * Should return 0 when job->cfgdata is filled, 1 when it is filled
+ * and other queued jobs are not needed anymore or -1 on error */
+typedef int (*kx_probe_func)(kx_scan_job *job, const char *mountpoint,
+		void *data);
+
+/* Probing pool structure */
+typedef struct {
+	unsigned int size;			/* Allocated jobs count */
+	unsigned int count;			/* Queued jobs count */
+	unsigned int next;			/* Next job to hand out to worker */
+	unsigned int finished;		/* Finished jobs count */
+	unsigned int taken;			/* Collected jobs count */
+	int closed;					/* No more jobs will be added */
+	kx_scan_job **jobs;			/* Jobs array */
+
+	kx_probe_func probe;		/* Probe function */
+	void *data;					/* Probe function data */
+	int notify_fd;				/* Byte is written here on every finished job */
+
+	unsigned int timeout;		/* Probe time limit, ms (0 - no limit) */
+	unsigned long long deadline;	/* msec_now() of giving up all jobs (0 - never) */
+	unsigned int abandoned;		/* Workers still running abandoned jobs */
+	int orphaned;				/* Pool is destroyed. Last abandoned worker frees it */
+	unsigned int spawned;		/* Workers ever started (mountpoint numbers) */
+
+	unsigned int workers;		/* Workers count (0 - probe in caller) */
+#ifdef USE_SCAN_THREADS
+	pthread_t *threads;			/* Worker threads */
+	pthread_mutex_t lock;		/* Protects everything above */
+	pthread_cond_t cond;		/* Signalled on queue changes */
+#endif
+} kx_scanpool;
+
+
+/* Create pool of 'workers' probing threads.
+ * notify_fd (if not -1) is written when some job is finished */
+kx_scanpool *scanpool_create(unsigned int workers, kx_probe_func probe,
+		void *data, int notify_fd);
+
+/* Limit probing time of every job by 'timeout' ms and all jobs by
+ * 'deadline' (msec_now() value). Zero means no limit.
+ * Hung workers are left behind and replaced by new ones */
+void scanpool_set_limits(kx_scanpool *pool, unsigned int timeout,
+		unsigned long long deadline);
+
+/* Give up jobs which are out of time. Return ms until next check
+ * should be done or -1 when there are no limits */
+int scanpool_expire(kx_scanpool *pool);
+
+/* Queue device for probing. Device is moved into job */
+kx_scan_job *scanpool_add(kx_scanpool *pool, struct device_t *dev);
+
+/* Tell workers that no more jobs will be queued */
+void scanpool_close(kx_scanpool *pool);
+
+/* Wait until all queued jobs are done or given up by limits.
+ * Pool should be closed before */
+void scanpool_wait(kx_scanpool *pool);
+
+/* Take finished job with lowest index or return NULL. Jobs are
+ * returned in queueing order among ones finished by now */
+kx_scan_job *scanpool_collect(kx_scanpool *pool);
+
+/* Return count of jobs which are not collected yet */
+unsigned int scanpool_pending(kx_scanpool *pool);
+
+/* Drop queued jobs. Running jobs will be finished */
+void scanpool_cancel(kx_scanpool *pool);
+
+/* Stop workers and free pool with all jobs. Running jobs are abandoned */
+void scanpool_destroy(kx_scanpool *pool);
+
+#endif /* _HAVE_SCANPOOL_H_ */
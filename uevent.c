@@ -0,0 +1,125 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#ifdef USE_UEVENTS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "util.h"
+#include "uevent.h"
+
+/* Kernel events multicast group */
+#define UEVENT_GROUP_KERNEL	1
+
+/* Open kernel uevent netlink socket */
+int uevent_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		log_msg(lg, "Can't open uevent socket: %s", ERRMSG);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0;	/* Let kernel choose */
+	addr.nl_groups = UEVENT_GROUP_KERNEL;
+
+	if (-1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		log_msg(lg, "Can't bind uevent socket: %s", ERRMSG);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/* Read one pending event from socket */
+int uevent_read(int fd, struct uevent_t *ev)
+{
+	struct sockaddr_nl addr;
+	struct iovec iov;
+	struct msghdr msg;
+	char buf[2048];
+	char *p, *end;
+	int len, is_block = 0;
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf) - 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	len = recvmsg(fd, &msg, 0);
+	if (len < 0) {
+		if (EAGAIN != errno && EINTR != errno)
+			log_msg(lg, "Can't read uevent: %s", ERRMSG);
+		return -1;
+	}
+
+	/* Trust kernel messages only */
+	if (0 != addr.nl_pid) return 0;
+
+	buf[len] = '\0';
+	end = buf + len;
+
+	ev->action = UE_OTHER;
+	ev->name[0] = '\0';
+	ev->major = -1;
+	ev->minor = -1;
+
+	/* Message is 'action@devpath' header and KEY=value strings.
+	 * All parts are zero-terminated */
+	for (p = buf + strlen(buf) + 1; p < end; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7)) {
+			if (!strcmp(p + 7, "add")) ev->action = UE_ADD;
+			else if (!strcmp(p + 7, "remove")) ev->action = UE_REMOVE;
+		} else if (!strncmp(p, "SUBSYSTEM=", 10)) {
+			is_block = !strcmp(p + 10, "block");
+		} else if (!strncmp(p, "DEVNAME=", 8)) {
+			strncpy(ev->name, p + 8, sizeof(ev->name) - 1);
+			ev->name[sizeof(ev->name) - 1] = '\0';
+		} else if (!strncmp(p, "MAJOR=", 6)) {
+			ev->major = atoi(p + 6);
+		} else if (!strncmp(p, "MINOR=", 6)) {
+			ev->minor = atoi(p + 6);
+		}
+	}
+
+	if (!is_block || '\0' == ev->name[0] || UE_OTHER == ev->action)
+		return 0;
+
+	return 1;
+}
+
+#endif	/* USE_UEVENTS */
@@ -0,0 +1,44 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_UEVENT_H_
+#define _HAVE_UEVENT_H_
+
+#include "config.h"
+
+enum uevent_action_t {
+	UE_OTHER,
+	UE_ADD,
+	UE_REMOVE
+};
+
+/* Block device event */
+struct uevent_t {
+	enum uevent_action_t action;	/* What is happened */
+	char name[32];					/* Kernel device name (sda1) */
+	int major, minor;				/* Device numbers */
+};
+
+/* Open kernel uevent netlink socket. Return socket or -1 */
+int uevent_open(void);
+
+/* Read one pending event from socket.
+ * Return 1 when block device event is read, 0 when other event is
+ * skipped or -1 when there are no more events */
+int uevent_read(int fd, struct uevent_t *ev);
+
+#endif /* _HAVE_UEVENT_H_ */
@@ -28,10 +28,18 @@
 #include <termios.h>
 #include <limits.h>		/* LONG_MAX, INT_MAX */
 #include <stdarg.h>		/* va_start/va_end */
+#include <time.h>
 
 #include "config.h"
 #include "util.h"
 
+#ifdef USE_SCAN_THREADS
+#include <pthread.h>
+
+/* Log is shared with device probing threads */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 
 /* Create charlist structure */
 struct charlist *create_charlist(int size)
@@ -79,6 +87,20 @@ void addto_charlist(struct charlist *cl, const char *str)
 }
 
 
+/* Remove no'th item from charlist structure */
+void delfrom_charlist(struct charlist *cl, int no)
+{
+	int i;
+
+	if (no < 0 || no >= cl->fill) return;
+
+	free(cl->list[no]);
+	for (i = no; i + 1 < cl->fill; i++)
+		cl->list[i] = cl->list[i + 1];
+	--cl->fill;
+}
+
+
 /* Search item in charlist structure */
 int in_charlist(struct charlist *cl, const char *str)
 {
@@ -93,6 +115,111 @@ int in_charlist(struct charlist *cl, const char *str)
 }
 
 
+/* FNV-1a hash of string */
+static unsigned int strset_hash(const char *str)
+{
+	unsigned int h = 2166136261U;
+
+	while (*str) {
+		h ^= (unsigned char)*str++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+/* Return slot of 'str' or free slot where it should be placed */
+static unsigned int strset_slot(char **table, unsigned int size,
+		const char *str)
+{
+	unsigned int i = strset_hash(str) & (size - 1);
+
+	while (table[i] && strcmp(table[i], str)) i = (i + 1) & (size - 1);
+	return i;
+}
+
+
+/* Allocate strset structure */
+struct strset *create_strset(unsigned int size)
+{
+	struct strset *s;
+	unsigned int n = 8;
+
+	/* Keep table half-empty */
+	while (n < size * 2) n <<= 1;
+
+	s = malloc(sizeof(*s));
+	if (NULL == s) return NULL;
+
+	s->table = calloc(n, sizeof(*(s->table)));
+	if (NULL == s->table) {
+		free(s);
+		return NULL;
+	}
+	s->size = n;
+	s->fill = 0;
+
+	return s;
+}
+
+
+/* Free strset structure */
+void free_strset(struct strset *s)
+{
+	unsigned int i;
+
+	if (NULL == s) return;
+
+	for (i = 0; i < s->size; i++)
+		dispose(s->table[i]);
+	free(s->table);
+	free(s);
+}
+
+
+/* Add item to strset structure */
+int addto_strset(struct strset *s, const char *str)
+{
+	unsigned int i, n;
+	char **new_table;
+
+	i = strset_slot(s->table, s->size, str);
+	if (s->table[i]) return 0;	/* Already here */
+	if (s->fill + 1 >= s->size) return -1;	/* Keep one free slot */
+
+	s->table[i] = strdup(str);
+	if (NULL == s->table[i]) return -1;
+	++s->fill;
+
+	/* Rehash when table is half-full */
+	if (s->fill * 2 < s->size) return 0;
+
+	new_table = calloc(s->size * 2, sizeof(*new_table));
+	if (NULL == new_table) {
+		DPRINTF("Can't resize string set");
+		return 0;	/* Still usable */
+	}
+
+	for (n = 0; n < s->size; n++) {
+		if (s->table[n])
+			new_table[strset_slot(new_table, s->size * 2, s->table[n])] =
+					s->table[n];
+	}
+	free(s->table);
+	s->table = new_table;
+	s->size *= 2;
+
+	return 0;
+}
+
+
+/* Search item in strset structure */
+int in_strset(struct strset *s, const char *str)
+{
+	return (NULL != s->table[strset_slot(s->table, s->size, str)]);
+}
+
+
 kx_text *log_open(unsigned int size)
 {
 	kx_text *log;
@@ -121,6 +248,10 @@ void log_msg(kx_text *log, char *fmt, ...)
 	static char *b, *e, buf[512];
 	static va_list ap;
 
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&log_mutex);
+#endif
+
 	/* Format string */
 	va_start(ap, fmt);
 	vsnprintf((char *)&buf, sizeof(buf), fmt, ap);
@@ -136,6 +267,49 @@ void log_msg(kx_text *log, char *fmt, ...)
 
 	/* Process latest part of string if any */
 	if (*b != '\0') log_plain_msg(log, b);
+
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_unlock(&log_mutex);
+#endif
+}
+
+/* Protect log from changes while it is read */
+void log_lock(void)
+{
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_lock(&log_mutex);
+#endif
+}
+
+void log_unlock(void)
+{
+#ifdef USE_SCAN_THREADS
+	pthread_mutex_unlock(&log_mutex);
+#endif
+}
+
+kx_text *log_copy(kx_text *log, unsigned int rows)
+{
+	kx_text *copy;
+	unsigned int i, fill;
+
+	copy = malloc(sizeof(*copy));
+	if (NULL == copy) return NULL;
+
+	log_lock();
+	fill = log->current_line_no + rows;
+	if (fill > log->rows->fill) fill = log->rows->fill;
+
+	copy->rows = create_charlist(fill + 1);
+	copy->current_line_no = log->current_line_no;
+	for (i = 0; i < fill; i++) {
+		copy->rows->list[i] = (i < log->current_line_no) ? NULL :
+				strdup(log->rows->list[i]);
+	}
+	copy->rows->fill = fill;
+	log_unlock();
+
+	return copy;
 }
 
 void log_close(kx_text *log)
@@ -235,7 +409,7 @@ char *ltrim(char *str)
 /* Get unsigned long-long integer */
 unsigned long long get_nnll(const char *str, char **endptr, int *error_flag)
 {
-	static unsigned long long val;
+	unsigned long long val;
 
 	errno = 0;
 	val = strtoull(str, endptr, 10);
@@ -262,8 +436,8 @@ unsigned long long get_nnll(const char *str, char **endptr, int *error_flag)
 /* Get non-negative integer */
 int get_nni(const char *str, char **endptr)
 {
-	static unsigned long long val;
-	static int eflag;
+	unsigned long long val;
+	int eflag;
 
 	eflag = 0;
 	val = get_nnll(str, endptr, &eflag);
@@ -283,6 +457,15 @@ int get_nni(const char *str, char **endptr)
 }
 
 
+unsigned long long msec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
 /*
  * Change terminal settings.
  * Mode: 1 - change; 0 - restore.
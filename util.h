@@ -66,6 +66,13 @@ struct charlist {
 	unsigned int fill;
 };
 
+/* Hashed set of strings */
+struct strset {
+	char **table;		/* Open addressing table, NULL is free slot */
+	unsigned int size;	/* Power of 2 */
+	unsigned int fill;
+};
+
 /* Text structure */
 typedef struct {
 	unsigned int current_line_no;
@@ -88,16 +95,40 @@ void free_charlist(struct charlist *cl);
 /* Append string 'str' to end of charlist 'cl' */
 void addto_charlist(struct charlist *cl, const char *str);
 
+/* Remove item 'no' from charlist 'cl' */
+void delfrom_charlist(struct charlist *cl, int no);
+
 /* Return position of string 'str' in charlist 'cl' or (-1) when not found */
 int in_charlist(struct charlist *cl, const char *str);
 
 
+/* Allocate strset structure for about 'size' items */
+struct strset *create_strset(unsigned int size);
+
+/* Destroy specified strset structure 's' */
+void free_strset(struct strset *s);
+
+/* Add copy of string 'str' to strset 's'. Return -1 on error */
+int addto_strset(struct strset *s, const char *str);
+
+/* Return 1 when string 'str' is in strset 's' or 0 otherwise */
+int in_strset(struct strset *s, const char *str);
+
+
 /* Create log structure of 'size' initial rows */
 kx_text *log_open(unsigned int size);
 
 /* Log message */
 void log_msg(kx_text *log, char *fmt, ...);
 
+/* Protect log from changes by probing threads while it is read */
+void log_lock(void);
+void log_unlock(void);
+
+/* Copy 'rows' rows of log from its current line under lock. Earlier rows
+ * are left NULL. Copy may be drawn while threads are logging */
+kx_text *log_copy(kx_text *log, unsigned int rows);
+
 /* Destroy log structure */
 void log_close(kx_text *log);
 
@@ -131,6 +162,9 @@ int get_nni(const char *str, char **endptr);
 /* Return unsigned long long from string 'str' and end of number in 'endptr' */
 unsigned long long get_nnll(const char *str, char **endptr, int *error_flag);
 
+/* Return milliseconds of monotonic clock */
+unsigned long long msec_now(void);
+
 /* Change terminal settings */
 void setup_terminal(char *ttydev, int *echo_state, int mode);
 
@@ -56,8 +56,34 @@ void xpm_destroy_image(char **xpm_data, const int rows)
 }
 
 
-/* Load XPM image into array of strings */
-int xpm_load_image(char ***xpm_data, const char *filename)
+/* Read function of XPM data source */
+typedef int (*xpm_read_func)(void *src, char *buf, int len);
+
+static int xpm_read_fd(void *src, char *buf, int len)
+{
+	return read(*(int *)src, buf, len);
+}
+
+/* XPM data in memory */
+struct xpm_mem_t {
+	const char *data;
+	int left;
+};
+
+static int xpm_read_mem(void *src, char *buf, int len)
+{
+	struct xpm_mem_t *m = src;
+
+	if (len > m->left) len = m->left;
+	memcpy(buf, m->data, len);
+	m->data += len;
+	m->left -= len;
+	return len;
+}
+
+
+/* Load XPM image from 'src' into array of strings */
+static int xpm_load(char ***xpm_data, xpm_read_func rd, void *src)
 {
 	int in_comment = 0;	/* We are inside comment block */
 	int in_quotes = 0;	/* We are inside double quotes */
@@ -74,39 +100,14 @@ int xpm_load_image(char ***xpm_data, const char *filename)
 	unsigned int n = 0;
 	int fail = 0;	/* 1 = don't free data, 2 = free data */
 	int len, nr;
-	int f;
 	char **data = NULL, *p, *e, *tmp;
 	char *qstart = NULL, *qs;	/* Start and end of quoted string */
-	struct stat sb;
 	char buf[1500];	/* read() buffer */
 	/* Quoted string storage buffer */
 	char qsbuf[640 * 4 + 1];	/* (640 px max width * 4 chars per pixel + '\0') */
 
-	if (NULL == xpm_data) {
-		return -1;
-	}
-
-	f = open(filename, O_RDONLY);
-	if (f < 0) {
-		log_msg(lg, "Can't open %s: %s", filename, ERRMSG);
-		return -1;
-	}
-
-	if ( -1 == fstat(f, &sb) ) {
-		log_msg(lg, "Can't stat %s: %s", filename, ERRMSG);
-		close(f);
-		return -1;
-	}
-
-	/* Check file size */
-	if (sb.st_size > MAX_XPM_FILE_SIZE) {
-		log_msg(lg, "%s is too big (%d bytes)", filename, (int)sb.st_size);
-		close(f);
-		return -1;
-	}
-
 	qsbuf[0] = '\0';
-	while ( (nr = read(f, buf, sizeof(buf))) > 0 ) {
+	while ( (nr = rd(src, buf, sizeof(buf))) > 0 ) {
 		/* Parse block by chars */
 		e = buf + nr;	/* End of buffer */
 		for (p = buf; p < e; p++) {
@@ -250,7 +251,6 @@ int xpm_load_image(char ***xpm_data, const char *filename)
 		}
 
 	} /* while (read()) */
-	close(f);
 
 	/*
 	 * Now we can have one of following statuses:
@@ -277,6 +277,57 @@ int xpm_load_image(char ***xpm_data, const char *filename)
 }
 
 
+/* Load XPM image file into array of strings */
+int xpm_load_image(char ***xpm_data, const char *filename)
+{
+	int f, rows;
+	struct stat sb;
+
+	if (NULL == xpm_data) {
+		return -1;
+	}
+
+	f = open(filename, O_RDONLY);
+	if (f < 0) {
+		log_msg(lg, "Can't open %s: %s", filename, ERRMSG);
+		return -1;
+	}
+
+	if ( -1 == fstat(f, &sb) ) {
+		log_msg(lg, "Can't stat %s: %s", filename, ERRMSG);
+		close(f);
+		return -1;
+	}
+
+	/* Check file size */
+	if (sb.st_size > MAX_XPM_FILE_SIZE) {
+		log_msg(lg, "%s is too big (%d bytes)", filename, (int)sb.st_size);
+		close(f);
+		return -1;
+	}
+
+	rows = xpm_load(xpm_data, xpm_read_fd, &f);
+	close(f);
+
+	return rows;
+}
+
+
+/* Load XPM image from memory into array of strings */
+int xpm_load_buffer(char ***xpm_data, const char *data, int len)
+{
+	struct xpm_mem_t m;
+
+	if ( (NULL == xpm_data) || (len > MAX_XPM_FILE_SIZE) ) {
+		return -1;
+	}
+
+	m.data = data;
+	m.left = len;
+	return xpm_load(xpm_data, xpm_read_mem, &m);
+}
+
+
 /* Local function to parse color line
  * NOTE: It will modify 'data'.
  */
@@ -89,6 +89,20 @@ void xpm_destroy_image(char **xpm_data, const int rows);
  */
 int xpm_load_image(char ***xpm_data, const char *filename);
 
+/*
+ * Function: xpm_load_buffer()
+ * Same as xpm_load_image() but XPM file contents is in memory.
+ * Args:
+ * - pointer to store address of XPM image data
+ * - XPM file contents
+ * - length of contents
+ * Return value:
+ * - rows count of xpm image data
+ * - -1 on error
+ * xpm_data should be destroyed with xpm_destroy_image()
+ */
+int xpm_load_buffer(char ***xpm_data, const char *data, int len);
+
 /*
  * Function: xpm_parse_image()
  * Process XPM image data and make it 'drawable'.